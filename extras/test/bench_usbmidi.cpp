@@ -0,0 +1,562 @@
+// Throughput and latency of the library on the simulated bus. Times are
+// simulated: messages per second of bus time, latency from the moment a
+// message is handed over (send call or host queue) to when the other side
+// has it. --check fails on any lost message or on figures far off the
+// expected ones.
+//
+// The second table is host CPU time per message spent in library calls
+// (the simulated bus excluded): rough figures for comparing two versions
+// or two code paths on the same machine, printed only, never checked.
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string.h>
+#include "check.h"
+#include "USBMIDIClock.h"
+
+struct Result {
+    const char* name;
+    double rate;               // Messages per simulated second
+    std::vector<uint32_t> latency;
+    uint32_t refused;          // Send calls turned away (back-pressure)
+    uint32_t lost;             // Accepted but never delivered
+};
+
+static std::vector<Result> results;
+static std::vector<std::string> notes;     // Printed under the table
+
+struct CpuResult {
+    const char* name;
+    double ns;                 // Host CPU nanoseconds per message
+};
+
+static std::vector<CpuResult> cpuResults;
+
+typedef std::chrono::steady_clock HostClock;
+static double nsSince(HostClock::time_point start) {
+    return std::chrono::duration<double, std::nano>(HostClock::now() - start).count();
+}
+
+static uint32_t percentile(std::vector<uint32_t>& v, double p) {
+    if(v.empty()) return 0;
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static double mean(const std::vector<uint32_t>& v) {
+    double sum = 0;
+    for(uint32_t x : v) sum += x;
+    return v.empty() ? 0 : sum / v.size();
+}
+
+// Sequence number <-> Control Change, 18 bits: channel, value, controller
+static uint32_t seqPacket(uint32_t seq) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | ((seq >> 14) & 0x0F), seq & 0x7F, (seq >> 7) & 0x7F);
+}
+static uint32_t packetSeq(uint32_t packet) {
+    return ((USB_MIDI_BYTE(packet, 1) & 0x0F) << 14) | (USB_MIDI_BYTE(packet, 3) << 7) | USB_MIDI_BYTE(packet, 2);
+}
+
+static const uint32_t MAX_SEQ = 1u << 18;
+static std::vector<uint32_t> sentAt, gotAt;
+
+// Device -> host, the main loop sending as fast as the FIFO takes it
+static void benchTxSaturated() {
+    Result r = { "tx, saturated", 0, {}, 0, 0 };
+    start_device();
+    sentAt.assign(MAX_SEQ, 0);
+    const uint32_t duration = 200000;
+    uint32_t start = sim_time_us(), seq = 0;
+    while(sim_time_us() - start < duration && seq < MAX_SEQ) {
+        uint32_t packet = seqPacket(seq);
+        sentAt[seq] = sim_time_us();
+        if(USB_write(&packet, 1)) seq++;
+        else r.refused++;
+        sim_run_us(1);          // Rest of loop()
+    }
+    sim_run_us(5000);
+    uint32_t words[64], times[64], n, received = 0;
+    while((n = sim_host_read(words, times, 64)) > 0) {
+        for(uint32_t i = 0; i < n; i++, received++) {
+            uint32_t s = packetSeq(words[i]);
+            if(s != received) continue; // Counted as lost below
+            r.latency.push_back(times[i] - sentAt[s]);
+        }
+    }
+    r.lost = seq - (uint32_t)r.latency.size();
+    r.rate = received * 1e6 / duration;
+    results.push_back(r);
+}
+
+static uint32_t delivered;
+static void onControl(uint8_t channel, uint8_t control, uint8_t value) {
+    uint32_t seq = ((uint32_t)channel << 14) | ((uint32_t)value << 7) | control;
+    if(seq < MAX_SEQ && !gotAt[seq]) {
+        gotAt[seq] = sim_time_us() + 1;
+        delivered++;
+    }
+}
+
+// Host -> device with the host keeping EP2 OUT busy and loop() polling
+static void benchRxSaturated() {
+    Result r = { "rx, saturated", 0, {}, 0, 0 };
+    start_device();
+    USBMIDI.setHandleControlChange(onControl);
+    sentAt.assign(MAX_SEQ, 0);
+    gotAt.assign(MAX_SEQ, 0);
+    delivered = 0;
+    const uint32_t duration = 200000;
+    uint32_t start = sim_time_us(), seq = 0;
+    while(sim_time_us() - start < duration) {
+        while(sim_host_out_pending() < 64 && seq < MAX_SEQ) {
+            uint32_t packet = seqPacket(seq);
+            sentAt[seq++] = sim_time_us();
+            sim_host_send(&packet, 1);
+        }
+        USBMIDI.poll();
+        sim_run_us(20);         // Rest of loop()
+    }
+    uint32_t inTime = delivered;
+    for(int i = 0; i < 100 && sim_host_out_pending(); i++) { USBMIDI.poll(); sim_run_us(100); }
+    USBMIDI.poll();
+    for(uint32_t s = 0; s < seq; s++) {
+        if(gotAt[s]) r.latency.push_back(gotAt[s] - 1 - sentAt[s]);
+    }
+    r.lost = seq - delivered;
+    r.rate = inTime * 1e6 / duration;
+    USBMIDI.setHandleControlChange(nullptr);
+    results.push_back(r);
+}
+
+// Sparse input while loop() is busy for 5 ms at a time, e.g. redrawing a
+// display: delivered by poll() between the busy spells, or by interrupt
+// dispatch as each transfer arrives
+static void benchRxBusyLoop(bool interruptDispatch) {
+    Result r = { interruptDispatch ? "rx, 5 ms loop, interrupt dispatch" : "rx, 5 ms loop, poll()",
+                 0, {}, 0, 0 };
+    start_device();
+    USBMIDI.setHandleControlChange(onControl);
+    USBMIDI.setInterruptDispatch(interruptDispatch);
+    gotAt.assign(MAX_SEQ, 0);
+    sentAt.assign(MAX_SEQ, 0);
+    delivered = 0;
+    uint32_t rng = 12345, seq = 0;
+    uint32_t next = sim_time_us() + 100;
+    const uint32_t messages = 2000;
+    while(seq < messages) {
+        USBMIDI.poll();
+        for(uint32_t busy = 0; busy < 5000; busy += 10) {
+            if(seq < messages && (int32_t)(sim_time_us() - next) >= 0) {
+                uint32_t packet = seqPacket(seq);
+                sentAt[seq++] = sim_time_us();
+                sim_host_send(&packet, 1);
+                rng = rng * 1103515245 + 12345;
+                next = sim_time_us() + 2000 + (rng >> 16) % 6000;
+            }
+            sim_run_us(10);
+        }
+    }
+    for(int i = 0; i < 20; i++) { USBMIDI.poll(); sim_run_us(1000); }
+    for(uint32_t s = 0; s < seq; s++) {
+        if(gotAt[s]) r.latency.push_back(gotAt[s] - 1 - sentAt[s]);
+    }
+    r.lost = seq - delivered;
+    r.rate = 0;
+    USBMIDI.setInterruptDispatch(false);
+    USBMIDI.setHandleControlChange(nullptr);
+    results.push_back(r);
+}
+
+// The packet queues alone: sendPacket() into the TX FIFO (including the
+// interrupt staging it into an IN half) and readPackets() out of the OUT
+// halves, 32 at a time with the bus run in between. The simulator's
+// preemption points at each queue index access are part of the figure.
+static void benchQueues() {
+    start_device();
+    const uint32_t rounds = 5000;
+    double txNs = 0, rxNs = 0;
+    uint32_t sent = 0, read = 0;
+    uint32_t packets[32];
+    for(uint32_t i = 0; i < 32; i++) packets[i] = seqPacket(i);
+    for(uint32_t round = 0; round < rounds; round++) {
+        HostClock::time_point start = HostClock::now();
+        for(uint32_t i = 0; i < 32; i++) {
+            sent += USBMIDI.sendPacket(0x0B, USB_MIDI_BYTE(packets[i], 1), USB_MIDI_BYTE(packets[i], 2),
+                                       USB_MIDI_BYTE(packets[i], 3));
+        }
+        txNs += nsSince(start);
+        sim_host_send(packets, 32);
+        sim_run_us(2000);
+        sim_host_clear();
+        uint32_t out[32];
+        start = HostClock::now();
+        read += USBMIDI.readPackets(out, 32);
+        rxNs += nsSince(start);
+    }
+    CHECK_EQ(sent, rounds * 32);
+    CHECK_EQ(read, rounds * 32);
+    cpuResults.push_back({ "sendPacket(), queue and stage", txNs / sent });
+    cpuResults.push_back({ "readPackets(), 32 per call", rxNs / read });
+}
+
+// Receive dispatch, callback pointers against a compile-time handler set:
+// 32 Control Changes per poll(), only the poll() call timed
+struct ControlCounter : USBMIDIHandlers {
+    uint32_t count = 0;
+    void onControlChange(uint8_t cable, uint8_t channel, uint8_t control, uint8_t value) {
+        (void)cable; (void)channel; (void)control; (void)value;
+        count++;
+    }
+};
+
+static uint32_t controlCount;
+static void onControlCount(uint8_t channel, uint8_t control, uint8_t value) {
+    (void)channel; (void)control; (void)value;
+    controlCount++;
+}
+
+static void benchDispatch(bool handlerSet) {
+    start_device();
+    USBMIDI.setHandleControlChange(handlerSet ? nullptr : onControlCount);
+    ControlCounter counter;
+    controlCount = 0;
+    uint32_t packets[32];
+    for(uint32_t i = 0; i < 32; i++) packets[i] = seqPacket(i);
+    const uint32_t rounds = 5000;
+    double ns = 0;
+    for(uint32_t round = 0; round < rounds; round++) {
+        sim_host_send(packets, 32);
+        sim_run_us(2000);
+        HostClock::time_point start = HostClock::now();
+        if(handlerSet) USBMIDI.poll(counter);
+        else USBMIDI.poll();
+        ns += nsSince(start);
+    }
+    CHECK_EQ(handlerSet ? counter.count : controlCount, rounds * 32);
+    cpuResults.push_back({ handlerSet ? "poll(handlers), Control Change" : "poll(), callback, Control Change",
+                           ns / (rounds * 32) });
+    USBMIDI.setHandleControlChange(nullptr);
+}
+
+// A control surface flooding the bus: each fader (CC 16-31 on channels
+// 1-4) moves a step every 25 us of loop(), several times what the bus
+// carries, then stops on a final position. The FIFO holds 56 distinct
+// controls besides the Note Off reserve, so 64 faders overflow it.
+// Latency is the staleness of each value the host gets: how long ago the
+// surface set it. The note compares bytes sent with the changes made, and
+// counts faders whose final position never reached the host.
+static void benchFaderSweep(uint8_t faders, bool coalescing) {
+    Result r = { faders == 32 ? (coalescing ? "32 faders, coalescing" : "32 faders, no coalescing")
+                              : (coalescing ? "64 faders, coalescing" : "64 faders, no coalescing"),
+                 0, {}, 0, 0 };
+    start_device();
+    USBMIDI.setCoalescing(coalescing);
+    static uint32_t setAt[64][128];
+    uint8_t hostValue[64];
+    memset(setAt, 0, sizeof(setAt));
+    memset(hostValue, 0xFF, sizeof(hostValue));
+    uint32_t changes = 0, words = 0;
+    auto drain = [&]() {
+        uint32_t got[64], times[64], n;
+        while((n = sim_host_read(got, times, 64)) > 0) {
+            for(uint32_t i = 0; i < n; i++, words++) {
+                uint8_t channel = USB_MIDI_BYTE(got[i], 1) & 0x0F, control = USB_MIDI_BYTE(got[i], 2);
+                uint8_t value = USB_MIDI_BYTE(got[i], 3);
+                if((USB_MIDI_BYTE(got[i], 1) & 0xF0) != 0xB0 || channel >= 4 || control < 16 || control >= 32) continue;
+                uint8_t fader = channel * 16 + control - 16;
+                r.latency.push_back(times[i] - setAt[fader][value]);
+                hostValue[fader] = value;
+            }
+        }
+    };
+    auto move = [&](uint8_t fader, uint8_t value) {
+        changes++;
+        uint32_t now = sim_time_us();
+        if(USBMIDI.sendPacket(0x0B, 0xB0 | (fader / 16), 16 + fader % 16, value)) setAt[fader][value] = now;
+        else r.refused++;
+    };
+    const uint32_t duration = 200000;
+    uint32_t start = sim_time_us();
+    for(uint32_t step = 0; sim_time_us() - start < duration; step++) {
+        for(uint8_t f = 0; f < faders; f++) move(f, (step + f * 2) & 0x7F);
+        sim_run_us(25);
+        drain();
+    }
+    for(uint8_t f = 0; f < faders; f++) move(f, 127 - f);
+    sim_run_us(5000);
+    drain();
+    uint32_t stale = 0;
+    for(uint8_t f = 0; f < faders; f++) stale += hostValue[f] != 127 - f;
+    r.rate = words * 1e6 / (sim_time_us() - start);
+    char line[160];
+    snprintf(line, sizeof(line), "%s: %u changes, %u bytes sent (%.2f per change), %u faders stale at the end",
+             r.name, changes, words * 4, words * 4.0 / changes, stale);
+    notes.push_back(line);
+    if(coalescing && faders == 32) {
+        CHECK_EQ(stale, 0);
+        CHECK_EQ(r.refused, 0);
+    }
+    USBMIDI.setCoalescing(false);
+    results.push_back(r);
+}
+
+// Outgoing clock at 120 BPM for two seconds while loop() keeps the TX FIFO
+// full of Control Changes. The ticks go through the realtime lane
+// (sendRealTime), through the FIFO behind the flood (sendPacket with CIN F,
+// tried before the flood refills it and retried while refused), or from
+// the clock generator, which schedules them
+// on the USB frame clock. Latency is the jitter: how far each interval
+// between ticks at the host is from the tick period.
+enum ClockPath { CLOCK_LANE, CLOCK_FIFO, CLOCK_GENERATOR };
+
+static void benchClockUnderFlood(ClockPath path) {
+    Result r = { path == CLOCK_LANE ? "clock under CC flood, realtime lane"
+               : path == CLOCK_FIFO ? "clock under CC flood, in the FIFO" : "clock under CC flood, generator",
+                 0, {}, 0, 0 };
+    start_device();
+    USBMIDIClockGenerator generator;
+    generator.setTempo(120);
+    const double period = 2500000.0 / 120;
+    const uint32_t duration = 2000000;
+    uint32_t start = sim_time_us(), seq = 0, sent = 0, received = 0, lastTick = 0;
+    double next = start + 1000;
+    std::vector<double> dueAt;                  // When each tick was due (not for the generator)
+    double delaySum = 0, delayMax = 0;
+    bool pending = false;
+    if(path == CLOCK_GENERATOR) generator.start();
+    while(sim_time_us() - start < duration) {
+        if(path == CLOCK_GENERATOR) {
+            generator.update();
+        } else {
+            if(sim_time_us() >= next) {
+                pending = true;
+                dueAt.push_back(next);
+                next += period;
+                sent++;
+            }
+            if(pending && path == CLOCK_LANE) {
+                USBMIDI.sendRealTime(0xF8);
+                pending = false;
+            } else if(pending) {
+                if(USBMIDI.sendPacket(0x0F, 0xF8, 0, 0)) pending = false;
+                else r.refused++;
+            }
+        }
+        uint32_t p = seqPacket(seq & 0x3FFF);
+        while(USBMIDI.sendPacket(0x0B, USB_MIDI_BYTE(p, 1), USB_MIDI_BYTE(p, 2), USB_MIDI_BYTE(p, 3))) {
+            p = seqPacket(++seq & 0x3FFF);
+        }
+        sim_run_us(20);
+        uint32_t words[64], times[64], n;
+        while((n = sim_host_read(words, times, 64)) > 0) {
+            for(uint32_t i = 0; i < n; i++) {
+                if(words[i] != USB_MIDI_PACKET(0x0F, 0xF8, 0, 0)) continue;
+                if(received < dueAt.size()) {
+                    double delay = times[i] - dueAt[received];
+                    delaySum += delay;
+                    if(delay > delayMax) delayMax = delay;
+                }
+                if(received++) {
+                    double deviation = (double)(times[i] - lastTick) - period;
+                    r.latency.push_back((uint32_t)(deviation < 0 ? -deviation : deviation));
+                }
+                lastTick = times[i];
+            }
+        }
+    }
+    if(path == CLOCK_GENERATOR) {
+        generator.stop();
+        sent = generator.ticks();
+    }
+    r.lost = sent > received + 1 ? sent - received - 1 : 0; // The last may still be on its way
+    if(!dueAt.empty()) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s: ticks reach the host %.0f us after they are due on average, %.0f at most",
+                 r.name, delaySum / received, delayMax);
+        notes.push_back(line);
+    }
+    results.push_back(r);
+}
+
+// SysEx throughput in bytes, against 3 bytes per packet at the saturated
+// packet rate of the same direction (the most USB-MIDI can carry)
+static void noteSysExRate(const Result& r, const Result& saturated) {
+    char line[128];
+    snprintf(line, sizeof(line), "%s: %.0f KB/s, %.0f%% of the %s packet rate", r.name, r.rate * 256 / 1000,
+             100 * r.rate * 256 / (3 * saturated.rate), saturated.name);
+    notes.push_back(line);
+}
+
+// SysEx of 256 bytes (86 packets) back to back, device to host: sendSysEx()
+// blocks while the FIFO is full, so the bus sets the pace. Latency runs
+// from the call to the host having the last packet.
+static void benchSysExTx() {
+    Result r = { "sysex tx, 256 bytes", 0, {}, 0, 0 };
+    start_device();
+    uint8_t message[256];
+    for(uint32_t i = 0; i < 256; i++) message[i] = i == 0 ? 0xF0 : i == 255 ? 0xF7 : i & 0x7F;
+    const uint32_t duration = 200000;
+    std::vector<uint32_t> calledAt;
+    uint32_t start = sim_time_us(), done = 0, inMessage = 0, received = 0;
+    auto drain = [&]() {
+        uint32_t words[64], times[64], n;
+        while((n = sim_host_read(words, times, 64)) > 0) {
+            for(uint32_t i = 0; i < n; i++) {
+                inMessage++;
+                if((words[i] & 0x0F) == 0x04) continue;
+                if(inMessage == 86 && done < calledAt.size()) {
+                    r.latency.push_back(times[i] - calledAt[done]);
+                    if(times[i] - start < duration) received++;
+                }
+                done++;
+                inMessage = 0;
+            }
+        }
+    };
+    while(sim_time_us() - start < duration) {
+        uint32_t now = sim_time_us();
+        if(USBMIDI.sendSysEx(message, sizeof(message))) calledAt.push_back(now);
+        else r.refused++;
+        drain();
+    }
+    sim_run_us(5000);
+    drain();
+    r.lost = (uint32_t)(calledAt.size() - r.latency.size());
+    r.rate = received * 1e6 / duration;
+    noteSysExRate(r, results[0]);
+    results.push_back(r);
+}
+
+// The same messages host to device, the host keeping EP2 OUT busy and
+// loop() polling with a chunk callback; latency from the host queueing the
+// first packet to the callback seeing the last
+static std::vector<uint32_t> sysexDoneAt;
+static uint32_t sysexBytes, sysexBad;
+static void onSysExChunk(const uint8_t* data, uint8_t length, bool last) {
+    (void)data;
+    sysexBytes += length;
+    if(!last) return;
+    if(sysexBytes != 256) sysexBad++;
+    sysexBytes = 0;
+    sysexDoneAt.push_back(sim_time_us());
+}
+
+static void benchSysExRx() {
+    Result r = { "sysex rx, 256 bytes", 0, {}, 0, 0 };
+    start_device();
+    USBMIDI.setHandleSysExChunk(onSysExChunk);
+    sysexDoneAt.clear();
+    sysexBytes = sysexBad = 0;
+    uint8_t message[256];
+    for(uint32_t i = 0; i < 256; i++) message[i] = i == 0 ? 0xF0 : i == 255 ? 0xF7 : i & 0x7F;
+    uint32_t packets[86];
+    for(uint32_t i = 0, k = 0; i < 256; i += 3, k++) {
+        uint32_t left = 256 - i;
+        uint8_t cin = left > 3 ? 0x04 : (uint8_t)(0x04 + left);
+        packets[k] = USB_MIDI_PACKET(cin, message[i], left > 1 ? message[i + 1] : 0, left > 2 ? message[i + 2] : 0);
+    }
+    const uint32_t duration = 200000;
+    std::vector<uint32_t> queuedAt;
+    uint32_t start = sim_time_us();
+    while(sim_time_us() - start < duration) {
+        if(sim_host_out_pending() < 64) {
+            queuedAt.push_back(sim_time_us());
+            sim_host_send(packets, 86);
+        }
+        USBMIDI.poll();
+        sim_run_us(20);
+    }
+    uint32_t inTime = (uint32_t)sysexDoneAt.size();
+    for(int i = 0; i < 100 && sim_host_out_pending(); i++) { USBMIDI.poll(); sim_run_us(100); }
+    USBMIDI.poll();
+    for(size_t m = 0; m < sysexDoneAt.size() && m < queuedAt.size(); m++) {
+        r.latency.push_back(sysexDoneAt[m] - queuedAt[m]);
+    }
+    r.lost = (uint32_t)(queuedAt.size() - sysexDoneAt.size()) + sysexBad;
+    r.rate = inTime * 1e6 / duration;
+    noteSysExRate(r, results[1]);
+    USBMIDI.setHandleSysExChunk(nullptr);
+    results.push_back(r);
+}
+
+// USBMIDITransform::apply with every stage set
+static void benchTransform() {
+    USBMIDITransform t;
+    t.filter(0xFFFF & ~0x0200, USBMIDITransform::NOTES);
+    t.remapChannel(1, 2);
+    t.keyZone(0, 47, 3);
+    t.transpose(5);
+    t.velocityCurve(0.7f);
+    t.mapControl(1, 74);
+    std::vector<uint32_t> packets;
+    uint32_t rng = 1;
+    for(int i = 0; i < 4096; i++) {
+        rng = rng * 1103515245 + 12345;
+        uint8_t cin = (rng >> 28) & 1 ? 0x09 : 0x0B;
+        packets.push_back(USB_MIDI_PACKET(cin, (cin << 4) | ((rng >> 16) & 0x0F), (rng >> 8) & 0x7F, rng & 0x7F));
+    }
+    const int rounds = 2000;
+    uint32_t kept = 0;
+    HostClock::time_point start = HostClock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(uint32_t p : packets) kept += t.apply(p);
+    }
+    double ns = nsSince(start);
+    CHECK(kept > 0);
+    cpuResults.push_back({ "transform, all stages", ns / (rounds * packets.size()) });
+}
+
+int main(int argc, char** argv) {
+    bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+
+    benchTxSaturated();
+    benchRxSaturated();
+    benchRxBusyLoop(false);
+    benchRxBusyLoop(true);
+    benchSysExTx();
+    benchSysExRx();
+    benchFaderSweep(32, false);
+    benchFaderSweep(32, true);
+    benchFaderSweep(64, true);
+    benchClockUnderFlood(CLOCK_LANE);
+    benchClockUnderFlood(CLOCK_FIFO);
+    benchClockUnderFlood(CLOCK_GENERATOR);
+    benchQueues();
+    benchDispatch(false);
+    benchDispatch(true);
+    benchTransform();
+
+    printf("%-36s %9s %7s %7s %7s %7s %7s %8s %5s\n",
+           "", "msgs/s", "mean", "p50", "p90", "p99", "max", "refused", "lost");
+    for(Result& r : results) {
+        double m = mean(r.latency);
+        printf("%-36s %9.0f %7.0f %7u %7u %7u %7u %8u %5u\n", r.name, r.rate, m,
+               percentile(r.latency, 0.5), percentile(r.latency, 0.9),
+               percentile(r.latency, 0.99), percentile(r.latency, 1.0), r.refused, r.lost);
+    }
+    printf("(latency in microseconds of simulated time)\n");
+    for(std::string& note : notes) printf("%s\n", note.c_str());
+    printf("\n");
+    printf("%-36s %9s\n", "", "ns/msg");
+    for(CpuResult& r : cpuResults) printf("%-36s %9.1f\n", r.name, r.ns);
+    printf("(host CPU time in library calls)\n");
+
+    if(!check) return 0;
+    for(Result& r : results) CHECK_EQ(r.lost, 0);
+    // A full-speed bus moves at most 19 transfers of 16 packets per frame
+    CHECK(results[0].rate > 150000);
+    CHECK(results[1].rate > 100000);
+    CHECK(mean(results[2].latency) > 1500);
+    CHECK(percentile(results[3].latency, 0.99) < 500);
+    // SysEx fills the packets the bus carries: 3 bytes each, 86 per message
+    CHECK(results[4].rate * 86 > results[0].rate * 0.9);
+    CHECK(results[5].rate * 86 > results[1].rate * 0.9);
+    // Clock under a flood: the lane keeps ticks within a bus slot or two of
+    // their spacing, the generator within one frame
+    CHECK(percentile(results[9].latency, 1.0) < 100);
+    CHECK(percentile(results[11].latency, 1.0) <= 1000);
+    return check_report("bench_usbmidi");
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Checks and device setup shared by the host tests
+
+#include <stdio.h>
+#include "USBMIDI.h"
+#include "usbfs_sim.h"
+
+static int checks_run = 0;
+static int checks_failed = 0;
+
+#define CHECK(cond) do { \
+    checks_run++; \
+    if(!(cond)) { checks_failed++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } \
+} while(0)
+
+#define CHECK_EQ(a, b) do { \
+    long long a_ = (long long)(a), b_ = (long long)(b); \
+    checks_run++; \
+    if(a_ != b_) { \
+        checks_failed++; \
+        printf("%s:%d: %s == %s failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, a_, b_); \
+    } \
+} while(0)
+
+static int check_report(const char* name) {
+    printf("%s: %d checks, %d failed\n", name, checks_run, checks_failed);
+    return checks_failed ? 1 : 0;
+}
+
+// Fresh simulator, library started and enumerated on the given setting,
+// with the connection event already seen by poll()
+static void start_device(uint8_t alt = 0) {
+    sim_init();
+    USBMIDI.begin();
+    CHECK_EQ(sim_host_attach(alt), 0);
+    USBMIDI.poll();
+    USBMIDI.resetStats();
+}
+
+// Host side: the next word received, or 0 if none
+static uint32_t host_next() {
+    uint32_t word = 0;
+    return sim_host_read(&word, nullptr, 1) ? word : 0;
+}
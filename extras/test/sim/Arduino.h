@@ -0,0 +1,35 @@
+#pragma once
+
+// Minimal Arduino core for the host simulator: time comes from the
+// simulated clock, and each call moves it on by a microsecond so that
+// busy-wait loops in the library make progress.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "ch32x035.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned long millis(void);
+unsigned long micros(void);
+
+#ifdef __cplusplus
+}
+
+class Stream {
+public:
+    virtual ~Stream() {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+        size_t n = 0;
+        while(n < size && write(buffer[n])) n++;
+        return n;
+    }
+    virtual int availableForWrite() { return 0; }
+};
+#endif
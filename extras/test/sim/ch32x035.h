@@ -0,0 +1,100 @@
+#pragma once
+
+// Host stand-in for the CH32X035 device header: the registers the library
+// touches, backed by plain structs that usbfs_sim.c drives.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO volatile
+
+typedef struct {
+    __IO uint8_t  BASE_CTRL;
+    __IO uint8_t  UDEV_CTRL;
+    __IO uint8_t  INT_EN;
+    __IO uint8_t  DEV_ADDR;
+    __IO uint8_t  R0;
+    __IO uint8_t  MIS_ST;
+    __IO uint8_t  INT_FG;
+    __IO uint8_t  INT_ST;
+    __IO uint16_t RX_LEN;
+    __IO uint16_t R1;
+    __IO uint8_t  UEP4_1_MOD;
+    __IO uint8_t  UEP2_3_MOD;
+    __IO uint8_t  UEP5_6_MOD;
+    __IO uint8_t  UEP7_MOD;
+    __IO uint32_t UEP0_DMA;
+    __IO uint32_t UEP1_DMA;
+    __IO uint32_t UEP2_DMA;
+    __IO uint32_t UEP3_DMA;
+    __IO uint16_t UEP0_TX_LEN;
+    __IO uint16_t UEP0_CTRL_H;
+    __IO uint16_t UEP1_TX_LEN;
+    __IO uint16_t UEP1_CTRL_H;
+    __IO uint16_t UEP2_TX_LEN;
+    __IO uint16_t UEP2_CTRL_H;
+} USBFS_TypeDef;
+
+// CTLR: STE 0x01, STIE 0x02, STCLK 0x04 (HCLK, else HCLK/8), STRE 0x08
+// (count 0..CMP then restart at 0). CNT is refreshed by the simulator
+// whenever simulated time moves.
+typedef struct {
+    __IO uint32_t CTLR;
+    __IO uint32_t SR;
+    __IO uint32_t CNT;
+    uint32_t      RESERVED0;
+    __IO uint32_t CMP;
+    uint32_t      RESERVED1;
+} SysTick_Type;
+
+typedef struct { __IO uint32_t CTLR; } AFIO_TypeDef;
+typedef struct { __IO uint32_t CFGLR; } GPIO_TypeDef;
+
+extern USBFS_TypeDef sim_usbfs;
+extern SysTick_Type  sim_systick;
+extern AFIO_TypeDef  sim_afio;
+extern GPIO_TypeDef  sim_gpioc;
+extern uint32_t      SystemCoreClock;
+
+#define USBFSD  (&sim_usbfs)
+#define SysTick (&sim_systick)
+#define AFIO    (&sim_afio)
+#define GPIOC   (&sim_gpioc)
+
+typedef enum {
+    Software_IRQn = 14,
+    USBFS_IRQn    = 45
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPendingIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint8_t priority);
+
+#define __NOP() do {} while(0)
+
+typedef enum { DISABLE = 0, ENABLE = 1 } FunctionalState;
+
+#define RCC_APB2Periph_AFIO   0x00000001
+#define RCC_APB2Periph_GPIOC  0x00000010
+#define RCC_AHBPeriph_USBFS   0x00001000
+void RCC_APB2PeriphClockCmd(uint32_t periph, FunctionalState state);
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state);
+
+#define GPIO_Pin_16           0x00010000
+#define GPIO_Pin_17           0x00020000
+#define GPIO_Mode_IN_FLOATING 0x04
+#define GPIO_Mode_IPU         0x48
+typedef struct {
+    uint32_t GPIO_Pin;
+    uint32_t GPIO_Speed;
+    uint32_t GPIO_Mode;
+} GPIO_InitTypeDef;
+void GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,546 @@
+#include "usbfs_sim.h"
+#include "wch_usbmidi_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+USBFS_TypeDef sim_usbfs;
+SysTick_Type  sim_systick;
+AFIO_TypeDef  sim_afio;
+GPIO_TypeDef  sim_gpioc;
+uint32_t SystemCoreClock = SIM_CPU_MHZ * 1000000u;
+uint32_t sim_uid[3] = { 0x89ABCDEF, 0x01234567, 0x0BADCAFE };
+
+void USBFS_IRQHandler(void);
+void SW_Handler(void) __attribute__((weak)); // WCH_USBMIDI_RX_DEFERRED builds only
+
+#define US_CYCLES(us)   ((uint64_t)(us) * SIM_CPU_MHZ)
+#define FRAME_CYCLES    US_CYCLES(1000)
+#define SLOT0_CYCLES    US_CYCLES(20)    // First transaction after SOF
+#define PREEMPT_CYCLES  4
+#define ENTRY_CYCLES    12               // Interrupt entry, before the handler runs
+
+// Clock ----------------------------------------------------------------------
+
+static uint64_t now;
+static uint32_t systick_div;             // CPU cycles per SysTick count
+static uint32_t systick_reload;          // 0 = free running
+static uint64_t systick_start;           // Cycle CNT was cleared at
+static uint32_t jitter_max, jitter_state;
+
+static void set_now(uint64_t t) {
+    if(t < now) return;
+    now = t;
+    uint64_t ticks = (now - systick_start) / systick_div;
+    sim_systick.CNT = systick_reload ? (uint32_t)(ticks % systick_reload) : (uint32_t)ticks;
+}
+
+// Interrupts -----------------------------------------------------------------
+
+#define LEVEL_MAIN 0
+#define LEVEL_SW   1
+#define LEVEL_USB  2
+
+static int level;
+static int usb_enabled, usb_pend;
+static int sw_enabled, sw_pend;
+static uint8_t hw_flags;                 // INT_FG bits raised, not yet taken
+static uint8_t hw_st;                    // INT_ST of the pending transfer
+
+static void run_usb(void) {
+    int saved = level;
+    uint8_t taken = hw_flags;
+    set_now(now + ENTRY_CYCLES);
+    level = LEVEL_USB;
+    usb_pend = 0;
+    sim_usbfs.INT_FG = taken;
+    sim_usbfs.INT_ST = hw_st;
+    USBFS_IRQHandler();
+    // The handler clears each flag it handles; until it returns the
+    // transfer flag stays set and the SIE NAKs (INT_BUSY)
+    hw_flags &= ~taken;
+    sim_usbfs.INT_FG = hw_flags;
+    level = saved;
+}
+
+static void run_sw(void) {
+    int saved = level;
+    level = LEVEL_SW;
+    sw_pend = 0;
+    if(SW_Handler) SW_Handler();
+    level = saved;
+}
+
+static void dispatch(void) {
+    for(;;) {
+        int usb_wants = usb_pend || (hw_flags & sim_usbfs.INT_EN & 0x07);
+        if(usb_enabled && usb_wants && level < LEVEL_USB) run_usb();
+        else if(sw_enabled && sw_pend && level < LEVEL_SW) run_sw();
+        else break;
+    }
+}
+
+static void raise(uint8_t flag, uint8_t st) {
+    hw_flags |= flag;
+    if(flag & USBFS_UIF_TRANSFER) hw_st = st;
+}
+
+static int transfer_pending(void) {
+    return hw_flags & USBFS_UIF_TRANSFER;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    if(irq == USBFS_IRQn) usb_enabled = 1;
+    if(irq == Software_IRQn) sw_enabled = 1;
+    dispatch();
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    if(irq == USBFS_IRQn) usb_enabled = 0;
+    if(irq == Software_IRQn) sw_enabled = 0;
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type irq) {
+    if(irq == USBFS_IRQn) usb_pend = 1;
+    if(irq == Software_IRQn) sw_pend = 1;
+    dispatch();
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint8_t priority) {
+    (void)irq; (void)priority; // Fixed: USB over software interrupt
+}
+
+int sim_irq_enabled(IRQn_Type irq) {
+    return irq == USBFS_IRQn ? usb_enabled : sw_enabled;
+}
+
+int sim_in_irq(void) {
+    return level == LEVEL_USB ? USBFS_IRQn : level == LEVEL_SW ? Software_IRQn : 0;
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t periph, FunctionalState state) { (void)periph; (void)state; }
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state) { (void)periph; (void)state; }
+void GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init) { (void)port; (void)init; }
+
+// Host state -----------------------------------------------------------------
+
+typedef struct {
+    uint8_t len;
+    uint8_t raw;                         // Sent as is, never merged
+    uint8_t bytes[EP2_SIZE];
+} OutChunk;
+
+#define OUT_QUEUE 4096
+static OutChunk out_q[OUT_QUEUE];
+static uint32_t out_rd, out_wr;
+static OutChunk out_last;
+static uint8_t  out_tog, in_tog;
+
+static uint32_t* rx_words;
+static uint32_t* rx_times;
+static uint32_t  rx_count, rx_cap, rx_pos;
+
+static int attached, suspended, reading;
+static uint8_t  host_alt;
+static uint64_t frame_at;
+static uint32_t slot_next;
+static uint64_t slot_cycles;
+static SimHostStats hstats;
+
+typedef struct {
+    uint8_t  setup[8];
+    uint8_t* data;
+    uint16_t length;
+    uint16_t got;
+    uint8_t  stage;
+    int      result;
+} ControlJob;
+enum { CTRL_IDLE, CTRL_SETUP, CTRL_DATA_IN, CTRL_STATUS_OUT, CTRL_STATUS_IN, CTRL_DONE };
+static ControlJob ctrl;
+
+static void host_sof(void) {
+    hstats.frames++;
+    if(!(sim_usbfs.INT_EN & USBFS_UIE_DEV_SOF)) return;
+    if(transfer_pending()) hstats.sofLost++;
+    else raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_SOF);
+}
+
+static void host_control(void) {
+    uint16_t res;
+    if(transfer_pending()) { hstats.busyNaks++; return; }
+    switch(ctrl.stage) {
+        case CTRL_SETUP:
+            memcpy(wch_usbmidi_EP0_buffer, ctrl.setup, 8);
+            sim_usbfs.RX_LEN = 8;
+            raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_SETUP | 0);
+            if(ctrl.length == 0) ctrl.stage = CTRL_STATUS_IN;
+            else ctrl.stage = (ctrl.setup[0] & 0x80) ? CTRL_DATA_IN : CTRL_STATUS_IN;
+            break;
+        case CTRL_DATA_IN: {
+            res = sim_usbfs.UEP0_CTRL_H & USBFS_UEP_T_RES_MASK;
+            if(res == USBFS_UEP_T_RES_STALL) { ctrl.result = -1; ctrl.stage = CTRL_DONE; break; }
+            if(res != USBFS_UEP_T_RES_ACK) break;
+            uint16_t len = sim_usbfs.UEP0_TX_LEN;
+            for(uint16_t i = 0; i < len && ctrl.got < ctrl.length; i++) {
+                ctrl.data[ctrl.got++] = wch_usbmidi_EP0_buffer[i];
+            }
+            raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_IN | 0);
+            if(len < EP0_SIZE || ctrl.got >= ctrl.length) ctrl.stage = CTRL_STATUS_OUT;
+            break;
+        }
+        case CTRL_STATUS_OUT:
+            res = sim_usbfs.UEP0_CTRL_H & USBFS_UEP_R_RES_MASK;
+            if(res == USBFS_UEP_R_RES_STALL) { ctrl.result = -1; ctrl.stage = CTRL_DONE; break; }
+            if(res != USBFS_UEP_R_RES_ACK) break;
+            sim_usbfs.RX_LEN = 0;
+            raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_OUT | USBFS_UIS_TOG_OK | 0);
+            ctrl.result = ctrl.got;
+            ctrl.stage = CTRL_DONE;
+            break;
+        case CTRL_STATUS_IN:
+            res = sim_usbfs.UEP0_CTRL_H & USBFS_UEP_T_RES_MASK;
+            if(res == USBFS_UEP_T_RES_STALL) { ctrl.result = -1; ctrl.stage = CTRL_DONE; break; }
+            if(res != USBFS_UEP_T_RES_ACK) break;
+            raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_IN | 0);
+            ctrl.result = 0;
+            ctrl.stage = CTRL_DONE;
+            break;
+    }
+}
+
+static void host_bulk_out(void) {
+    if(transfer_pending()) { hstats.busyNaks++; return; }
+    if(!(sim_usbfs.UEP2_3_MOD & USBFS_UEP2_RX_EN)
+       || (sim_usbfs.UEP2_CTRL_H & USBFS_UEP_R_RES_MASK) != USBFS_UEP_R_RES_ACK) {
+        hstats.outNaks++;
+        return;
+    }
+    OutChunk* chunk = &out_q[out_rd % OUT_QUEUE];
+    uint8_t tog = (sim_usbfs.UEP2_CTRL_H & USBFS_UEP_R_TOG) ? 1 : 0;
+    uint8_t st = USBFS_UIS_TOKEN_OUT | 2;
+    if(tog == out_tog) {
+        // Double buffered: R_TOG picks the half the data lands in
+        memcpy(wch_usbmidi_EP2_buffer + tog * EP2_SIZE, chunk->bytes, chunk->len);
+        sim_usbfs.RX_LEN = chunk->len;
+        sim_usbfs.UEP2_CTRL_H ^= USBFS_UEP_R_TOG;
+        st |= USBFS_UIS_TOG_OK;
+    }
+    // A repeat (toggle mismatch) is ACKed too, without TOG_OK
+    out_last = *chunk;
+    out_rd++;
+    out_tog ^= 1;
+    hstats.outAcks++;
+    raise(USBFS_UIF_TRANSFER, st);
+}
+
+static void rx_log(uint32_t word) {
+    if(rx_count == rx_cap) {
+        rx_cap = rx_cap ? rx_cap * 2 : 4096;
+        rx_words = (uint32_t*)realloc(rx_words, rx_cap * sizeof(uint32_t));
+        rx_times = (uint32_t*)realloc(rx_times, rx_cap * sizeof(uint32_t));
+    }
+    rx_words[rx_count] = word;
+    rx_times[rx_count++] = (uint32_t)(now / SIM_CPU_MHZ);
+}
+
+static void host_bulk_in(void) {
+    if(transfer_pending()) { hstats.busyNaks++; return; }
+    if(!(sim_usbfs.UEP2_3_MOD & USBFS_UEP2_TX_EN)
+       || (sim_usbfs.UEP2_CTRL_H & USBFS_UEP_T_RES_MASK) != USBFS_UEP_T_RES_ACK) {
+        hstats.inNaks++;
+        return;
+    }
+    uint8_t tog = (sim_usbfs.UEP2_CTRL_H & USBFS_UEP_T_TOG) ? 1 : 0;
+    const uint8_t* src = wch_usbmidi_EP2_buffer + (2 + tog) * EP2_SIZE;
+    uint16_t len = sim_usbfs.UEP2_TX_LEN;
+    if(tog != in_tog) {
+        hstats.inToggleErrors++; // Looks like a repeat to the host: dropped
+    } else {
+        for(uint16_t i = 0; i + 4 <= len; i += 4) {
+            uint32_t word;
+            memcpy(&word, src + i, 4);
+            rx_log(word);
+        }
+        in_tog ^= 1;
+    }
+    sim_usbfs.UEP2_CTRL_H ^= USBFS_UEP_T_TOG;
+    hstats.inAcks++;
+    raise(USBFS_UIF_TRANSFER, USBFS_UIS_TOKEN_IN | 2);
+}
+
+static void host_transaction(uint32_t slot) {
+    if(ctrl.stage != CTRL_IDLE && ctrl.stage != CTRL_DONE) {
+        host_control();
+        return;
+    }
+    if(out_rd != out_wr && (!reading || (slot & 1))) host_bulk_out();
+    else if(reading) host_bulk_in();
+}
+
+// Play bus events due by until, taking the interrupts they raise
+static void play_events(uint64_t until) {
+    while(attached && !suspended) {
+        uint64_t t = frame_at + SLOT0_CYCLES + slot_next * slot_cycles;
+        int sof = t + slot_cycles > frame_at + FRAME_CYCLES;
+        if(sof) t = frame_at + FRAME_CYCLES;
+        if(t > until) break;
+        set_now(t);
+        if(sof) {
+            frame_at = t;
+            slot_next = 0;
+            host_sof();
+        } else {
+            host_transaction(slot_next++);
+        }
+        dispatch();
+    }
+}
+
+static void advance(uint64_t cycles) {
+    uint64_t target = now + cycles;
+    play_events(target);
+    set_now(target);
+    dispatch();
+}
+
+// Public ---------------------------------------------------------------------
+
+void sim_init(void) {
+    memset((void*)&sim_usbfs, 0, sizeof(sim_usbfs));
+    memset((void*)&sim_systick, 0, sizeof(sim_systick));
+    now = 0;
+    level = LEVEL_MAIN;
+    usb_enabled = usb_pend = sw_enabled = sw_pend = 0;
+    hw_flags = hw_st = 0;
+    jitter_max = 0;
+    attached = suspended = 0;
+    reading = 1;
+    host_alt = 0;
+    slot_cycles = US_CYCLES(50);
+    out_rd = out_wr = 0;
+    out_tog = in_tog = 0;
+    memset(&ctrl, 0, sizeof(ctrl));
+    memset(&hstats, 0, sizeof(hstats));
+    sim_host_clear();
+    sim_systick_config(1, SystemCoreClock / 1000);
+}
+
+void sim_systick_config(uint8_t hclk, uint32_t reload) {
+    sim_systick.CTLR = 0x01 | 0x02 | (hclk ? 0x04 : 0) | (reload ? 0x08 : 0);
+    sim_systick.CMP  = reload ? reload - 1 : 0xFFFFFFFF;
+    systick_div = hclk ? 1 : 8;
+    systick_reload = reload;
+    systick_start = now;
+    sim_systick.CNT = 0;
+}
+
+uint64_t sim_cycles(void) {
+    return now;
+}
+
+uint32_t sim_time_us(void) {
+    return (uint32_t)(now / SIM_CPU_MHZ);
+}
+
+void sim_run_us(uint32_t us) {
+    advance(US_CYCLES(us));
+}
+
+int sim_run_until(int (*done)(void), uint32_t timeout_us) {
+    uint64_t end = now + US_CYCLES(timeout_us);
+    while(!done()) {
+        if(now >= end) return 0;
+        advance(US_CYCLES(10));
+    }
+    return 1;
+}
+
+void sim_jitter(uint32_t max_cycles, uint32_t seed) {
+    jitter_max = max_cycles;
+    jitter_state = seed ? seed : 1;
+}
+
+void sim_preempt(void) {
+    uint64_t cycles = PREEMPT_CYCLES;
+    if(jitter_max) {
+        jitter_state ^= jitter_state << 13;
+        jitter_state ^= jitter_state >> 17;
+        jitter_state ^= jitter_state << 5;
+        cycles += jitter_state % (jitter_max + 1);
+    }
+    advance(cycles);
+}
+
+unsigned long micros(void) {
+    advance(US_CYCLES(1));
+    return (unsigned long)(now / SIM_CPU_MHZ);
+}
+
+unsigned long millis(void) {
+    advance(US_CYCLES(1));
+    return (unsigned long)(now / US_CYCLES(1000));
+}
+
+void sim_host_bus_reset(void) {
+    if(!(sim_usbfs.BASE_CTRL & USBFS_UC_DEV_PU_EN)) return; // Not attached
+    attached = 1;
+    suspended = 0;
+    sim_usbfs.MIS_ST &= ~USBFS_UMS_SUSPEND;
+    frame_at = now;
+    slot_next = 0;
+    out_rd = out_wr;
+    out_tog = in_tog = 0;
+    host_alt = 0;
+    memset(&ctrl, 0, sizeof(ctrl));
+    raise(USBFS_UIF_BUS_RST, 0);
+    advance(US_CYCLES(10));
+}
+
+void sim_host_suspend(void) {
+    suspended = 1;
+    sim_usbfs.MIS_ST |= USBFS_UMS_SUSPEND;
+    raise(USBFS_UIF_SUSPEND, 0);
+    advance(US_CYCLES(10));
+}
+
+void sim_host_resume(void) {
+    suspended = 0;
+    sim_usbfs.MIS_ST &= ~USBFS_UMS_SUSPEND;
+    frame_at = now;
+    slot_next = 0;
+    raise(USBFS_UIF_SUSPEND, 0);
+    advance(US_CYCLES(10));
+}
+
+static int control_done(void) {
+    return ctrl.stage == CTRL_DONE;
+}
+
+int sim_host_control(const uint8_t setup[8], uint8_t* data) {
+    if(!attached || suspended) return -1;
+    memcpy(ctrl.setup, setup, 8);
+    ctrl.data = data;
+    ctrl.length = setup[6] | (setup[7] << 8);
+    ctrl.got = 0;
+    ctrl.result = -1;
+    ctrl.stage = CTRL_SETUP;
+    if(!sim_run_until(control_done, 100000)) {
+        ctrl.stage = CTRL_IDLE;
+        return -1;
+    }
+    ctrl.stage = CTRL_IDLE;
+    return ctrl.result;
+}
+
+int sim_host_get_descriptor(uint8_t type, uint8_t index, uint8_t* data, uint16_t length) {
+    const uint8_t setup[8] = { 0x80, 0x06, index, type, 0, 0, (uint8_t)length, (uint8_t)(length >> 8) };
+    return sim_host_control(setup, data);
+}
+
+int sim_host_set_interface(uint8_t interface, uint8_t alt) {
+    const uint8_t setup[8] = { 0x01, 0x0B, alt, 0, interface, 0, 0, 0 };
+    int result = sim_host_control(setup, NULL);
+    if(result == 0) {
+        // The endpoints of the interface restart at DATA0
+        out_tog = in_tog = 0;
+        if(interface == 1) host_alt = alt;
+    }
+    return result;
+}
+
+int sim_host_attach(uint8_t alt) {
+    uint8_t buf[512];
+    sim_host_bus_reset();
+    if(!attached) return -1;
+    sim_run_us(2000);
+
+    if(sim_host_get_descriptor(USB_DESCR_TYP_DEVICE, 0, buf, 64) < 8) return -1;
+    const uint8_t set_address[8] = { 0x00, 0x05, 7, 0, 0, 0, 0, 0 };
+    if(sim_host_control(set_address, NULL) != 0) return -1;
+    if((sim_usbfs.DEV_ADDR & USBFS_USB_ADDR_MASK) != 7) return -1;
+    if(sim_host_get_descriptor(USB_DESCR_TYP_DEVICE, 0, buf, 18) != 18) return -1;
+    if(sim_host_get_descriptor(USB_DESCR_TYP_CONFIG, 0, buf, 9) != 9) return -1;
+    uint16_t total = buf[2] | (buf[3] << 8);
+    if(total > sizeof(buf) || sim_host_get_descriptor(USB_DESCR_TYP_CONFIG, 0, buf, total) != total) return -1;
+    for(uint8_t i = 0; i < 4; i++) {
+        if(sim_host_get_descriptor(USB_DESCR_TYP_STRING, i, buf, 255) < 2) return -1;
+    }
+    const uint8_t set_config[8] = { 0x00, 0x09, 1, 0, 0, 0, 0, 0 };
+    if(sim_host_control(set_config, NULL) != 0) return -1;
+    out_tog = in_tog = 0;
+    if(alt && sim_host_set_interface(1, alt) != 0) return -1;
+    return 0;
+}
+
+static OutChunk* out_tail_chunk(uint8_t room) {
+    if(out_wr != out_rd) {
+        OutChunk* last = &out_q[(out_wr - 1) % OUT_QUEUE];
+        if(!last->raw && last->len + room <= EP2_SIZE) return last;
+    }
+    if(out_wr - out_rd >= OUT_QUEUE) return NULL;
+    OutChunk* chunk = &out_q[out_wr++ % OUT_QUEUE];
+    chunk->len = 0;
+    chunk->raw = 0;
+    return chunk;
+}
+
+void sim_host_send(const uint32_t* words, uint32_t count) {
+    for(uint32_t i = 0; i < count;) {
+        uint8_t n = host_alt ? UMP_WORD_COUNT(words[i]) : 1;
+        if(i + n > count) n = count - i;
+        OutChunk* chunk = out_tail_chunk(n * 4);
+        if(!chunk) return;
+        memcpy(chunk->bytes + chunk->len, &words[i], n * 4);
+        chunk->len += n * 4;
+        i += n;
+    }
+}
+
+void sim_host_send_raw(const uint8_t* bytes, uint8_t length) {
+    if(out_wr - out_rd >= OUT_QUEUE) return;
+    OutChunk* chunk = &out_q[out_wr++ % OUT_QUEUE];
+    if(length > EP2_SIZE) length = EP2_SIZE;
+    memcpy(chunk->bytes, bytes, length);
+    chunk->len = length;
+    chunk->raw = 1;
+}
+
+void sim_host_resend_last(void) {
+    out_q[--out_rd % OUT_QUEUE] = out_last;
+    out_q[out_rd % OUT_QUEUE].raw = 1;
+    out_tog ^= 1;
+}
+
+uint32_t sim_host_out_pending(void) {
+    uint32_t words = 0;
+    for(uint32_t i = out_rd; i != out_wr; i++) words += out_q[i % OUT_QUEUE].len / 4;
+    return words;
+}
+
+void sim_host_reading(int on) {
+    reading = on;
+}
+
+uint32_t sim_host_received(void) {
+    return rx_count - rx_pos;
+}
+
+uint32_t sim_host_read(uint32_t* words, uint32_t* times, uint32_t max) {
+    uint32_t n = 0;
+    for(; n < max && rx_pos < rx_count; n++, rx_pos++) {
+        words[n] = rx_words[rx_pos];
+        if(times) times[n] = rx_times[rx_pos];
+    }
+    return n;
+}
+
+void sim_host_clear(void) {
+    rx_count = rx_pos = 0;
+}
+
+void sim_host_slot_us(uint32_t us) {
+    slot_cycles = US_CYCLES(us ? us : 1);
+}
+
+void sim_host_stats(SimHostStats* out) {
+    *out = hstats;
+}
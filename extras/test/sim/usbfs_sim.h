@@ -0,0 +1,106 @@
+#pragma once
+
+// Host simulator for the library: a model of the CH32X035 USBFS device
+// controller, SysTick and the interrupt controller, driven by a scripted
+// full-speed host on a simulated clock.
+//
+// Time only moves when the code under test lets it: through micros() and
+// millis(), at every queue index access in the handler (FIFO_LOAD and
+// FIFO_STORE, see usbfs_sim_config.h) or explicitly with sim_run_us(). Each
+// time it moves, bus events that fell due are played in order and the
+// interrupts they raise are taken at once, preempting whatever is running
+// if their priority allows (USB over the software interrupt over the main
+// loop). So interrupts land exactly at the points where the code publishes
+// or reads queue state, which is where races live.
+//
+// The host starts a frame with SOF every millisecond and then runs one bulk
+// transaction per slot (every 50 us by default, about what a full-speed bus
+// fits): OUT while it has data queued, alternating with IN polls while it is
+// reading. Like the hardware with INT_BUSY set, the device NAKs every token
+// while a transfer interrupt is still pending, and a SOF arriving then is
+// lost.
+
+#include <stdint.h>
+#include "ch32x035.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_CPU_MHZ 48
+
+// Back to power-on: time 0, registers clear, host detached, SysTick in the
+// Arduino core's setup (HCLK, auto-reload every millisecond)
+void sim_init(void);
+
+// SysTick setup: hclk selects HCLK over HCLK/8; reload 0 runs it free,
+// otherwise it counts 0..reload-1 and restarts. Counts from 0 at the time
+// of the call, so its phase to the USB frames is whatever that time makes it.
+void sim_systick_config(uint8_t hclk, uint32_t reload);
+
+// Simulated clock
+uint64_t sim_cycles(void);
+uint32_t sim_time_us(void);
+void sim_run_us(uint32_t us);
+// Run until done() returns nonzero or timeout_us passes; returns done()
+int sim_run_until(int (*done)(void), uint32_t timeout_us);
+
+// Preemption point: called by the handler's FIFO_LOAD/FIFO_STORE. Costs a
+// few cycles, plus a random amount while jitter is on, so interrupts land at
+// varying points of the code under test.
+void sim_preempt(void);
+void sim_jitter(uint32_t max_cycles, uint32_t seed);
+
+// Interrupt state, for tests that check masking
+int sim_irq_enabled(IRQn_Type irq);
+int sim_in_irq(void);               // 0 main loop, else the active IRQn
+
+// Scripted host --------------------------------------------------------------
+
+// Bus reset and full enumeration (device, configuration and string
+// descriptors, SET_ADDRESS, SET_CONFIGURATION), then SET_INTERFACE to alt
+// when it is not 0. Returns 0 on success.
+int sim_host_attach(uint8_t alt);
+void sim_host_bus_reset(void);
+void sim_host_suspend(void);
+void sim_host_resume(void);
+// Control transfer; data receives (IN) up to the setup's wLength bytes.
+// Returns the bytes transferred, or -1 on STALL or timeout.
+int sim_host_control(const uint8_t setup[8], uint8_t* data);
+int sim_host_get_descriptor(uint8_t type, uint8_t index, uint8_t* data, uint16_t length);
+int sim_host_set_interface(uint8_t interface, uint8_t alt);
+
+// Bulk OUT: words are queued and sent up to 16 per transaction; on the UMP
+// setting a message is never split across transactions
+void sim_host_send(const uint32_t* words, uint32_t count);
+// One OUT transaction of exactly these bytes (0-64), e.g. a torn packet
+void sim_host_send_raw(const uint8_t* bytes, uint8_t length);
+// Send the last OUT again with the same data toggle, as after a lost ACK
+void sim_host_resend_last(void);
+uint32_t sim_host_out_pending(void);  // Words not yet accepted by the device
+
+// Bulk IN: whether the host polls EP2 IN, and what it received, each word
+// with the simulated time (us) of its transaction
+void sim_host_reading(int on);
+uint32_t sim_host_received(void);
+uint32_t sim_host_read(uint32_t* words, uint32_t* times, uint32_t max);
+void sim_host_clear(void);
+
+// Bulk transaction spacing in microseconds (default 50)
+void sim_host_slot_us(uint32_t us);
+
+typedef struct {
+    uint32_t frames;       // SOFs sent
+    uint32_t sofLost;      // SOFs that arrived while a transfer was pending
+    uint32_t outAcks;      // OUT transactions the device took
+    uint32_t outNaks;
+    uint32_t inAcks;       // IN transactions that carried data
+    uint32_t inNaks;
+    uint32_t inToggleErrors; // IN data with the wrong toggle, discarded
+    uint32_t busyNaks;     // Tokens refused because an interrupt was pending
+} SimHostStats;
+void sim_host_stats(SimHostStats* out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+// Forced into every library source of the host build (-include): points the
+// pieces that only exist on the chip at the simulator.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern uint32_t sim_uid[3];
+void sim_preempt(void);
+#ifdef __cplusplus
+}
+#endif
+
+#define CH32X035_ESIG_UNIID1  ((uintptr_t)&sim_uid[0])
+#define CH32X035_ESIG_UNIID2  ((uintptr_t)&sim_uid[1])
+#define CH32X035_ESIG_UNIID3  ((uintptr_t)&sim_uid[2])
+
+#define WCH_USBMIDI_IRQ_ATTR
+
+// Every queue index access is a point where an interrupt may come in
+#define FIFO_LOAD(idx)        (sim_preempt(), __atomic_load_n(&(idx), __ATOMIC_ACQUIRE))
+#define FIFO_STORE(idx, val)  do { sim_preempt(); __atomic_store_n(&(idx), (val), __ATOMIC_RELEASE); } while(0)
@@ -0,0 +1,111 @@
+// Clock follower: tempo under jitter, lost ticks, gaps and tempo changes.
+// The tolerances are the figures quoted in the README (MIDI Clock).
+
+#include "check.h"
+#include "USBMIDIClock.h"
+#include <math.h>
+
+static const uint32_t CLOCK = USB_MIDI_PACKET(0x0F, 0xF8, 0, 0);
+static const uint32_t START = USB_MIDI_PACKET(0x0F, 0xFA, 0, 0);
+
+// Ticks at bpm from time t (in us, fractional), each arriving up to
+// jitterUs early or late; ticks for which drop() is true never arrive.
+// worst is the largest tempo error seen while locked, in percent.
+struct Feed {
+    USBMIDIClockFollower follower;
+    double t = 100000;
+    uint32_t rng = 1;
+    uint32_t sent = 0;
+    float worst = 0;
+    uint32_t unlocked = 0;
+
+    int32_t jitter(uint32_t us) {
+        rng = rng * 1103515245 + 12345;
+        return us ? (int32_t)((rng >> 8) % (2 * us + 1)) - (int32_t)us : 0;
+    }
+
+    void ticks(float bpm, uint32_t count, uint32_t jitterUs, bool (*drop)(uint32_t) = nullptr, bool check = true) {
+        double period = 2500000.0 / bpm;
+        for(uint32_t i = 0; i < count; i++, sent++) {
+            t += period;
+            int32_t j = jitter(jitterUs);
+            if(drop && drop(sent)) continue;
+            follower.handlePacket(CLOCK, (uint32_t)(t + j));
+            if(!check) continue;
+            if(!follower.locked()) { unlocked++; continue; }
+            float error = fabsf(follower.bpm() - bpm) / bpm * 100;
+            if(error > worst) worst = error;
+        }
+    }
+};
+
+// 120 BPM once locked (within two quarter notes): within 0.1% with up to
+// half a USB frame of jitter either way, 0.2% with a whole frame
+static void test_jitter() {
+    Feed half, whole;
+    half.ticks(120, 48, 500, nullptr, false);
+    CHECK(half.follower.locked());
+    half.ticks(120, 2400, 500);
+    CHECK_EQ(half.unlocked, 0);
+    CHECK(half.worst < 0.1f);
+    whole.ticks(120, 48, 1000, nullptr, false);
+    whole.ticks(120, 2400, 1000);
+    CHECK_EQ(whole.unlocked, 0);
+    CHECK(whole.worst < 0.2f);
+}
+
+// Every 37th tick lost, and two in a row every 148th: the position keeps
+// counting and the tempo holds as if nothing happened
+static bool dropSome(uint32_t n) { return n % 37 == 36 || n % 148 == 70 || n % 148 == 71; }
+
+static void test_dropped_ticks() {
+    Feed feed;
+    feed.follower.handlePacket(START, 0);
+    feed.ticks(120, 48, 500, nullptr, false);
+    feed.ticks(120, 2400, 500, dropSome);
+    CHECK_EQ(feed.follower.ticks(), feed.sent - 1);
+    CHECK_EQ(feed.unlocked, 0);
+    CHECK(feed.worst < 0.1f);
+}
+
+// A pause of a second is a real gap: the filter starts over and has the new
+// tempo within about a quarter note
+static void test_gap_restarts() {
+    Feed feed;
+    feed.ticks(120, 96, 0);
+    feed.t += 1000000;
+    feed.ticks(140, 24, 200, nullptr, false);
+    CHECK(fabsf(feed.follower.bpm() - 140) < 140 * 0.01f);
+}
+
+// A tempo change of 5%: within 1% of the new tempo after a quarter note
+static void test_tempo_change() {
+    Feed feed;
+    feed.ticks(120, 96, 300, nullptr, false);
+    feed.ticks(126, 24, 300, nullptr, false);
+    CHECK(fabsf(feed.follower.bpm() - 126) < 126 * 0.01f);
+}
+
+// A slower tempo whose intervals land on two or three of the old periods is
+// not lost ticks once the next interval agrees: the tempo follows and the
+// position counts each tick once
+static void test_slower_tempo(float to) {
+    Feed feed;
+    feed.follower.handlePacket(START, 0);
+    feed.ticks(120, 96, 300, nullptr, false);
+    feed.ticks(to, 480, 300, nullptr, false);
+    CHECK(fabsf(feed.follower.bpm() - to) < to * 0.01f);
+    CHECK(feed.follower.locked());
+    CHECK_EQ(feed.follower.ticks(), feed.sent - 1);
+}
+
+int main() {
+    test_jitter();
+    test_dropped_ticks();
+    test_gap_restarts();
+    test_tempo_change();
+    test_slower_tempo(80);
+    test_slower_tempo(60);
+    test_slower_tempo(40);
+    return check_report("test_clock");
+}
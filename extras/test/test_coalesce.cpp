@@ -0,0 +1,105 @@
+// Coalescing mode: latest value wins, nothing overtakes a note, and the
+// Note Off reserve
+
+#include "check.h"
+#include <vector>
+
+static std::vector<uint32_t> hostAll() {
+    std::vector<uint32_t> words;
+    uint32_t w;
+    while(sim_host_read(&w, nullptr, 1)) words.push_back(w);
+    return words;
+}
+
+static uint32_t cc(uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | channel, control, value);
+}
+
+static void start_coalescing() {
+    start_device();
+    sim_run_us(2000);
+    hostAll();                                // Notes left On by a test before
+    USBMIDI.setCoalescing(true);
+    sim_host_reading(0);
+}
+
+// A fader sweep while the host is not reading: the queue keeps the newest
+// value, not the backlog
+static void test_latest_value() {
+    start_coalescing();
+    for(uint8_t v = 0; v < 128; v++) USBMIDI.sendControlChange(0, 7, v);
+    USBMIDI.sendPitchBend(1, -8192);
+    USBMIDI.sendPitchBend(1, 8191);
+    sim_host_reading(1);
+    sim_run_us(3000);
+    std::vector<uint32_t> got = hostAll();
+    CHECK(got.size() < 20);
+    CHECK(got.size() >= 2 && got[got.size() - 2] == cc(0, 7, 127));
+    CHECK(!got.empty() && USB_MIDI_BYTE(got.back(), 1) == 0xE1 && USB_MIDI_BYTE(got.back(), 3) == 0x7F);
+    CHECK(USBMIDI.getStats().txCoalesced > 100);
+    CHECK_EQ(USBMIDI.getStats().txDropped, 0);
+    USBMIDI.setCoalescing(false);
+}
+
+// An update never moves ahead of a note on its channel, and switch-type
+// controllers are all sent
+static void test_order_kept() {
+    start_coalescing();
+    USBMIDI.sendControlChange(0, 1, 10);      // Staged straight away
+    USBMIDI.sendControlChange(0, 1, 11);
+    USBMIDI.sendNoteOn(0, 60, 100);
+    USBMIDI.sendControlChange(0, 1, 20);      // Not merged into 11
+    USBMIDI.sendControlChange(2, 1, 30);
+    USBMIDI.sendControlChange(2, 1, 31);      // Other channel: merged
+    USBMIDI.sendControlChange(0, 64, 127);
+    USBMIDI.sendControlChange(0, 64, 0);      // Sustain: both sent
+    sim_host_reading(1);
+    sim_run_us(3000);
+    std::vector<uint32_t> got = hostAll();
+    std::vector<uint32_t> expected = {
+        cc(0, 1, 10), cc(0, 1, 11), USB_MIDI_PACKET(0x09, 0x90, 60, 100), cc(0, 1, 20),
+        cc(2, 1, 31), cc(0, 64, 127), cc(0, 64, 0)
+    };
+    CHECK(got == expected);
+    USBMIDI.setCoalescing(false);
+}
+
+// The FIFO flooded with controllers that cannot merge: other sends are
+// refused while 8 slots are left, which take exactly 8 Note Offs
+static void test_note_off_reserve() {
+    start_coalescing();
+    uint32_t accepted = 0;
+    for(uint32_t i = 0; i < 200; i++) {
+        uint32_t packet = cc(i % 16, 1 + i / 16, 0);
+        if(!USB_write(&packet, 1)) break;
+        accepted++;
+    }
+    uint32_t on = USB_MIDI_PACKET(0x09, 0x90, 60, 100);
+    CHECK_EQ(USB_write(&on, 1), 0);
+    uint32_t offs[10];
+    for(uint8_t i = 0; i < 10; i++) {
+        offs[i] = i % 2 ? USB_MIDI_PACKET(0x08, 0x80, 40 + i, 0) : USB_MIDI_PACKET(0x09, 0x90, 40 + i, 0);
+    }
+    uint32_t pair[2] = { offs[0], offs[1] };
+    CHECK_EQ(USB_write(pair, 2), 0);          // Multi-packet writes stay out too
+    uint32_t offsAccepted = 0;
+    for(uint8_t i = 0; i < 10; i++) offsAccepted += USB_write(&offs[i], 1);
+    CHECK_EQ(offsAccepted, 8);                // The reserve, and no more
+    CHECK_EQ(USBMIDI.getStats().txDropped, 1 + 1 + 2 + 2);
+
+    sim_host_reading(1);
+    sim_run_us(10000);
+    std::vector<uint32_t> got = hostAll();
+    CHECK_EQ(got.size(), accepted + 8);
+    bool tail = got.size() >= 8;
+    for(uint8_t i = 0; tail && i < 8; i++) tail = got[accepted + i] == offs[i];
+    CHECK(tail);
+    USBMIDI.setCoalescing(false);
+}
+
+int main() {
+    test_latest_value();
+    test_order_kept();
+    test_note_off_reserve();
+    return check_report("test_coalesce");
+}
@@ -0,0 +1,130 @@
+// Enumeration, descriptors, loopback and link state against the simulated host
+
+#include "check.h"
+
+static uint8_t lastNote, lastVelocity;
+static int noteOns;
+static void onNoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
+    (void)channel;
+    lastNote = note;
+    lastVelocity = velocity;
+    noteOns++;
+}
+
+static uint8_t states[8];
+static int stateCount;
+static void onConnection(uint8_t state) {
+    if(stateCount < 8) states[stateCount++] = state;
+}
+
+static void test_descriptors() {
+    uint8_t buf[512];
+    start_device();
+    CHECK(USBMIDI.connected());
+
+    CHECK_EQ(sim_host_get_descriptor(USB_DESCR_TYP_DEVICE, 0, buf, 18), 18);
+    CHECK_EQ(buf[7], EP0_SIZE);
+    CHECK_EQ(buf[8] | (buf[9] << 8), WCH_USBMIDI_VENDOR_ID);
+    CHECK_EQ(buf[10] | (buf[11] << 8), WCH_USBMIDI_PRODUCT_ID);
+
+    CHECK_EQ(sim_host_get_descriptor(USB_DESCR_TYP_CONFIG, 0, buf, 9), 9);
+    uint16_t total = buf[2] | (buf[3] << 8);
+    CHECK_EQ(sim_host_get_descriptor(USB_DESCR_TYP_CONFIG, 0, buf, sizeof(buf)), total);
+    // Walk the descriptors: lengths add up and both bulk endpoints are there
+    int endpoints = 0;
+    uint16_t pos = 0;
+    while(pos + 2 <= total && buf[pos] >= 2) {
+        if(buf[pos + 1] == USB_DESCR_TYP_ENDP) {
+            CHECK(buf[pos + 2] == USB_ENDP_ADDR_EP2_OUT || buf[pos + 2] == USB_ENDP_ADDR_EP2_IN);
+            CHECK_EQ(buf[pos + 3] & 0x03, USB_ENDP_TYPE_BULK);
+            CHECK_EQ(buf[pos + 4] | (buf[pos + 5] << 8), EP2_SIZE);
+            endpoints++;
+        }
+        pos += buf[pos];
+    }
+    CHECK_EQ(pos, total);
+    CHECK_EQ(endpoints, 2);
+
+    // Serial number: prefix, then the unique ID words 3, 2, 1 in hex
+    char expected[40];
+    snprintf(expected, sizeof(expected), "%s%08X%08X%08X", WCH_USBMIDI_SERIAL_PREFIX,
+             (unsigned)sim_uid[2], (unsigned)sim_uid[1], (unsigned)sim_uid[0]);
+    int len = sim_host_get_descriptor(USB_DESCR_TYP_STRING, 3, buf, 255);
+    CHECK_EQ(len, 2 + 2 * strlen(expected));
+    bool same = true;
+    for(size_t i = 0; i < strlen(expected); i++) same &= buf[2 + 2 * i] == (uint8_t)expected[i];
+    CHECK(same);
+
+    // GET_CONFIGURATION, and a class request the device does not know
+    const uint8_t getConfig[8] = { 0x80, 0x08, 0, 0, 0, 0, 1, 0 };
+    CHECK_EQ(sim_host_control(getConfig, buf), 1);
+    CHECK_EQ(buf[0], 1);
+    const uint8_t classRequest[8] = { 0x21, 0x01, 0, 0, 0, 0, 0, 0 };
+    CHECK_EQ(sim_host_control(classRequest, nullptr), -1);
+    CHECK_EQ(USBMIDI.getStats().setupStalls, 1);
+}
+
+static void test_loopback() {
+    start_device();
+    USBMIDI.setHandleNoteOn(onNoteOn);
+    noteOns = 0;
+
+    const uint32_t noteOn = USB_MIDI_PACKET(0x09, 0x90, 60, 100);
+    sim_host_send(&noteOn, 1);
+    sim_run_us(2000);
+    USBMIDI.poll();
+    CHECK_EQ(noteOns, 1);
+    CHECK_EQ(lastNote, 60);
+    CHECK_EQ(lastVelocity, 100);
+
+    USBMIDI.sendNoteOn(0, lastNote + 12, lastVelocity);
+    sim_run_us(2000);
+    CHECK_EQ(sim_host_received(), 1);
+    CHECK_EQ(host_next(), USB_MIDI_PACKET(0x09, 0x90, 72, 100));
+
+    USBMIDIStats stats = USBMIDI.getStats();
+    CHECK_EQ(stats.rxPackets, 1);
+    CHECK_EQ(stats.txPackets, 1);
+    CHECK_EQ(stats.txTransfers, 1);
+    SimHostStats host;
+    sim_host_stats(&host);
+    CHECK_EQ(host.inToggleErrors, 0);
+    USBMIDI.setHandleNoteOn(nullptr);
+}
+
+static void test_link_state() {
+    start_device();
+    USBMIDI.setHandleConnection(onConnection);
+    stateCount = 0;
+
+    sim_host_suspend();
+    USBMIDI.poll();
+    CHECK_EQ(USBMIDI.connectionState(), USB_STATE_SUSPENDED);
+    CHECK(!USBMIDI.connected());
+    USBMIDI.sendNoteOn(0, 60, 1);              // Refused while suspended
+    CHECK_EQ(USBMIDI.getStats().txDropped, 1);
+
+    sim_host_resume();
+    USBMIDI.poll();
+    CHECK_EQ(USBMIDI.connectionState(), USB_STATE_CONFIGURED);
+
+    sim_host_bus_reset();
+    USBMIDI.poll();
+    CHECK_EQ(USBMIDI.connectionState(), USB_STATE_DEFAULT);
+    CHECK_EQ(sim_host_attach(0), 0);
+    USBMIDI.poll();
+    CHECK(USBMIDI.connected());
+
+    CHECK(stateCount >= 4);
+    CHECK_EQ(states[0], USB_STATE_SUSPENDED);
+    CHECK_EQ(states[1], USB_STATE_CONFIGURED);
+    CHECK_EQ(states[stateCount - 1], USB_STATE_CONFIGURED);
+    USBMIDI.setHandleConnection(nullptr);
+}
+
+int main() {
+    test_descriptors();
+    test_loopback();
+    test_link_state();
+    return check_report("test_enumeration");
+}
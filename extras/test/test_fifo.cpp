@@ -0,0 +1,294 @@
+// Packet queues between the main loop and the USB interrupt
+
+#include "check.h"
+#include <string.h>
+
+static uint32_t seqPacket(uint32_t seq) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | ((seq >> 14) & 0x0F), seq & 0x7F, (seq >> 7) & 0x7F);
+}
+
+static uint32_t packetSeqOf(uint32_t packet) {
+    return ((USB_MIDI_BYTE(packet, 1) & 0x0F) << 14) | (USB_MIDI_BYTE(packet, 3) << 7) | USB_MIDI_BYTE(packet, 2);
+}
+
+// Main loop -> ISR: every packet arrives once and in order while interrupts
+// come in at random points of USB_write
+static void test_tx_order() {
+    start_device();
+    sim_jitter(300, 7);
+    const uint32_t total = 20000;
+    uint32_t seq = 0, expected = 0, bad = 0;
+    while(expected < total) {
+        uint32_t packet = seqPacket(seq);
+        if(seq < total && USB_write(&packet, 1)) seq++;
+        uint32_t word;
+        while(sim_host_read(&word, nullptr, 1)) {
+            if(word != seqPacket(expected)) bad++;
+            expected++;
+        }
+        sim_run_us(1);
+        if(sim_time_us() > 2000000) break;
+    }
+    sim_jitter(0, 0);
+    CHECK_EQ(expected, total);
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(USBMIDI.getStats().txPackets, total);
+}
+
+// ISR -> main loop, read in uneven slices
+static void test_rx_order() {
+    start_device();
+    sim_jitter(300, 11);
+    const uint32_t total = 20000;
+    uint32_t sent = 0, expected = 0, bad = 0, rng = 1;
+    while(expected < total && sim_time_us() < 2000000) {
+        while(sent < total && sim_host_out_pending() < 88) {
+            uint32_t packet = seqPacket(sent++);
+            sim_host_send(&packet, 1);
+        }
+        uint32_t packets[16];
+        rng = rng * 1103515245 + 12345;
+        uint32_t n = USB_read(packets, 1 + (rng >> 16) % 16);
+        for(uint32_t i = 0; i < n; i++, expected++) {
+            if(packets[i] != seqPacket(expected)) bad++;
+        }
+        sim_run_us((rng >> 20) % 40);
+    }
+    sim_jitter(0, 0);
+    CHECK_EQ(expected, total);
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(USB_available(), 0);
+}
+
+// Ping-pong: each message is echoed from poll() and the host waits for the
+// echo before sending the next
+static uint32_t echoes;
+static void onControl(uint8_t channel, uint8_t control, uint8_t value) {
+    USBMIDI.sendControlChange(channel, control, value);
+    echoes++;
+}
+
+static void test_ping_pong() {
+    start_device();
+    USBMIDI.setHandleControlChange(onControl);
+    echoes = 0;
+    uint32_t bad = 0, worst = 0;
+    for(uint32_t seq = 0; seq < 1000; seq++) {
+        uint32_t packet = seqPacket(seq), word = 0, start = sim_time_us();
+        sim_host_send(&packet, 1);
+        while(!sim_host_read(&word, nullptr, 1) && sim_time_us() - start < 10000) {
+            USBMIDI.poll();
+            sim_run_us(5);
+        }
+        if(word != packet) bad++;
+        if(sim_time_us() - start > worst) worst = sim_time_us() - start;
+    }
+    CHECK_EQ(echoes, 1000);
+    CHECK_EQ(bad, 0);
+    CHECK(worst < 1000); // Both directions within a frame
+    USBMIDI.setHandleControlChange(nullptr);
+}
+
+// Interrupt dispatch: callbacks echo from the USB interrupt while the main
+// loop sends its own stream, interrupts coming in at random points of both.
+// Each stream arrives in order; the loop's is complete, the echoes are all
+// there but for the ones refused on a full FIFO.
+static uint32_t isrEchoes, isrRefused;
+static void onControlIsr(uint8_t channel, uint8_t control, uint8_t value) {
+    if(USBMIDI.sendPacket(0x0A, 0xA0 | channel, control, value)) isrEchoes++;
+    else isrRefused++;
+}
+
+static void test_isr_and_loop_sends() {
+    start_device();
+    USBMIDI.setHandleControlChange(onControlIsr);
+    USBMIDI.setInterruptDispatch(true);
+    isrEchoes = isrRefused = 0;
+    sim_jitter(300, 13);
+    const uint32_t total = 5000;
+    uint32_t seq = 0, hostSent = 0, loopSeen = 0, echoSeen = 0, lastEcho = 0, bad = 0;
+    while((loopSeen < total || echoSeen < isrEchoes || hostSent < total) && sim_time_us() < 2000000) {
+        while(hostSent < total && sim_host_out_pending() < 8) {
+            uint32_t packet = seqPacket(hostSent++);
+            sim_host_send(&packet, 1);
+        }
+        uint32_t p = seqPacket(seq);
+        if(seq < total && USBMIDI.sendPacket(0x0B, USB_MIDI_BYTE(p, 1), USB_MIDI_BYTE(p, 2), USB_MIDI_BYTE(p, 3))) seq++;
+        uint32_t word;
+        while(sim_host_read(&word, nullptr, 1)) {
+            if((word & 0xF0FF) == 0xB00B) {
+                if(word != seqPacket(loopSeen)) bad++;
+                loopSeen++;
+            } else if((word & 0xF0FF) == 0xA00A) {
+                uint32_t n = packetSeqOf(word ^ 0x1001);
+                if(echoSeen && n <= lastEcho) bad++;
+                lastEcho = n;
+                echoSeen++;
+            } else {
+                bad++;
+            }
+        }
+        USBMIDI.poll();
+        sim_run_us(2);
+    }
+    sim_jitter(0, 0);
+    USBMIDI.setInterruptDispatch(false);
+    USBMIDI.setHandleControlChange(nullptr);
+    CHECK_EQ(loopSeen, total);
+    CHECK_EQ(isrEchoes + isrRefused, total);
+    CHECK(isrEchoes > total / 2);
+    CHECK_EQ(echoSeen, isrEchoes);
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(USBMIDI.getStats().txPackets, total + isrEchoes);
+}
+
+// A transfer that is not a whole number of packets: the whole ones are
+// delivered, the trailing piece counted and dropped
+static void test_torn_packets() {
+    start_device();
+    uint8_t bytes[10];
+    uint32_t a = USB_MIDI_PACKET(0x09, 0x90, 60, 100), b = USB_MIDI_PACKET(0x08, 0x80, 60, 0);
+    memcpy(bytes, &a, 4);
+    memcpy(bytes + 4, &b, 4);
+    bytes[8] = 0x09;
+    bytes[9] = 0x90;
+    sim_host_send_raw(bytes, sizeof(bytes));
+    sim_host_send_raw(bytes, 0);              // Zero-length transfer
+    sim_host_send_raw(bytes, 3);              // Less than one packet
+    sim_run_us(3000);
+    uint32_t packets[8];
+    CHECK_EQ(USB_read(packets, 8), 2);
+    CHECK_EQ(packets[0], a);
+    CHECK_EQ(packets[1], b);
+    sim_run_us(3000);                         // The half is free: the rest lands
+    CHECK_EQ(USB_available(), 0);
+    USBMIDIStats stats = USBMIDI.getStats();
+    CHECK_EQ(stats.rxPackets, 2);
+    CHECK_EQ(stats.rxDropped, 2);
+}
+
+// A multi-packet write is queued whole or not at all
+static void test_write_all_or_nothing() {
+    start_device();
+    sim_host_reading(0);
+    uint32_t packets[2], accepted = 0;
+    for(;;) {
+        packets[0] = USB_MIDI_PACKET(0x0B, 0xB0, accepted & 0x7F, 0);
+        if(!USB_write(packets, 1)) break;
+        accepted++;
+    }
+    packets[1] = packets[0];
+    CHECK_EQ(USB_write(packets, 2), 0);
+    CHECK_EQ(USBMIDI.getStats().txDropped, 3);
+    sim_host_reading(1);
+    sim_run_us(5000);
+    uint32_t received[128];
+    uint32_t n = sim_host_read(received, nullptr, 128);
+    CHECK_EQ(n, accepted);
+    bool same = true;
+    for(uint32_t i = 0; i < n; i++) same &= received[i] == USB_MIDI_PACKET(0x0B, 0xB0, i & 0x7F, 0);
+    CHECK(same);
+}
+
+// A batch is held back until it ends, then goes out in one full transfer
+static void test_batch() {
+    start_device();
+    SimHostStats before, after;
+    sim_host_stats(&before);
+    USBMIDI.beginBatch();
+    for(uint8_t i = 0; i < 8; i++) USBMIDI.sendControlChange(0, 20 + i, i);
+    uint32_t packets[8];
+    for(uint32_t i = 0; i < 8; i++) packets[i] = seqPacket(i);
+    CHECK_EQ(USBMIDI.sendPackets(packets, 8), 8);
+    sim_run_us(3000);
+    CHECK_EQ(host_next(), 0);
+    USBMIDI.endBatch();
+    sim_run_us(3000);
+
+    uint32_t received[32];
+    uint32_t n = sim_host_read(received, nullptr, 32);
+    CHECK_EQ(n, 16);
+    CHECK_EQ(received[0], USB_MIDI_PACKET(0x0B, 0xB0, 20, 0));
+    CHECK_EQ(received[8], seqPacket(0));
+    CHECK_EQ(received[15], seqPacket(7));
+    sim_host_stats(&after);
+    CHECK_EQ(after.inAcks - before.inAcks, 1);
+    USBMIDIStats stats = USBMIDI.getStats();
+    CHECK_EQ(stats.txTransfers, 1);
+    CHECK_EQ(stats.txFlushes, 1);
+}
+
+// sendPackets takes at most the 64 packets of the TX FIFO in one call
+static void test_send_packets_limit() {
+    start_device();
+    uint32_t packets[65];
+    for(uint32_t i = 0; i < 65; i++) packets[i] = seqPacket(i);
+    CHECK_EQ(USBMIDI.sendPackets(packets, 65), 0);   // Even with the FIFO empty
+    CHECK_EQ(USBMIDI.getStats().txDropped, 65);
+    CHECK_EQ(USBMIDI.sendPackets(packets, 64), 64);
+    sim_run_us(5000);
+    uint32_t received[65], bad = 0;
+    uint32_t n = sim_host_read(received, nullptr, 65);
+    CHECK_EQ(n, 64);
+    for(uint32_t i = 0; i < n; i++) bad += received[i] != seqPacket(i);
+    CHECK_EQ(bad, 0);
+}
+
+// A main loop that stops reading holds the host off with NAK; nothing is lost
+static void test_backpressure() {
+    start_device();
+    uint32_t packets[200];
+    for(uint32_t i = 0; i < 200; i++) packets[i] = seqPacket(i);
+    sim_host_send(packets, 200);
+    sim_run_us(20000);
+    CHECK_EQ(USB_available(), 2 * EP2_SIZE / 4);  // Both halves full
+    CHECK_EQ(sim_host_out_pending(), 200 - 2 * EP2_SIZE / 4);
+    SimHostStats host;
+    sim_host_stats(&host);
+    CHECK(host.outNaks > 10);
+    USBMIDIStats stats = USBMIDI.getStats();
+    CHECK_EQ(stats.rxNaks, 1);                    // One stall, however long
+    CHECK_EQ(stats.rxHighWater, 2 * EP2_SIZE / 4);
+
+    uint32_t expected = 0, bad = 0, got[7];
+    for(int i = 0; i < 1000 && expected < 200; i++) {
+        uint32_t n = USB_read(got, 7);
+        for(uint32_t j = 0; j < n; j++, expected++) bad += got[j] != seqPacket(expected);
+        sim_run_us(50);
+    }
+    CHECK_EQ(expected, 200);
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(USBMIDI.getStats().rxDropped, 0);
+}
+
+// An OUT repeated after a lost handshake (same data toggle) is ignored
+static void test_repeated_out() {
+    start_device();
+    uint32_t packet = seqPacket(1);
+    sim_host_send(&packet, 1);
+    sim_run_us(2000);
+    sim_host_resend_last();
+    sim_run_us(2000);
+    packet = seqPacket(2);
+    sim_host_send(&packet, 1);
+    sim_run_us(2000);
+    uint32_t got[4];
+    CHECK_EQ(USB_read(got, 4), 2);
+    CHECK_EQ(got[0], seqPacket(1));
+    CHECK_EQ(got[1], seqPacket(2));
+    CHECK_EQ(USBMIDI.getStats().rxPackets, 2);
+}
+
+int main() {
+    test_tx_order();
+    test_rx_order();
+    test_ping_pong();
+    test_isr_and_loop_sends();
+    test_torn_packets();
+    test_write_all_or_nothing();
+    test_batch();
+    test_send_packets_limit();
+    test_backpressure();
+    test_repeated_out();
+    return check_report("test_fifo");
+}
@@ -0,0 +1,97 @@
+// Hung notes across bus resets: notes left On are released, including
+// those whose Note Off was queued but thrown away by the reset
+
+#include "check.h"
+#include <vector>
+
+static std::vector<uint32_t> hostAll() {
+    std::vector<uint32_t> words;
+    uint32_t w;
+    while(sim_host_read(&w, nullptr, 1)) words.push_back(w);
+    return words;
+}
+
+static uint32_t noteOff(uint8_t channel, uint8_t note) {
+    return USB_MIDI_PACKET(0x08, 0x80 | channel, note, 0);
+}
+
+static void start_clean() {
+    start_device();
+    sim_run_us(2000);
+    hostAll();                                // Releases left over by a test before
+}
+
+static void reset_and_reconnect() {
+    sim_host_bus_reset();
+    USBMIDI.poll();
+    sim_host_reading(1);
+    CHECK_EQ(sim_host_attach(0), 0);
+    USBMIDI.poll();
+    sim_run_us(3000);
+}
+
+// Held notes are released after a reset; so is a note whose Note Off was
+// waiting in the FIFO or on the wire when the reset came
+static void test_release_after_reset() {
+    start_clean();
+    USBMIDI.sendNoteOn(0, 60, 100);
+    USBMIDI.sendNoteOn(3, 61, 100);
+    USBMIDI.sendNoteOn(3, 62, 100);
+    sim_run_us(2000);
+    CHECK_EQ(hostAll().size(), 3);
+
+    sim_host_reading(0);
+    USBMIDI.sendNoteOff(3, 61);               // Staged in the armed IN half
+    for(uint8_t i = 0; i < 40; i++) USBMIDI.sendControlChange(0, 1, i);
+    USBMIDI.sendNoteOff(0, 60);               // Further back, in the FIFO
+    CHECK(!USBMIDI.noteHeld(0, 60));
+    CHECK(!USBMIDI.noteHeld(3, 61));
+
+    reset_and_reconnect();
+    std::vector<uint32_t> got = hostAll();
+    std::vector<uint32_t> expected = { noteOff(0, 60), noteOff(3, 61), noteOff(3, 62) };
+    CHECK(got == expected);
+    CHECK(!USBMIDI.noteHeld(0, 60) && !USBMIDI.noteHeld(3, 61) && !USBMIDI.noteHeld(3, 62));
+}
+
+// A Note Off the host did take is not sent again
+static void test_delivered_not_repeated() {
+    start_clean();
+    USBMIDI.sendNoteOn(1, 40, 100);
+    USBMIDI.sendNoteOff(1, 40);
+    sim_run_us(2000);
+    CHECK_EQ(hostAll().size(), 2);
+    reset_and_reconnect();
+    CHECK_EQ(hostAll().size(), 0);
+}
+
+// More Note Offs thrown away than the handler keeps: All Notes Off on
+// every channel instead
+static void test_overflow_all_notes_off() {
+    start_clean();
+    for(uint8_t n = 0; n < 40; n++) USBMIDI.sendNoteOn(n % 16, 30 + n, 100);
+    sim_run_us(5000);
+    CHECK_EQ(hostAll().size(), 40);
+    sim_host_reading(0);
+    for(uint8_t n = 0; n < 40; n++) USBMIDI.sendNoteOff(n % 16, 30 + n);
+
+    reset_and_reconnect();
+    std::vector<uint32_t> got = hostAll();
+    uint32_t allOff = 0, others = 0;
+    for(uint32_t w : got) {
+        if((w & 0xFFFFF00F) == USB_MIDI_PACKET(0x0B, 0xB0, 123, 0)) allOff++;
+        else others++;
+    }
+    CHECK_EQ(allOff, 16 * WCH_USBMIDI_NUM_CABLES);
+    CHECK_EQ(others, 0);
+    bool held = false;
+    for(uint8_t n = 0; n < 40; n++) held |= USBMIDI.noteHeld(n % 16, 30 + n);
+    CHECK(!held);
+}
+
+int main() {
+    test_release_after_reset();
+    test_delivered_not_repeated();
+    test_overflow_all_notes_off();
+    return check_report("test_notes");
+}
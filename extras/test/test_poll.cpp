@@ -0,0 +1,282 @@
+// Budgeted polling: poll(maxPackets), pollFor(microseconds) and
+// readPackets() under a burst from the host, and the parameter messages
+// (14-bit CC, RPN/NRPN) put together across and within polls; poll() with a
+// compile-time handler set
+
+#include "check.h"
+#include <vector>
+
+static uint32_t seqPacket(uint32_t seq) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | ((seq >> 14) & 0x0F), seq & 0x7F, (seq >> 7) & 0x7F);
+}
+
+static std::vector<uint32_t> handled;
+static uint32_t handlerCostUs;
+static void onPacket(uint32_t packet, uint32_t timestamp) {
+    (void)timestamp;
+    handled.push_back(packet);
+    if(handlerCostUs) sim_run_us(handlerCostUs);
+}
+
+static void start_burst(uint32_t count) {
+    start_device();
+    handled.clear();
+    handlerCostUs = 0;
+    USBMIDI.setHandlePacket(onPacket);
+    std::vector<uint32_t> packets;
+    for(uint32_t i = 0; i < count; i++) packets.push_back(seqPacket(i));
+    sim_host_send(packets.data(), count);
+    sim_run_us(3000);                         // Both OUT halves full, the host NAKed
+}
+
+static bool inOrder(uint32_t count) {
+    if(handled.size() != count) return false;
+    for(uint32_t i = 0; i < count; i++) if(handled[i] != seqPacket(i)) return false;
+    return true;
+}
+
+// At most maxPackets per call; the return value is what is still waiting
+static void test_max_packets() {
+    const uint32_t total = 200;
+    start_burst(total);
+    uint32_t calls = 0, over = 0, wrongLeft = 0;
+    while(handled.size() < total && calls < 1000) {
+        size_t before = handled.size();
+        uint32_t left = USBMIDI.poll(5);
+        if(handled.size() - before > 5) over++;
+        if(left != USB_available() + USB_available_realtime()) wrongLeft++;
+        calls++;
+        sim_run_us(200);
+    }
+    CHECK_EQ(over, 0);
+    CHECK_EQ(wrongLeft, 0);
+    CHECK(calls >= total / 5);
+    CHECK(inOrder(total));
+    CHECK_EQ(USBMIDI.poll(5), 0);
+    CHECK_EQ(USBMIDI.getStats().rxDropped, 0);
+    USBMIDI.setHandlePacket(nullptr);
+}
+
+// With 20 us of work per packet and a 100 us budget, a call stops at the
+// first check (every 4 packets) past the budget: 8 packets, 160 us
+static void test_time_budget() {
+    const uint32_t total = 120;
+    start_burst(total);
+    handlerCostUs = 20;
+    uint32_t longest = 0, most = 0, calls = 0;
+    while(handled.size() < total && calls < 1000) {
+        size_t before = handled.size();
+        uint32_t start = sim_time_us();
+        USBMIDI.pollFor(100);
+        uint32_t took = sim_time_us() - start;
+        if(took > longest) longest = took;
+        if(handled.size() - before > most) most = (uint32_t)(handled.size() - before);
+        calls++;
+        sim_run_us(300);
+    }
+    CHECK_EQ(most, 8);
+    CHECK(longest < 100 + 4 * 20 + 20);
+    CHECK(inOrder(total));
+    USBMIDI.setHandlePacket(nullptr);
+}
+
+// A 14-bit controller pair split by the budget is still delivered whole
+static uint32_t cc14Calls;
+static uint16_t cc14Value;
+static void onCC14(uint8_t channel, uint8_t control, uint16_t value) {
+    (void)channel; (void)control;
+    cc14Calls++;
+    cc14Value = value;
+}
+
+static void test_pair_across_budget() {
+    start_device();
+    USBMIDI.setHandleControlChange14(onCC14);
+    cc14Calls = 0;
+    uint32_t pair[2] = { USB_MIDI_PACKET(0x0B, 0xB0, 7, 0x40), USB_MIDI_PACKET(0x0B, 0xB0, 39, 0x11) };
+    sim_host_send(pair, 2);
+    sim_run_us(2000);
+    CHECK_EQ(USBMIDI.poll(1), 1);
+    CHECK_EQ(cc14Calls, 0);                   // The MSB waits for its LSB
+    CHECK_EQ(USBMIDI.poll(1), 0);
+    CHECK_EQ(cc14Calls, 1);
+    CHECK_EQ(cc14Value, (0x40 << 7) | 0x11);
+    USBMIDI.setHandleControlChange14(nullptr);
+}
+
+// readPackets: raw packets in bulk, realtime first
+static void test_read_packets() {
+    start_device();
+    uint32_t in[4] = { seqPacket(1), seqPacket(2), USB_MIDI_PACKET(0x0F, 0xF8, 0, 0), seqPacket(3) };
+    sim_host_send(in, 4);
+    sim_run_us(2000);
+    uint32_t out[8];
+    CHECK_EQ(USBMIDI.readPackets(out, 2), 2);
+    CHECK_EQ(out[0], in[2]);
+    CHECK_EQ(out[1], in[0]);
+    CHECK_EQ(USBMIDI.readPackets(out, 8), 2);
+    CHECK_EQ(out[0], in[1]);
+    CHECK_EQ(out[1], in[3]);
+    CHECK_EQ(USBMIDI.readPackets(out, 8), 0);
+}
+
+// RPN/NRPN sending: the selection is skipped while it is unchanged, and
+// sent again after a controller that may have changed it
+static std::vector<uint32_t> hostAll() {
+    std::vector<uint32_t> words;
+    uint32_t w;
+    sim_run_us(3000);
+    while(sim_host_read(&w, nullptr, 1)) words.push_back(w);
+    return words;
+}
+
+static uint32_t cc(uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | channel, control, value);
+}
+
+static void test_parameter_send() {
+    start_device();
+    hostAll();
+    CHECK(USBMIDI.sendRPN(0, 0, 2 << 7));
+    CHECK(USBMIDI.sendRPN(0, 0, 3 << 7));
+    CHECK(USBMIDI.sendNRPN(0, 300, 130));
+    std::vector<uint32_t> expected = {
+        cc(0, 101, 0), cc(0, 100, 0), cc(0, 6, 2), cc(0, 38, 0),
+        cc(0, 6, 3), cc(0, 38, 0),
+        cc(0, 99, 2), cc(0, 98, 44), cc(0, 6, 1), cc(0, 38, 2)
+    };
+    CHECK(hostAll() == expected);
+
+    USBMIDI.sendControlChange(0, 99, 5);      // By hand: the selection is unknown
+    CHECK(USBMIDI.sendNRPN(0, 300, 0));
+    CHECK(USBMIDI.sendNRPN(1, 300, 0));       // Remembered per channel
+    expected = { cc(0, 99, 5), cc(0, 99, 2), cc(0, 98, 44), cc(0, 6, 0), cc(0, 38, 0),
+                 cc(1, 99, 2), cc(1, 98, 44), cc(1, 6, 0), cc(1, 38, 0) };
+    CHECK(hostAll() == expected);
+}
+
+// A full FIFO that takes the selection but not the value: false, and the
+// next call selects the parameter again
+static void test_parameter_send_full() {
+    start_device();
+    hostAll();
+    sim_host_reading(0);
+    uint32_t room = 0;
+    while(USBMIDI.sendPacket(0x0B, 0xB1, 1, room & 0x7F)) room++;
+    start_device();
+    hostAll();
+    sim_host_reading(0);
+    for(uint32_t i = 0; i + 2 < room; i++) USBMIDI.sendPacket(0x0B, 0xB1, 1, i & 0x7F);
+    CHECK(!USBMIDI.sendRPN(0, 1, 100));       // 101/100 queued, 6/38 refused
+    sim_host_reading(1);
+    std::vector<uint32_t> got = hostAll();
+    CHECK_EQ(got.size(), room);
+    CHECK(got.size() >= 2 && got[got.size() - 2] == cc(0, 101, 0) && got.back() == cc(0, 100, 1));
+
+    CHECK(USBMIDI.sendRPN(0, 1, 100));
+    std::vector<uint32_t> expected = { cc(0, 101, 0), cc(0, 100, 1), cc(0, 6, 0), cc(0, 38, 100) };
+    CHECK(hostAll() == expected);
+}
+
+// Receiving: parameter number and Data Entry put back together; an MSB
+// without LSB is delivered with LSB 0 by the end of poll(); Data Entry after
+// the null parameter (127/127) is ignored
+struct ParameterSeen {
+    uint8_t channel;
+    uint16_t number, value;
+    bool nrpn;
+    bool operator==(const ParameterSeen& o) const {
+        return channel == o.channel && number == o.number && value == o.value && nrpn == o.nrpn;
+    }
+};
+static std::vector<ParameterSeen> parameters;
+static void onParameter(uint8_t channel, uint16_t number, uint16_t value, bool nrpn) {
+    parameters.push_back({ channel, number, value, nrpn });
+}
+
+static void receive(std::vector<uint32_t> packets) {
+    sim_host_send(packets.data(), (uint32_t)packets.size());
+    sim_run_us(2000);
+    USBMIDI.poll();
+}
+
+static void test_parameter_receive() {
+    start_device();
+    USBMIDI.setHandleParameter(onParameter);
+    parameters.clear();
+    receive({ cc(2, 99, 2), cc(2, 98, 44), cc(2, 6, 1), cc(2, 38, 2) });
+    std::vector<ParameterSeen> expected = { { 2, 300, 130, true } };
+    CHECK(parameters == expected);
+
+    receive({ cc(3, 101, 0), cc(3, 100, 0), cc(3, 6, 12) });
+    expected.push_back({ 3, 0, 12 << 7, false });
+    CHECK(parameters == expected);
+    receive({ cc(3, 38, 50) });               // A later LSB refines it
+    expected.push_back({ 3, 0, (12 << 7) | 50, false });
+    CHECK(parameters == expected);
+
+    receive({ cc(3, 101, 127), cc(3, 100, 127), cc(3, 6, 1), cc(3, 38, 1) });
+    CHECK(parameters == expected);
+    USBMIDI.setHandleParameter(nullptr);
+}
+
+// Compile-time handlers: a USBMIDIHandlers subclass gets the same messages
+// as the callbacks, with its own state, realtime first, within the budget
+struct Recorder : USBMIDIHandlers {
+    std::vector<uint32_t> seen;             // Decoded back into packets
+    uint32_t raw = 0;
+    void onNoteOn(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {
+        seen.push_back(USB_MIDI_PACKET((cable << 4) | 0x09, 0x90 | channel, note, velocity));
+    }
+    void onNoteOff(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {
+        seen.push_back(USB_MIDI_PACKET((cable << 4) | 0x08, 0x80 | channel, note, velocity));
+    }
+    void onControlChange(uint8_t cable, uint8_t channel, uint8_t control, uint8_t value) {
+        seen.push_back(USB_MIDI_PACKET((cable << 4) | 0x0B, 0xB0 | channel, control, value));
+    }
+    void onPitchBend(uint8_t cable, uint8_t channel, int value) {
+        value += 8192;
+        seen.push_back(USB_MIDI_PACKET((cable << 4) | 0x0E, 0xE0 | channel, value & 0x7F, value >> 7));
+    }
+    void onRealTime(uint8_t cable, uint8_t realtimebyte) {
+        seen.push_back(USB_MIDI_PACKET((cable << 4) | 0x0F, realtimebyte, 0, 0));
+    }
+    void onPacket(uint32_t packet, uint32_t timestamp) { (void)packet; (void)timestamp; raw++; }
+};
+
+static void test_handler_set() {
+    start_device();
+    USBMIDI.setHandlePacket(onPacket);        // Not used by poll(handlers)
+    handled.clear();
+    uint32_t in[] = {
+        USB_MIDI_PACKET(0x09, 0x93, 60, 100), USB_MIDI_PACKET(0x09, 0x93, 60, 0),
+        USB_MIDI_PACKET(0x0B, 0xB1, 7, 99), USB_MIDI_PACKET(0x0E, 0xE2, 0x01, 0x40),
+        USB_MIDI_PACKET(0x0F, 0xF8, 0, 0), USB_MIDI_PACKET(0x0C, 0xC0, 5, 0)  // No handler
+    };
+    sim_host_send(in, 6);
+    sim_run_us(2000);
+    Recorder rec;
+    CHECK_EQ(USBMIDI.poll(rec, 3), 3);
+    USBMIDI.poll(rec);
+    std::vector<uint32_t> expected = {
+        USB_MIDI_PACKET(0x0F, 0xF8, 0, 0), USB_MIDI_PACKET(0x09, 0x93, 60, 100),
+        USB_MIDI_PACKET(0x08, 0x83, 60, 0), USB_MIDI_PACKET(0x0B, 0xB1, 7, 99),
+        USB_MIDI_PACKET(0x0E, 0xE2, 0x01, 0x40)
+    };
+    CHECK(rec.seen == expected);
+    CHECK_EQ(rec.raw, 6);
+    CHECK(handled.empty());
+    USBMIDI.setHandlePacket(nullptr);
+}
+
+int main() {
+    test_max_packets();
+    test_time_budget();
+    test_pair_across_budget();
+    test_read_packets();
+    test_parameter_send();
+    test_parameter_send_full();
+    test_parameter_receive();
+    test_handler_set();
+    return check_report("test_poll");
+}
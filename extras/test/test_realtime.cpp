@@ -0,0 +1,109 @@
+// The System Real-Time lane against a SysEx flood
+
+#include "check.h"
+#include <vector>
+
+static bool isClock(uint32_t packet) {
+    return packet == USB_MIDI_PACKET(0x0F, 0xF8, 0, 0);
+}
+
+// A clock tick every 2 ms while loop() keeps the TX FIFO full of SysEx for a
+// host that reads slowly: the ticks overtake the queue
+static void test_tx_overtakes_sysex() {
+    start_device();
+    sim_host_slot_us(200);
+    std::vector<uint32_t> tickSent, sysexSentAt;
+    uint32_t sysexSent = 0, nextTick = sim_time_us();
+    const uint32_t duration = 100000, start = sim_time_us();
+    while(sim_time_us() - start < duration) {
+        if((int32_t)(sim_time_us() - nextTick) >= 0) {
+            tickSent.push_back(sim_time_us());
+            USBMIDI.sendRealTime(0xF8);
+            nextTick += 2000;
+        }
+        uint32_t packet = USB_MIDI_PACKET(0x04, sysexSent & 0x7F, 0x11, 0x22);
+        if(USB_write(&packet, 1)) {
+            sysexSentAt.push_back(sim_time_us());
+            sysexSent++;
+        }
+        sim_run_us(5);
+    }
+    sim_run_us(10000);
+
+    uint32_t words[64], times[64], n, ticks = 0, sysex = 0, worstTick = 0, bad = 0;
+    uint64_t tickLatency = 0, sysexLatency = 0;
+    while((n = sim_host_read(words, times, 64)) > 0) {
+        for(uint32_t i = 0; i < n; i++) {
+            if(isClock(words[i])) {
+                uint32_t latency = times[i] - tickSent[ticks++];
+                if(latency > worstTick) worstTick = latency;
+                tickLatency += latency;
+            } else {
+                if(words[i] != USB_MIDI_PACKET(0x04, sysex & 0x7F, 0x11, 0x22)) bad++;
+                else sysexLatency += times[i] - sysexSentAt[sysex];
+                sysex++;
+            }
+        }
+    }
+    CHECK_EQ(ticks, tickSent.size());
+    CHECK_EQ(sysex, sysexSent);
+    CHECK_EQ(bad, 0);
+    // SysEx waits behind the whole FIFO, about 64 packets at 4 transfers of
+    // 16 per frame; a tick only for the transfer armed and the one staged
+    // next, i.e. two IN polls (three across the end of a frame)
+    CHECK(ticks && sysex);
+    if(ticks && sysex) CHECK(tickLatency / ticks * 2 < sysexLatency / sysex);
+    CHECK(worstTick < 3 * 200);
+    CHECK(USBMIDI.getStats().txHighWater == 64);
+    sim_host_slot_us(50);
+}
+
+// Realtime is not held back by an open batch
+static void test_tx_ignores_batch() {
+    start_device();
+    USBMIDI.beginBatch();
+    USBMIDI.sendControlChange(0, 1, 2);
+    USBMIDI.sendRealTime(0xFA);
+    sim_run_us(2000);
+    CHECK_EQ(sim_host_received(), 1);
+    CHECK_EQ(host_next(), USB_MIDI_PACKET(0x0F, 0xFA, 0, 0));
+    USBMIDI.endBatch();
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), USB_MIDI_PACKET(0x0B, 0xB0, 1, 2));
+}
+
+// Receiving: a clock behind SysEx in the same transfer is delivered first
+static std::vector<int> events;
+static void onRealTime(uint8_t byte) { events.push_back(byte); }
+static void onChunk(const uint8_t* data, uint8_t length, bool last) {
+    (void)data; (void)length; (void)last;
+    events.push_back(0);
+}
+
+static void test_rx_overtakes_sysex() {
+    start_device();
+    USBMIDI.setHandleRealTime(onRealTime);
+    USBMIDI.setHandleSysExChunk(onChunk);
+    events.clear();
+    uint32_t packets[32];
+    packets[0] = USB_MIDI_PACKET(0x04, 0xF0, 0x01, 0x02);
+    for(int i = 1; i < 15; i++) packets[i] = USB_MIDI_PACKET(0x04, 0x03, 0x04, 0x05);
+    packets[15] = USB_MIDI_PACKET(0x0F, 0xF8, 0, 0);
+    for(int i = 16; i < 31; i++) packets[i] = USB_MIDI_PACKET(0x04, 0x03, 0x04, 0x05);
+    packets[31] = USB_MIDI_PACKET(0x0F, 0xF8, 0, 0);
+    sim_host_send(packets, 32);
+    sim_run_us(3000);
+    USBMIDI.poll();
+    CHECK_EQ(events.size(), 32);
+    CHECK(events.size() >= 2 && events[0] == 0xF8 && events[1] == 0xF8);
+    CHECK_EQ(USB_available_realtime(), 0);
+    USBMIDI.setHandleRealTime(nullptr);
+    USBMIDI.setHandleSysExChunk(nullptr);
+}
+
+int main() {
+    test_tx_overtakes_sysex();
+    test_tx_ignores_batch();
+    test_rx_overtakes_sysex();
+    return check_report("test_realtime");
+}
@@ -0,0 +1,138 @@
+// Router merging: SysEx and parameter sequences kept whole, realtime
+// passing, and what a full hold queue does with Note Offs
+
+#include "check.h"
+#include "USBMIDIRouter.h"
+#include <vector>
+
+static std::vector<uint32_t> sent[2];
+
+static bool sink(uint32_t packet, void* context) {
+    sent[(uintptr_t)context].push_back(packet);
+    return true;
+}
+
+typedef USBMIDIRouter<3, 2> Router;
+
+static void setup(Router& router) {
+    sent[0].clear();
+    sent[1].clear();
+    router.setOutput(0, sink, (void*)0);
+    router.setOutput(1, sink, (void*)1);
+    for(uint8_t i = 0; i < 3; i++) router.connect(i, 0);
+}
+
+static uint32_t sysex(uint8_t cin, uint8_t b1, uint8_t b2 = 0, uint8_t b3 = 0) {
+    return USB_MIDI_PACKET(cin, b1, b2, b3);
+}
+static uint32_t noteOn(uint8_t note) { return USB_MIDI_PACKET(0x09, 0x90, note, 100); }
+static uint32_t noteOff(uint8_t note) { return USB_MIDI_PACKET(0x08, 0x80, note, 0); }
+static uint32_t cc(uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | channel, control, value);
+}
+
+// Another source's notes wait for the end of a SysEx, clock does not
+static void test_sysex_lock() {
+    Router router;
+    setup(router);
+    router.input(0, sysex(0x04, 0xF0, 0x7E, 0x01));
+    router.input(1, noteOn(60));
+    router.input(2, USB_MIDI_PACKET(0x0F, 0xF8, 0, 0));
+    router.input(0, sysex(0x04, 0x02, 0x03, 0x04));
+    router.input(1, noteOff(60));
+    CHECK_EQ(router.held(0), 2);
+    router.input(0, sysex(0x06, 0x05, 0xF7));
+    std::vector<uint32_t> expected = {
+        sysex(0x04, 0xF0, 0x7E, 0x01), USB_MIDI_PACKET(0x0F, 0xF8, 0, 0), sysex(0x04, 0x02, 0x03, 0x04),
+        sysex(0x06, 0x05, 0xF7), noteOn(60), noteOff(60)
+    };
+    CHECK(sent[0] == expected);
+    CHECK_EQ(router.held(0), 0);
+    CHECK_EQ(router.dropped(), 0);
+}
+
+// An RPN selection holds other sources until its data entry LSB; the owner
+// sending something else ends it too
+static void test_parameter_lock() {
+    Router router;
+    setup(router);
+    router.input(0, cc(2, 101, 0));
+    router.input(0, cc(2, 100, 1));
+    router.input(1, cc(2, 6, 99));           // Would land in the sequence
+    router.input(0, cc(2, 6, 64));
+    CHECK_EQ(router.held(0), 1);
+    router.input(0, cc(2, 38, 0));
+    std::vector<uint32_t> expected = { cc(2, 101, 0), cc(2, 100, 1), cc(2, 6, 64), cc(2, 38, 0), cc(2, 6, 99) };
+    CHECK(sent[0] == expected);
+
+    sent[0].clear();
+    router.input(0, cc(3, 99, 1));
+    router.input(1, noteOn(61));
+    router.input(0, noteOn(62));              // Moving on releases the output
+    expected = { cc(3, 99, 1), noteOn(62), noteOn(61) };
+    CHECK(sent[0] == expected);
+    CHECK_EQ(router.held(0), 0);
+
+    // A stalled sequence gives way once the queue is full
+    sent[0].clear();
+    router.input(0, cc(4, 99, 1));
+    for(uint8_t i = 0; i < 33; i++) router.input(1, noteOn(i));
+    CHECK_EQ(sent[0].size(), 34);
+    CHECK_EQ(router.dropped(), 0);
+}
+
+// release() ends the sequence of a source that went away
+static void test_release() {
+    Router router;
+    setup(router);
+    router.input(0, sysex(0x04, 0xF0, 0x01, 0x02));
+    router.input(1, noteOn(70));
+    CHECK_EQ(sent[0].size(), 1);
+    router.release(0);
+    CHECK_EQ(sent[0].size(), 2);
+    CHECK(sent[0].back() == noteOn(70));
+}
+
+// The queue full of held notes behind a long SysEx: Note Offs and All Notes
+// Off still get in, in place of the newest held packets of other kinds;
+// other newcomers are dropped
+static void test_full_queue_keeps_note_offs() {
+    Router router;
+    setup(router);
+    router.input(0, sysex(0x04, 0xF0, 0x00, 0x00));
+    for(uint8_t n = 0; n < 32; n++) router.input(1, noteOn(n));
+    CHECK_EQ(router.held(0), 32);
+    router.input(1, cc(0, 1, 5));              // Dropped
+    CHECK_EQ(router.dropped(), 1);
+    for(uint8_t n = 0; n < 20; n++) router.input(1, noteOff(n));
+    router.input(2, cc(5, 123, 0));
+    CHECK_EQ(router.held(0), 32);
+    CHECK_EQ(router.dropped(), 1 + 21);        // 21 Note Ons made room
+
+    // The 11 Note Ons left give way too; after that Note Offs are dropped
+    for(uint8_t n = 20; n < 40; n++) router.input(1, noteOff(n));
+    CHECK_EQ(router.held(0), 32);
+    for(uint8_t i = 0; i < 5; i++) router.input(1, sysex(0x04, 0xF0, i, 0)); // Another source's SysEx: dropped
+    router.input(0, sysex(0x05, 0xF7));
+
+    std::vector<uint32_t> after(sent[0].begin() + 2, sent[0].end());
+    uint32_t offs = 0, allOff = 0, ons = 0;
+    for(uint32_t p : after) {
+        offs += (p & 0xFF) == 0x08;
+        allOff += p == cc(5, 123, 0);
+        ons += (p & 0xFF) == 0x09;
+    }
+    CHECK_EQ(after.size(), 32);
+    CHECK_EQ(allOff, 1);
+    CHECK_EQ(ons, 0);
+    CHECK_EQ(offs, 31);                        // 9 of the later 20 found no room
+    CHECK_EQ(router.dropped(), 1 + 21 + 11 + 9 + 5);
+}
+
+int main() {
+    test_sysex_lock();
+    test_parameter_lock();
+    test_release();
+    test_full_queue_keeps_note_offs();
+    return check_report("test_router");
+}
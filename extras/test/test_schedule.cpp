@@ -0,0 +1,150 @@
+// Scheduled sends (sendAt): heap order, same-time order, capacity, clear,
+// and the link state
+
+#include "check.h"
+#include <vector>
+
+static uint32_t seqPacket(uint32_t seq) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | ((seq >> 14) & 0x0F), seq & 0x7F, (seq >> 7) & 0x7F);
+}
+static uint32_t packetSeq(uint32_t packet) {
+    return ((USB_MIDI_BYTE(packet, 1) & 0x0F) << 14) | (USB_MIDI_BYTE(packet, 3) << 7) | USB_MIDI_BYTE(packet, 2);
+}
+
+static bool sendSeqAt(uint32_t time, uint32_t seq) {
+    uint32_t p = seqPacket(seq);
+    return USBMIDI.sendAt(time, p & 0x0F, USB_MIDI_BYTE(p, 1), USB_MIDI_BYTE(p, 2), USB_MIDI_BYTE(p, 3));
+}
+
+// Bus time minus USBMIDI.now(), to turn host arrival times into frame time
+static uint32_t clockOffset() {
+    return sim_time_us() - USBMIDI.now();
+}
+
+static void start_scheduler() {
+    start_device();
+    USBMIDI.enableTimestamps();
+    sim_run_us(2000);
+}
+
+// Posted in random time order: sent in time order, each in the first frame
+// at or after its time
+static void test_time_order() {
+    start_scheduler();
+    const uint32_t count = 100;
+    std::vector<uint32_t> due(count);
+    uint32_t base = USBMIDI.now() + 2000, rng = 99;
+    for(uint32_t i = 0; i < count; i++) {
+        rng = rng * 1103515245 + 12345;
+        due[i] = base + (rng >> 16) % 40000;
+        CHECK(sendSeqAt(due[i], i));
+        if(i % 20 == 19) sim_run_us(50);       // Posted across a few frames
+    }
+    CHECK_EQ(USBMIDI.scheduled(), count);
+    uint32_t offset = clockOffset();
+    sim_run_us(45000);
+
+    uint32_t words[count + 1], times[count + 1], bad = 0, early = 0, late = 0;
+    uint32_t n = sim_host_read(words, times, count + 1);
+    CHECK_EQ(n, count);
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t t = due[packetSeq(words[i])];
+        if(i && (int32_t)(t - due[packetSeq(words[i - 1])]) < 0) bad++;
+        int32_t delay = (int32_t)(times[i] - offset - t);
+        if(delay < 0) early++;
+        if(delay > 1100) late++;
+    }
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(early, 0);
+    CHECK_EQ(late, 0);
+    CHECK_EQ(USBMIDI.scheduled(), 0);
+}
+
+// The same time: posting order, across more than one frame's worth of
+// release staging
+static void test_same_time_order() {
+    start_scheduler();
+    uint32_t at = USBMIDI.now() + 3000;
+    for(uint32_t i = 0; i < 60; i++) CHECK(sendSeqAt(at, i));
+    sim_run_us(8000);
+    uint32_t words[64], bad = 0;
+    uint32_t n = sim_host_read(words, nullptr, 64);
+    CHECK_EQ(n, 60);
+    for(uint32_t i = 0; i < n; i++) bad += packetSeq(words[i]) != i;
+    CHECK_EQ(bad, 0);
+}
+
+// A time already past goes out in the next frame; one far ahead waits
+static void test_past_and_future() {
+    start_scheduler();
+    uint32_t now = USBMIDI.now();
+    CHECK(sendSeqAt(now + 1000000, 2));
+    CHECK(sendSeqAt(now - 5000, 1));
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), seqPacket(1));
+    CHECK_EQ(host_next(), 0);
+    CHECK_EQ(USBMIDI.scheduled(), 1);
+    USBMIDI.clearScheduled();
+    sim_run_us(10);
+}
+
+// WCH_USBMIDI_SCHED_CAPACITY pending at most; refused ones are counted
+static void test_capacity() {
+    start_scheduler();
+    uint32_t at = USBMIDI.now() + 100000, accepted = 0;
+    for(uint32_t i = 0; i < WCH_USBMIDI_SCHED_CAPACITY + 10; i++) {
+        accepted += sendSeqAt(at + i, i);
+        sim_run_us(1);
+    }
+    CHECK_EQ(accepted, WCH_USBMIDI_SCHED_CAPACITY);
+    CHECK_EQ(USBMIDI.scheduled(), WCH_USBMIDI_SCHED_CAPACITY);
+    CHECK_EQ(USBMIDI.getStats().txDropped, 10);
+    USBMIDI.clearScheduled();
+    sim_run_us(2000);
+    CHECK_EQ(USBMIDI.scheduled(), 0);
+    CHECK(sendSeqAt(USBMIDI.now(), 7));
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), seqPacket(7));
+    CHECK_EQ(host_next(), 0);                  // Nothing cleared comes back
+}
+
+// Refused while suspended or unconfigured; a bus reset drops what is
+// pending, so nothing of it goes out after the host enumerates again
+static void test_reset_with_pending() {
+    start_scheduler();
+    uint32_t now = USBMIDI.now();
+    for(uint32_t i = 0; i < 20; i++) CHECK(sendSeqAt(now + 5000 + i * 1000, i));
+    sim_run_us(8000);                          // A few go out before the reset
+    uint32_t words[32];
+    uint32_t sent = sim_host_read(words, nullptr, 32);
+    CHECK(sent > 0 && sent < 20);
+
+    sim_host_suspend();
+    USBMIDI.poll();
+    CHECK(!sendSeqAt(now, 100));
+    sim_host_resume();
+
+    sim_host_bus_reset();
+    USBMIDI.poll();
+    CHECK_EQ(USBMIDI.scheduled(), 0);
+    CHECK(!sendSeqAt(now, 101));
+    CHECK_EQ(USBMIDI.getStats().txDropped, 2);
+    CHECK_EQ(sim_host_attach(0), 0);
+    USBMIDI.poll();
+    USBMIDI.enableTimestamps();
+    sim_run_us(30000);
+    CHECK_EQ(host_next(), 0);
+
+    CHECK(sendSeqAt(USBMIDI.now(), 7));        // Scheduling works again
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), seqPacket(7));
+}
+
+int main() {
+    test_time_order();
+    test_same_time_order();
+    test_past_and_future();
+    test_capacity();
+    test_reset_with_pending();
+    return check_report("test_schedule");
+}
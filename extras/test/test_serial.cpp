@@ -0,0 +1,252 @@
+// Serial MIDI parser and encoder round trips, and the bridge on both USB
+// settings (built with WCH_USBMIDI_MIDI2=1, so SysEx goes as UMPs on alt 1)
+
+#include "check.h"
+#include "USBMIDISerialBridge.h"
+#include "USBMIDIUMP.h"
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::vector<uint32_t> parseAll(USBMIDISerialParser& parser, const Bytes& bytes) {
+    std::vector<uint32_t> packets;
+    uint32_t out[2];
+    for(uint8_t b : bytes) {
+        uint8_t n = parser.parse(b, out);
+        packets.insert(packets.end(), out, out + n);
+    }
+    return packets;
+}
+
+static Bytes encodeAll(USBMIDISerialEncoder& encoder, const std::vector<uint32_t>& packets) {
+    Bytes bytes;
+    uint8_t out[3];
+    for(uint32_t p : packets) {
+        uint8_t n = encoder.encode(p, out);
+        bytes.insert(bytes.end(), out, out + n);
+    }
+    return bytes;
+}
+
+// A stream with every kind of message: channel messages in runs (sent with
+// and without running status), SysEx of 0-20 data bytes, System Common, and
+// clock bytes dropped in at random points, also inside SysEx and messages
+static Bytes mixedStream(uint32_t seed, Bytes* canonical) {
+    Bytes bytes;
+    uint32_t rng = seed;
+    auto next = [&rng](uint32_t range) { rng = rng * 1103515245 + 12345; return (rng >> 16) % range; };
+    uint8_t running = 0;
+    for(int m = 0; m < 400; m++) {
+        Bytes msg;
+        uint32_t kind = next(10);
+        if(kind < 6) {
+            static const uint8_t types[] = { 0x80, 0x90, 0xA0, 0xB0, 0xC0, 0xD0, 0xE0 };
+            uint8_t status = types[next(7)] | next(2);
+            msg.push_back(status);
+            msg.push_back(next(128));
+            if((status & 0xE0) != 0xC0) msg.push_back(next(128));
+        } else if(kind < 8) {
+            msg.push_back(0xF0);
+            for(uint32_t i = next(21); i > 0; i--) msg.push_back(next(128));
+            msg.push_back(0xF7);
+        } else {
+            static const uint8_t common[] = { 0xF1, 0xF2, 0xF3, 0xF6 };
+            uint8_t status = common[next(4)];
+            msg.push_back(status);
+            if(status != 0xF6) msg.push_back(next(128));
+            if(status == 0xF2) msg.push_back(next(128));
+        }
+        canonical->insert(canonical->end(), msg.begin(), msg.end());
+        bool skipStatus = msg[0] < 0xF0 && msg[0] == running && next(2);
+        running = msg[0] < 0xF0 ? msg[0] : 0;
+        for(size_t i = skipStatus ? 1 : 0; i < msg.size(); i++) {
+            if(next(8) == 0) bytes.push_back(0xF8);
+            bytes.push_back(msg[i]);
+        }
+    }
+    return bytes;
+}
+
+static Bytes withoutClock(const Bytes& bytes) {
+    Bytes out;
+    for(uint8_t b : bytes) if(b != 0xF8) out.push_back(b);
+    return out;
+}
+
+// Serial -> packets -> serial gives the same messages back, with running
+// status wherever the status repeats
+static void test_round_trip() {
+    for(uint32_t seed = 1; seed <= 5; seed++) {
+        Bytes canonical;
+        Bytes input = mixedStream(seed, &canonical);
+        USBMIDISerialParser parser(3);
+        USBMIDISerialEncoder encoder;
+        std::vector<uint32_t> packets = parseAll(parser, input);
+        uint32_t clocks = 0, wrongCable = 0;
+        for(uint32_t p : packets) {
+            clocks += p == USB_MIDI_PACKET(0x3F, 0xF8, 0, 0);
+            wrongCable += (USB_MIDI_BYTE(p, 0) >> 4) != 3;
+        }
+        CHECK_EQ(clocks, input.size() - withoutClock(input).size());
+        CHECK_EQ(wrongCable, 0);
+
+        Bytes output = encodeAll(encoder, packets);
+        USBMIDISerialParser again(3);
+        CHECK(parseAll(again, output) == packets);
+
+        // The canonical stream with running status applied is what comes out
+        Bytes expected;
+        uint8_t running = 0;
+        for(size_t i = 0; i < canonical.size(); i++) {
+            uint8_t b = canonical[i];
+            if(b & 0x80) {
+                bool channel = b < 0xF0;
+                if(channel && b == running) continue;
+                running = channel ? b : 0;
+            }
+            expected.push_back(b);
+        }
+        CHECK(withoutClock(output) == expected);
+    }
+}
+
+// A run of notes on one channel: a third of the bytes saved, and clock in
+// the middle of the run does not break it
+static void test_running_status() {
+    USBMIDISerialEncoder encoder;
+    std::vector<uint32_t> packets;
+    for(uint8_t i = 0; i < 30; i++) {
+        packets.push_back(USB_MIDI_PACKET(0x09, 0x90, 40 + i, 100));
+        if(i == 10) packets.push_back(USB_MIDI_PACKET(0x0F, 0xF8, 0, 0));
+    }
+    CHECK_EQ(encodeAll(encoder, packets).size(), 1 + 30 * 2 + 1);
+    packets.push_back(USB_MIDI_PACKET(0x05, 0xF6, 0, 0)); // System Common ends it
+    packets.push_back(USB_MIDI_PACKET(0x09, 0x90, 40, 0));
+    encoder.reset();
+    Bytes bytes = encodeAll(encoder, packets);
+    CHECK_EQ(bytes.size(), 1 + 30 * 2 + 1 + 1 + 3);
+}
+
+// A Stream stand-in: bytes to read, and what was written
+struct FakePort {
+    Bytes in, out;
+    size_t pos = 0;
+    int available() { return (int)(in.size() - pos); }
+    int read() { return in[pos++]; }
+    size_t write(const uint8_t* bytes, size_t n) { out.insert(out.end(), bytes, bytes + n); return n; }
+};
+
+static FakePort port;
+static USBMIDISerialBridge<FakePort> bridge(port, 1);
+
+static void onPacket(uint32_t packet, uint32_t timestamp) {
+    (void)timestamp;
+    bridge.write(packet);
+}
+
+static void onUMP(const uint32_t* words, uint8_t count, uint32_t timestamp) {
+    (void)count; (void)timestamp;
+    bridge.writeUMP(words);
+}
+
+static void start_bridge(uint8_t alt) {
+    start_device(alt);
+    port = FakePort();
+    bridge.reset();
+    USBMIDI.setHandlePacket(onPacket);
+    USBMIDI.setHandleUMP(onUMP);
+}
+
+// Runs the bridge until the port is read and the host has everything
+static std::vector<uint32_t> bridgeToHost() {
+    std::vector<uint32_t> words;
+    for(int i = 0; i < 500 && (port.available() || i < 5); i++) {
+        bridge.update();
+        sim_run_us(1000);
+        uint32_t w;
+        while(sim_host_read(&w, nullptr, 1)) words.push_back(w);
+    }
+    return words;
+}
+
+// SysEx of every length from 0 to 20 data bytes, serial -> USB -> serial
+static Bytes sysexSet() {
+    Bytes bytes;
+    for(uint8_t length = 0; length <= 20; length++) {
+        bytes.push_back(0xF0);
+        for(uint8_t i = 0; i < length; i++) bytes.push_back((length * 7 + i) & 0x7F);
+        bytes.push_back(0xF7);
+    }
+    return bytes;
+}
+
+// USB-MIDI setting: SysEx as packets both ways
+static void test_bridge_sysex_packets() {
+    start_bridge(0);
+    port.in = sysexSet();
+    std::vector<uint32_t> got = bridgeToHost();
+    USBMIDISerialParser parser(1);
+    CHECK(got == parseAll(parser, port.in));
+
+    sim_host_send(got.data(), (uint32_t)got.size());
+    for(int i = 0; i < 20; i++) {
+        sim_run_us(1000);
+        USBMIDI.poll();
+    }
+    CHECK(port.out == port.in);
+}
+
+// MIDI 2.0 setting: serial SysEx repacked into 7-bit SysEx UMPs on the
+// bridge's group, and SysEx UMPs from the host written out as bytes
+static void test_bridge_sysex_ump() {
+    start_bridge(1);
+    CHECK(USBMIDI.umpActive());
+    port.in = sysexSet();
+    port.in.push_back(0x91);                  // A note after it still gets through
+    port.in.push_back(60);
+    port.in.push_back(100);
+    std::vector<uint32_t> got = bridgeToHost();
+
+    Bytes rebuilt;
+    uint32_t notes = 0, others = 0, badGroup = 0;
+    for(size_t i = 0; i < got.size(); i += UMP_WORD_COUNT(got[i])) {
+        uint8_t mt = got[i] >> 28;
+        if(mt == UMP_MT_SYSEX7 && i + 1 < got.size()) {
+            uint8_t data[8];
+            bool last;
+            uint8_t n = usbmidiUMPSysEx(&got[i], data, &last);
+            rebuilt.insert(rebuilt.end(), data, data + n);
+            badGroup += ((got[i] >> 24) & 0x0F) != 1;
+        } else if(mt == UMP_MT_MIDI2 && ((got[i] >> 16) & 0xFF) == 0x91) {
+            notes++;
+        } else {
+            others++;
+        }
+    }
+    CHECK(rebuilt == sysexSet());
+    CHECK_EQ(badGroup, 0);
+    CHECK_EQ(notes, 1);
+    CHECK_EQ(others, 0);
+
+    // Back out of the port: the same bytes, realtime aside
+    std::vector<uint32_t> sysex;
+    for(size_t i = 0; i < got.size(); i += UMP_WORD_COUNT(got[i])) {
+        if((got[i] >> 28) == UMP_MT_SYSEX7) sysex.insert(sysex.end(), &got[i], &got[i] + 2);
+    }
+    for(size_t i = 0; i < sysex.size(); i += 16) {
+        sim_host_send(&sysex[i], (uint32_t)(sysex.size() - i < 16 ? sysex.size() - i : 16));
+        sim_run_us(2000);
+        USBMIDI.poll();
+    }
+    CHECK(port.out == sysexSet());
+    USBMIDI.setHandleUMP(nullptr);
+    USBMIDI.setHandlePacket(nullptr);
+}
+
+int main() {
+    test_round_trip();
+    test_running_status();
+    test_bridge_sysex_packets();
+    test_bridge_sysex_ump();
+    return check_report("test_serial");
+}
@@ -0,0 +1,140 @@
+// State cache: what it records, the changed flags the take*() calls hand
+// out, Reset All Controllers, and updates from interrupt dispatch
+
+#include "check.h"
+#include "USBMIDIStateCache.h"
+#include <vector>
+
+static uint32_t cc(uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | channel, control, value);
+}
+
+static std::vector<int> takeAllCC(USBMIDIStateCache& cache, uint8_t channel) {
+    std::vector<int> controls;
+    int control;
+    while((control = cache.takeChangedCC(channel)) >= 0) controls.push_back(control);
+    return controls;
+}
+
+static void test_tracking() {
+    USBMIDIStateCache cache;
+    CHECK_EQ(cache.changedChannels(), 0);
+    cache.update(USB_MIDI_PACKET(0x09, 0x93, 60, 100));
+    cache.update(USB_MIDI_PACKET(0x09, 0x93, 100, 1));
+    cache.update(USB_MIDI_PACKET(0x09, 0x93, 64, 0));  // Note On 0 for a note not held
+    CHECK(cache.noteOn(3, 60) && cache.noteOn(3, 100) && !cache.noteOn(3, 64));
+    CHECK_EQ(cache.activeNoteCount(3), 2);
+    std::vector<uint8_t> held;
+    cache.forEachActiveNote(3, [&](uint8_t n) { held.push_back(n); });
+    CHECK(held == std::vector<uint8_t>({ 60, 100 }));
+    cache.update(USB_MIDI_PACKET(0x08, 0x83, 60, 64));
+    CHECK_EQ(cache.activeNoteCount(3), 1);
+
+    cache.update(cc(5, 7, 90));
+    cache.update(USB_MIDI_PACKET(0x0C, 0xC5, 42, 0));
+    cache.update(USB_MIDI_PACKET(0x0D, 0xD5, 77, 0));
+    cache.update(USB_MIDI_PACKET(0x0E, 0xE5, 0x00, 0x00));
+    CHECK_EQ(cache.cc(5, 7), 90);
+    CHECK_EQ(cache.program(5), 42);
+    CHECK_EQ(cache.pressure(5), 77);
+    CHECK_EQ(cache.pitchBend(5), -8192);
+    cache.update(USB_MIDI_PACKET(0x0E, 0xE5, 0x7F, 0x7F));
+    CHECK_EQ(cache.pitchBend(5), 8191);
+    CHECK_EQ(cache.cc(4, 7), 0);              // Other channels untouched
+
+    cache.update(cc(3, 123, 0));              // All Notes Off
+    CHECK_EQ(cache.activeNoteCount(3), 0);
+    cache.reset();
+    CHECK_EQ(cache.cc(5, 7), 0);
+    CHECK_EQ(cache.program(5), 0);
+    CHECK_EQ(cache.changedChannels(), 0);
+}
+
+// Flags are set by changes only, and each is handed out once
+static void test_changes() {
+    USBMIDIStateCache cache;
+    cache.update(cc(2, 10, 64));
+    cache.update(cc(2, 1, 5));
+    cache.update(cc(2, 10, 64));              // Same value: no change
+    cache.update(USB_MIDI_PACKET(0x09, 0x92, 60, 100));
+    cache.update(USB_MIDI_PACKET(0x0E, 0xE9, 0x00, 0x40)); // Centered: no change
+    CHECK_EQ(cache.changedChannels(), 1 << 2);
+    CHECK_EQ(cache.takeChanges(2), USBMIDIStateCache::CHANGED_CC | USBMIDIStateCache::CHANGED_NOTES);
+    CHECK_EQ(cache.takeChanges(2), USBMIDIStateCache::CHANGED_CC); // Until every CC is taken
+    CHECK(takeAllCC(cache, 2) == std::vector<int>({ 1, 10 }));
+    CHECK_EQ(cache.takeChanges(2), 0);
+    CHECK_EQ(cache.changedChannels(), 0);
+
+    cache.update(cc(7, 100, 1));
+    cache.update(USB_MIDI_PACKET(0x0C, 0xC7, 3, 0));
+    CHECK(takeAllCC(cache, 7) == std::vector<int>({ 100 }));
+    CHECK_EQ(cache.changedChannels(), 1 << 7);    // The program is still pending
+    CHECK_EQ(cache.takeChanges(7), USBMIDIStateCache::CHANGED_PROGRAM);
+    CHECK_EQ(cache.changedChannels(), 0);
+}
+
+// CC 121 resets the performance controllers and keeps the mix settings
+static void test_reset_all_controllers() {
+    USBMIDIStateCache cache;
+    cache.update(cc(0, 1, 100));
+    cache.update(cc(0, 7, 90));
+    cache.update(cc(0, 10, 20));
+    cache.update(cc(0, 11, 30));
+    cache.update(cc(0, 64, 127));
+    cache.update(USB_MIDI_PACKET(0x0C, 0xC0, 9, 0));
+    cache.update(USB_MIDI_PACKET(0x0D, 0xD0, 50, 0));
+    cache.update(USB_MIDI_PACKET(0x0E, 0xE0, 0, 0x60));
+    cache.update(USB_MIDI_PACKET(0x09, 0x90, 60, 100));
+    cache.takeChanges(0);
+    takeAllCC(cache, 0);
+
+    cache.update(cc(0, 121, 0));
+    CHECK_EQ(cache.cc(0, 1), 0);
+    CHECK_EQ(cache.cc(0, 11), 127);
+    CHECK_EQ(cache.cc(0, 64), 0);
+    CHECK_EQ(cache.pressure(0), 0);
+    CHECK_EQ(cache.pitchBend(0), 0);
+    CHECK_EQ(cache.cc(0, 7), 90);
+    CHECK_EQ(cache.cc(0, 10), 20);
+    CHECK_EQ(cache.program(0), 9);
+    CHECK(cache.noteOn(0, 60));
+    CHECK_EQ(cache.takeChanges(0), USBMIDIStateCache::CHANGED_CC | USBMIDIStateCache::CHANGED_PRESSURE
+                                 | USBMIDIStateCache::CHANGED_PITCHBEND);
+    CHECK(takeAllCC(cache, 0) == std::vector<int>({ 1, 11, 64 }));
+}
+
+// Attached to the cable, in both dispatch modes: the cache sees what the
+// callbacks see, and take*() from the loop leaves the receive interrupt
+// enabled again
+static void test_on_cable(bool interruptDispatch) {
+    start_device();
+    USBMIDIStateCache cache;
+    USBMIDI.setStateCache(&cache);
+    USBMIDI.setInterruptDispatch(interruptDispatch);
+    std::vector<uint32_t> packets;
+    for(uint8_t v = 0; v < 40; v++) packets.push_back(cc(v & 3, 20 + v, v + 1));
+    packets.push_back(USB_MIDI_PACKET(0x09, 0x91, 48, 90));
+    sim_host_send(packets.data(), (uint32_t)packets.size());
+    uint32_t taken = 0;
+    for(int i = 0; i < 10; i++) {
+        sim_run_us(500);
+        if(!interruptDispatch) USBMIDI.poll();
+        for(uint8_t ch = 0; ch < 4; ch++) taken += (uint32_t)takeAllCC(cache, ch).size();
+        CHECK(sim_irq_enabled(USBFS_IRQn));
+    }
+    CHECK_EQ(taken, 40);
+    CHECK(cache.noteOn(1, 48));
+    CHECK_EQ(cache.cc(3, 59), 40);
+    CHECK_EQ(cache.takeChanges(1), USBMIDIStateCache::CHANGED_NOTES);
+    USBMIDI.setInterruptDispatch(false);
+    USBMIDI.setStateCache(nullptr);
+}
+
+int main() {
+    test_tracking();
+    test_changes();
+    test_reset_all_controllers();
+    test_on_cable(false);
+    test_on_cable(true);
+    return check_report("test_state_cache");
+}
@@ -0,0 +1,158 @@
+// SysEx streaming in both directions, across full queues
+
+#include "check.h"
+#include <vector>
+
+static std::vector<uint8_t> message(size_t length) {
+    std::vector<uint8_t> data(length);
+    data[0] = 0xF0;
+    for(size_t i = 1; i + 1 < length; i++) data[i] = (uint8_t)((i * 7) & 0x7F);
+    data[length - 1] = 0xF7;
+    return data;
+}
+
+// SysEx bytes of USB-MIDI packets (CIN 0x4-0x7)
+static std::vector<uint8_t> unpack(const std::vector<uint32_t>& packets) {
+    static const uint8_t sizes[4] = { 3, 1, 2, 3 };
+    std::vector<uint8_t> bytes;
+    for(uint32_t p : packets) {
+        uint8_t cin = p & 0x0F;
+        if(cin < 0x04 || cin > 0x07) continue;
+        for(uint8_t i = 0; i < sizes[cin - 4]; i++) bytes.push_back(USB_MIDI_BYTE(p, 1 + i));
+    }
+    return bytes;
+}
+
+static std::vector<uint32_t> pack(const std::vector<uint8_t>& data) {
+    std::vector<uint32_t> packets;
+    for(size_t i = 0; i < data.size(); i += 3) {
+        size_t left = data.size() - i;
+        uint8_t cin = left > 3 ? 0x04 : (uint8_t)(0x04 + left);
+        packets.push_back(USB_MIDI_PACKET(cin, data[i], left > 1 ? data[i + 1] : 0, left > 2 ? data[i + 2] : 0));
+    }
+    return packets;
+}
+
+static std::vector<uint32_t> hostAll() {
+    std::vector<uint32_t> words;
+    uint32_t w;
+    while(sim_host_read(&w, nullptr, 1)) words.push_back(w);
+    return words;
+}
+
+static void test_send_streams() {
+    start_device();
+    std::vector<uint8_t> data = message(3000);
+    CHECK(USBMIDI.sendSysEx(data.data(), data.size()));
+    sim_run_us(5000);
+    std::vector<uint32_t> packets = hostAll();
+    CHECK_EQ(packets.size(), 1000);
+    CHECK(unpack(packets) == data);
+    // The FIFO stayed full, so transfers went out full
+    CHECK(USBMIDI.getStats().txTransfers <= 1000 / 16 + 2);
+
+    // F0/F7 added when left out
+    CHECK(USBMIDI.sendSysEx(data.data() + 1, data.size() - 2));
+    sim_run_us(5000);
+    CHECK(unpack(hostAll()) == data);
+}
+
+// A host that polls IN rarely keeps the FIFO full for most of the message
+static void test_send_slow_host() {
+    start_device();
+    sim_host_slot_us(400);
+    std::vector<uint8_t> data = message(2000);
+    CHECK(USBMIDI.sendSysEx(data.data(), data.size()));
+    sim_run_us(10000);
+    CHECK(unpack(hostAll()) == data);
+    CHECK_EQ(USBMIDI.getStats().txHighWater, 64);
+    sim_host_slot_us(50);
+}
+
+// Nobody reading: gives up after WCH_USBMIDI_TX_TIMEOUT_MS
+static void test_send_timeout() {
+    start_device();
+    sim_host_reading(0);
+    std::vector<uint8_t> data = message(1000);
+    uint32_t start = sim_time_us();
+    CHECK(!USBMIDI.sendSysEx(data.data(), data.size()));
+    uint32_t took = sim_time_us() - start;           // millis() resolution
+    CHECK(took > (WCH_USBMIDI_TX_TIMEOUT_MS - 1) * 1000 && took < (WCH_USBMIDI_TX_TIMEOUT_MS + 10) * 1000);
+    sim_host_reading(1);
+}
+
+static std::vector<uint8_t> chunks;
+static int lastFlags, chunkCount;
+static void onChunk(const uint8_t* data, uint8_t length, bool last) {
+    chunks.insert(chunks.end(), data, data + length);
+    chunkCount++;
+    if(last) lastFlags++;
+}
+
+static size_t wholeLength;
+static bool wholeOverflow;
+static int wholeCount;
+static void onSysEx(const uint8_t* data, size_t length, bool overflow) {
+    (void)data;
+    wholeLength = length;
+    wholeOverflow = overflow;
+    wholeCount++;
+}
+
+// Receiving: chunks come through in order however slowly loop() reads
+static void test_receive_streams() {
+    start_device();
+    USBMIDI.setHandleSysExChunk(onChunk);
+    chunks.clear();
+    lastFlags = chunkCount = 0;
+    std::vector<uint8_t> data = message(3000);
+    std::vector<uint32_t> packets = pack(data);
+    sim_host_send(packets.data(), packets.size());
+    for(int i = 0; i < 400 && (sim_host_out_pending() || USB_available()); i++) {
+        USBMIDI.poll();
+        sim_run_us(700);                        // Slow loop: EP2 OUT NAKs meanwhile
+    }
+    USBMIDI.poll();
+    CHECK(chunks == data);
+    CHECK_EQ(lastFlags, 1);
+    CHECK_EQ(chunkCount, 1000);
+    CHECK(USBMIDI.getStats().rxNaks > 0);
+    USBMIDI.setHandleSysExChunk(nullptr);
+}
+
+// Whole-message callback: the buffer keeps what fits and flags the rest
+static void test_receive_buffered() {
+    start_device();
+    static uint8_t buffer[256];
+    USBMIDI.setSysExBuffer(buffer, sizeof(buffer));
+    USBMIDI.setHandleSysEx(onSysEx);
+    wholeCount = 0;
+
+    std::vector<uint8_t> small = message(100);
+    std::vector<uint32_t> packets = pack(small);
+    sim_host_send(packets.data(), packets.size());
+    for(int i = 0; i < 20; i++) { USBMIDI.poll(); sim_run_us(500); }
+    CHECK_EQ(wholeCount, 1);
+    CHECK_EQ(wholeLength, 100);
+    CHECK(!wholeOverflow);
+    CHECK(memcmp(buffer, small.data(), 100) == 0);
+
+    std::vector<uint8_t> large = message(1000);
+    packets = pack(large);
+    sim_host_send(packets.data(), packets.size());
+    for(int i = 0; i < 40; i++) { USBMIDI.poll(); sim_run_us(500); }
+    CHECK_EQ(wholeCount, 2);
+    CHECK_EQ(wholeLength, 256);
+    CHECK(wholeOverflow);
+    USBMIDI.setHandleSysEx(nullptr);
+    USBMIDI.setSysExBuffer(nullptr, 0);
+}
+
+int main() {
+    test_send_streams();
+    test_send_slow_host();
+    test_send_timeout();
+    test_receive_streams();
+    test_receive_buffered();
+    return check_report("test_sysex");
+}
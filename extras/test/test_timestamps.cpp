@@ -0,0 +1,137 @@
+// The SOF frame clock and interrupt timing with SysTick reloading every
+// millisecond (the Arduino core's setup), reloading from HCLK/8, and free
+// running
+
+#include "check.h"
+
+struct TimerSetup {
+    const char* name;
+    uint8_t hclk;
+    uint32_t reload;            // 0 = free running
+};
+
+static const TimerSetup setups[] = {
+    { "HCLK, 1 ms reload", 1, 48000 },
+    { "HCLK/8, 1 ms reload", 0, 6000 },
+    { "HCLK, free running", 1, 0 },
+};
+
+// SysTick restarted a third of the way into a frame, as it would be at any
+// phase to the host's frames on a board
+static void start_timestamps(const TimerSetup& setup) {
+    start_device();
+    sim_run_us(1000 - sim_time_us() % 1000 + 333);
+    sim_systick_config(setup.hclk, setup.reload);
+    USBMIDI.enableTimestamps();
+    sim_run_us(3000);
+}
+
+// now() keeps pace with bus time at every point of the frame
+static void test_now_tracks_time(const TimerSetup& setup) {
+    start_timestamps(setup);
+    uint32_t startNow = USBMIDI.now(), start = sim_time_us(), off = 0;
+    while(sim_time_us() - start < 50000) {
+        int32_t error = (int32_t)((USBMIDI.now() - startNow) - (sim_time_us() - start));
+        if(error < -20 || error > 20) off++;
+        sim_run_us(7);
+    }
+    CHECK_EQ(off, 0);
+    USBMIDI.enableTimestamps(false);
+}
+
+// Receive timestamps fall between the send and the callback
+static uint32_t packetTime;
+static void onPacket(uint32_t packet, uint32_t timestamp) {
+    (void)packet;
+    packetTime = timestamp;
+}
+
+static void test_receive_time(const TimerSetup& setup) {
+    start_timestamps(setup);
+    USBMIDI.setHandlePacket(onPacket);
+    uint32_t bad = 0;
+    for(uint32_t i = 0; i < 50; i++) {
+        sim_run_us(313);
+        uint32_t sent = USBMIDI.now(), packet = USB_MIDI_PACKET(0x09, 0x90, 60, 1);
+        packetTime = 0;
+        sim_host_send(&packet, 1);
+        sim_run_us(1500);
+        USBMIDI.poll();
+        if(packetTime - sent > 1100) bad++;  // Next OUT slot within the frame
+    }
+    CHECK_EQ(bad, 0);
+    USBMIDI.setHandlePacket(nullptr);
+    USBMIDI.enableTimestamps(false);
+}
+
+// sendAt() releases in the first frame at or after the given time
+static void test_send_at(const TimerSetup& setup) {
+    start_timestamps(setup);
+    uint32_t due = USBMIDI.now() + 5000, word = 0, arrived = 0;
+    uint32_t offset = sim_time_us() - USBMIDI.now();
+    CHECK(USBMIDI.sendAt(due, 0x0B, 0xB0, 1, 2));
+    for(int i = 0; i < 8000 && !word; i++) {
+        sim_run_us(1);
+        sim_host_read(&word, &arrived, 1);
+    }
+    CHECK_EQ(word, USB_MIDI_PACKET(0x0B, 0xB0, 1, 2));
+    int32_t late = (int32_t)(arrived - offset - due);
+    CHECK(late >= 0 && late < 1100);
+    USBMIDI.enableTimestamps(false);
+}
+
+// The USB interrupt masked for 2-5 ms loses the SOFs meanwhile: a free
+// running timer counts them back, a reloading one cannot but must not jump
+static void test_missed_sofs(const TimerSetup& setup) {
+    start_timestamps(setup);
+    uint32_t bad = 0;
+    for(uint32_t masked = 2100; masked < 5000; masked += 173) {
+        SimHostStats host;
+        sim_host_stats(&host);
+        uint32_t lostBefore = host.sofLost, before = USBMIDI.now(), start = sim_time_us();
+        NVIC_DisableIRQ(USBFS_IRQn);
+        sim_run_us(masked);
+        NVIC_EnableIRQ(USBFS_IRQn);
+        sim_run_us(1500);
+        sim_host_stats(&host);
+        int32_t lag = (int32_t)((sim_time_us() - start) - (USBMIDI.now() - before));
+        bool ok = setup.reload ? lag >= 0 && lag <= (int32_t)masked : lag > -50 && lag < 50;
+        if(host.sofLost == lostBefore || !ok) bad++;
+    }
+    CHECK_EQ(bad, 0);
+    USBMIDI.enableTimestamps(false);
+}
+
+// isrMaxTicks across hundreds of interrupts, some of them straddling a
+// reload: the longest one is short, not a wrapped count
+static void test_isr_max_ticks(const TimerSetup& setup) {
+    start_device();
+    sim_systick_config(setup.hclk, setup.reload);
+    USBMIDI.resetStats();
+    sim_jitter(200, 3);
+    uint32_t start = sim_time_us(), seq = 0;
+    while(sim_time_us() - start < 50000) {
+        uint32_t packet = USB_MIDI_PACKET(0x0B, 0xB0, seq & 0x7F, 0);
+        if(USB_write(&packet, 1)) seq++;
+        uint32_t word;
+        while(sim_host_read(&word, nullptr, 1)) {}
+        sim_run_us(3);
+    }
+    sim_jitter(0, 0);
+    USBMIDIStats stats = USBMIDI.getStats();
+    uint32_t ticksPerUs = setup.hclk ? SIM_CPU_MHZ : SIM_CPU_MHZ / 8;
+    CHECK(stats.isrCount > 500);
+    CHECK(stats.isrMaxTicks > 0);
+    CHECK(stats.isrMaxTicks < 100 * ticksPerUs);
+}
+
+int main() {
+    for(const TimerSetup& setup : setups) {
+        test_now_tracks_time(setup);
+        test_receive_time(setup);
+        test_send_at(setup);
+        test_missed_sofs(setup);
+        test_isr_max_ticks(setup);
+    }
+    return check_report("test_timestamps");
+}
@@ -0,0 +1,164 @@
+// Transform tables: each stage on its own, their order, the channel sets,
+// and the input and output hooks of a cable
+
+#include "check.h"
+
+static uint32_t note(uint8_t cin, uint8_t channel, uint8_t key, uint8_t velocity) {
+    return USB_MIDI_PACKET(cin, (cin << 4) | channel, key, velocity);
+}
+static uint32_t cc(uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(0x0B, 0xB0 | channel, control, value);
+}
+
+// Applied to a copy: the packet out, or 0 if filtered
+static uint32_t run(const USBMIDITransform& t, uint32_t packet) {
+    return t.apply(packet) ? packet : 0;
+}
+
+// Nothing set: every channel message, and everything else, passes as is
+static void test_identity() {
+    USBMIDITransform t;
+    uint32_t changed = 0;
+    for(uint8_t cin = 0x02; cin <= 0x0F; cin++) {
+        for(uint8_t ch = 0; ch < 16; ch++) {
+            for(uint8_t d = 0; d < 128; d += 9) {
+                uint8_t status = cin >= 0x08 && cin <= 0x0E ? (cin << 4) | ch : 0xF8;
+                uint32_t p = USB_MIDI_PACKET(0x20 | cin, status, d, 127 - d);
+                changed += run(t, p) != p;
+            }
+        }
+    }
+    CHECK_EQ(changed, 0);
+    CHECK_EQ(sizeof(USBMIDITransform), 550); // The RAM figure in the README
+}
+
+static void test_filter_and_remap() {
+    USBMIDITransform t;
+    t.filter(0x00FF, USBMIDITransform::PROGRAM);
+    t.filter(0xFFFE, USBMIDITransform::NOTES);
+    t.remapChannel(3, 9);
+    CHECK_EQ(run(t, USB_MIDI_PACKET(0x0C, 0xC7, 5, 0)), USB_MIDI_PACKET(0x0C, 0xC7, 5, 0));
+    CHECK_EQ(run(t, USB_MIDI_PACKET(0x0C, 0xC8, 5, 0)), 0);
+    CHECK_EQ(run(t, note(0x09, 0, 60, 100)), 0);
+    CHECK_EQ(run(t, note(0x08, 0, 60, 0)), 0);
+    CHECK_EQ(run(t, note(0x0A, 0, 60, 10)), 0);        // Poly pressure counts as notes
+    CHECK_EQ(run(t, cc(0, 7, 100)), cc(0, 7, 100));      // Other types untouched
+    CHECK_EQ(run(t, note(0x09, 3, 60, 100)), note(0x09, 9, 60, 100));
+    CHECK_EQ(run(t, USB_MIDI_PACKET(0x0E, 0xE3, 0, 64)), USB_MIDI_PACKET(0x0E, 0xE9, 0, 64));
+    CHECK_EQ(run(t, USB_MIDI_PACKET(0x0F, 0xF8, 0, 0)), USB_MIDI_PACKET(0x0F, 0xF8, 0, 0));
+    CHECK_EQ(run(t, USB_MIDI_PACKET(0x04, 0xF0, 1, 2)), USB_MIDI_PACKET(0x04, 0xF0, 1, 2));
+}
+
+// A split: keys below 60 go to channel 2 an octave up, only on channel 0;
+// the zone wins over the channel remap. Note Off and poly pressure follow.
+static void test_keys() {
+    USBMIDITransform t;
+    t.keyZone(0, 59, 2, 0x0001);
+    t.transpose(12, 0x0001, 0, 59);
+    t.remapChannel(0, 5);
+    CHECK_EQ(run(t, note(0x09, 0, 48, 90)), note(0x09, 2, 60, 90));
+    CHECK_EQ(run(t, note(0x08, 0, 48, 0)), note(0x08, 2, 60, 0));
+    CHECK_EQ(run(t, note(0x0A, 0, 48, 7)), note(0x0A, 2, 60, 7));
+    CHECK_EQ(run(t, note(0x09, 0, 72, 90)), note(0x09, 5, 72, 90));
+    CHECK_EQ(run(t, note(0x09, 1, 48, 90)), note(0x09, 1, 48, 90)); // Not a key channel
+
+    USBMIDITransform up;
+    up.transpose(24);
+    CHECK_EQ(run(up, note(0x09, 0, 103, 1)), note(0x09, 0, 127, 1));
+    CHECK_EQ(run(up, note(0x09, 0, 104, 1)), 0);                    // Past 127
+    up.mapNote(36, USBMIDITransform::DROP);
+    CHECK_EQ(run(up, note(0x09, 4, 36, 1)), 0);
+    up.mapNote(38, 40);
+    CHECK_EQ(run(up, note(0x08, 4, 38, 0)), note(0x08, 4, 40, 0));
+}
+
+// Curves never turn a Note On into a Note Off, keep their end points and
+// are monotonic; Note Off velocity and other channels are left alone
+static void test_velocity() {
+    USBMIDITransform t;
+    t.velocityCurve(0.5f, 20, 110, 0x0002);
+    uint8_t last = 0;
+    uint32_t zero = 0, falling = 0;
+    for(uint8_t v = 1; v < 128; v++) {
+        uint8_t out = USB_MIDI_BYTE(run(t, note(0x09, 1, 60, v)), 3);
+        zero += out == 0;
+        falling += out < last;
+        last = out;
+    }
+    CHECK_EQ(zero, 0);
+    CHECK_EQ(falling, 0);
+    CHECK_EQ(USB_MIDI_BYTE(run(t, note(0x09, 1, 60, 1)), 3), 20 + 8); // sqrt(1/127) * 90, rounded
+    CHECK_EQ(USB_MIDI_BYTE(run(t, note(0x09, 1, 60, 127)), 3), 110);
+    CHECK(USB_MIDI_BYTE(run(t, note(0x09, 1, 60, 32)), 3) > 32 + 20); // Soft made louder
+    CHECK_EQ(run(t, note(0x09, 1, 60, 0)), note(0x09, 1, 60, 0));     // Note Off as Note On 0
+    CHECK_EQ(run(t, note(0x08, 1, 60, 64)), note(0x08, 1, 60, 64));
+    CHECK_EQ(run(t, note(0x09, 0, 60, 64)), note(0x09, 0, 60, 64));
+
+    USBMIDITransform fixed;
+    fixed.mapVelocity(50, 0);                 // Raised to 1, not a Note Off
+    fixed.mapVelocity(0, 99);                 // Ignored
+    CHECK_EQ(run(fixed, note(0x09, 0, 60, 50)), note(0x09, 0, 60, 1));
+    CHECK_EQ(run(fixed, note(0x09, 0, 60, 0)), note(0x09, 0, 60, 0));
+}
+
+static void test_controls() {
+    USBMIDITransform t;
+    t.mapControl(1, 74);
+    t.mapControl(7, USBMIDITransform::DROP, 0x0001);
+    CHECK_EQ(run(t, cc(3, 1, 64)), cc(3, 74, 64));
+    CHECK_EQ(run(t, cc(0, 7, 100)), 0);
+    CHECK_EQ(run(t, cc(0, 10, 100)), cc(0, 10, 100));
+    t.reset();
+    CHECK_EQ(run(t, cc(0, 7, 100)), cc(0, 7, 100));
+}
+
+// On a cable: the callbacks see the input transform's output, and note
+// tracking records what the output transform actually sent
+static uint8_t seenChannel, seenNote;
+static void onNoteOn(uint8_t channel, uint8_t key, uint8_t velocity) {
+    (void)velocity;
+    seenChannel = channel;
+    seenNote = key;
+}
+
+static void test_cable_hooks() {
+    start_device();
+    USBMIDITransform in, out;
+    in.transpose(-12);
+    in.remapChannel(0, 4);
+    out.transpose(7);
+    USBMIDI.setInputTransform(&in);
+    USBMIDI.setOutputTransform(&out);
+    USBMIDI.setHandleNoteOn(onNoteOn);
+
+    uint32_t packet = note(0x09, 0, 64, 100);
+    sim_host_send(&packet, 1);
+    sim_run_us(2000);
+    USBMIDI.poll();
+    CHECK_EQ(seenChannel, 4);
+    CHECK_EQ(seenNote, 52);
+
+    USBMIDI.sendNoteOn(2, 60, 100);
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), note(0x09, 2, 67, 100));
+    CHECK(USBMIDI.noteHeld(2, 67));
+    CHECK(!USBMIDI.noteHeld(2, 60));
+    USBMIDI.sendNoteOff(2, 60);
+    sim_run_us(2000);
+    CHECK_EQ(host_next(), note(0x08, 2, 67, 0));
+    CHECK(!USBMIDI.noteHeld(2, 67));
+
+    USBMIDI.setInputTransform(nullptr);
+    USBMIDI.setOutputTransform(nullptr);
+    USBMIDI.setHandleNoteOn(nullptr);
+}
+
+int main() {
+    test_identity();
+    test_filter_and_remap();
+    test_keys();
+    test_velocity();
+    test_controls();
+    test_cable_hooks();
+    return check_report("test_transform");
+}
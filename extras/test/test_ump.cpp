@@ -0,0 +1,151 @@
+// The USB MIDI 2.0 setting: UMP Stream discovery is answered by the library,
+// and raw packets are converted all or none (built with WCH_USBMIDI_MIDI2=1
+// and two cables)
+
+#include "check.h"
+#include <string>
+#include <vector>
+
+struct StreamMsg {
+    uint32_t words[4];
+    uint16_t status() const { return (words[0] >> 16) & 0x3FF; }
+    uint8_t format() const { return (words[0] >> 26) & 3; }
+};
+
+static std::vector<StreamMsg> hostStreams(uint32_t& others) {
+    std::vector<StreamMsg> streams;
+    uint32_t w;
+    others = 0;
+    while(sim_host_read(&w, nullptr, 1)) {
+        if((w >> 28) != 0xF) { others++; continue; }
+        StreamMsg s = { { w, 0, 0, 0 } };
+        CHECK_EQ(sim_host_read(&s.words[1], nullptr, 3), 3);
+        streams.push_back(s);
+    }
+    return streams;
+}
+
+// Text bytes of consecutive messages from the one at i, which must form a
+// whole complete or start..end sequence; first is the byte the text starts at
+static std::string streamText(const std::vector<StreamMsg>& s, size_t& i, uint8_t first) {
+    std::string text;
+    for(;;) {
+        for(uint8_t b = first; b < 16; b++) {
+            char c = (char)(s[i].words[b / 4] >> (8 * (3 - b % 4)));
+            if(c) text += c;
+        }
+        uint8_t format = s[i++].format();
+        if(format == 0 || format == 3 || i == s.size()) return text;
+    }
+}
+
+static int umpSeen;
+static void onUMP(const uint32_t* words, uint8_t count, uint32_t timestamp) {
+    (void)words; (void)count; (void)timestamp;
+    umpSeen++;
+}
+
+static void request(uint32_t w0, uint32_t w1) {
+    uint32_t ump[4] = { w0, w1, 0, 0 };
+    sim_host_send(ump, 4);
+    sim_run_us(2000);
+    USBMIDI.poll();
+    sim_run_us(3000);
+}
+
+static void test_endpoint_discovery() {
+    start_device(1);
+    CHECK(USBMIDI.umpActive());
+    USBMIDI.setHandleUMP(onUMP);
+    umpSeen = 0;
+    request(0xF0000101, 0x1F);                // UMP 1.1, everything but device identity
+    CHECK_EQ(umpSeen, 1);
+    uint32_t others;
+    std::vector<StreamMsg> s = hostStreams(others);
+    CHECK_EQ(others, 0);
+    CHECK(s.size() >= 5);
+    if(s.size() < 5) return;
+
+    size_t i = 0;
+    CHECK_EQ(s[i].status(), 0x001);            // Endpoint Info
+    CHECK_EQ(s[i].words[0] & 0xFFFF, 0x0101);
+    CHECK_EQ(s[i].words[1] >> 31, 1);          // Static function blocks
+    CHECK_EQ((s[i].words[1] >> 24) & 0x7F, WCH_USBMIDI_NUM_CABLES);
+    CHECK_EQ(s[i].words[1] & 0x300, 0x200);    // MIDI 2.0 protocol
+    i++;
+    CHECK_EQ(s[i].status(), 0x003);
+    CHECK(streamText(s, i, 2) == WCH_USBMIDI_PROD_STR);
+    CHECK_EQ(s[i].status(), 0x004);
+    CHECK_EQ(s[i].format(), 1);                // 26 characters: two messages
+    std::string serial = streamText(s, i, 2);
+    CHECK_EQ(serial.size(), WCH_USBMIDI_SERIAL_LEN);
+    CHECK(serial.compare(0, 2, WCH_USBMIDI_SERIAL_PREFIX) == 0);
+    CHECK(i < s.size() && s[i].status() == 0x006);
+    CHECK_EQ((s[i].words[0] >> 8) & 0xFF, 0x02);
+    CHECK_EQ(i + 1, s.size());
+    USBMIDI.setHandleUMP(nullptr);
+}
+
+static void test_stream_config() {
+    start_device(1);
+    request(0xF0050100, 0);                   // Request MIDI 1.0: the build uses 2.0
+    uint32_t others;
+    std::vector<StreamMsg> s = hostStreams(others);
+    CHECK_EQ(s.size(), 1);
+    CHECK(!s.empty() && s[0].status() == 0x006 && ((s[0].words[0] >> 8) & 0xFF) == 0x02);
+}
+
+static void test_function_blocks() {
+    start_device(1);
+    request(0xF010FF03, 0);                   // All blocks, info and name
+    uint32_t others;
+    std::vector<StreamMsg> s = hostStreams(others);
+    size_t i = 0;
+    for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) {
+        CHECK(i < s.size() && s[i].status() == 0x011);
+        if(i >= s.size()) return;
+        CHECK_EQ(s[i].words[0] & 0xFFFF, 0x8000 | (c << 8) | 0x33);
+        CHECK_EQ(s[i].words[1] >> 16, (c << 8) | 1);
+        i++;
+        CHECK(i < s.size() && s[i].status() == 0x012 && ((s[i].words[0] >> 8) & 0xFF) == c);
+        if(i >= s.size()) return;
+        std::string expected = std::string(WCH_USBMIDI_PROD_STR) + " " + std::to_string(c + 1);
+        CHECK(streamText(s, i, 3) == expected);
+    }
+    CHECK_EQ(i, s.size());
+
+    request(0xF0100101, 0);                   // Block 1, info only
+    s = hostStreams(others);
+    CHECK_EQ(s.size(), 1);
+    CHECK(!s.empty() && s[0].status() == 0x011 && ((s[0].words[0] >> 8) & 0x7F) == 1);
+}
+
+// sendPackets converts every packet before queueing any: what does not fit
+// or cannot be converted leaves nothing behind
+static void test_send_packets() {
+    start_device(1);
+    uint32_t packets[33];
+    for(uint32_t i = 0; i < 33; i++) packets[i] = USB_MIDI_PACKET(0x1B, 0xB1, i, 64);
+    CHECK_EQ(USBMIDI.sendPackets(packets, 33), 0);   // 66 words
+    uint32_t kept = packets[4];
+    packets[4] = USB_MIDI_PACKET(0x04, 0xF0, 0x7D, 0x01);
+    CHECK_EQ(USBMIDI.sendPackets(packets, 8), 0);
+    sim_run_us(3000);
+    CHECK_EQ(host_next(), 0);
+
+    packets[4] = kept;
+    CHECK_EQ(USBMIDI.sendPackets(packets, 32), 32);
+    sim_run_us(5000);
+    uint32_t words[66], bad = 0;
+    CHECK_EQ(sim_host_read(words, nullptr, 66), 64);
+    for(uint32_t i = 0; i < 32; i++) bad += words[2 * i] != (0x41B10000u | (i << 8));
+    CHECK_EQ(bad, 0);
+}
+
+int main() {
+    test_endpoint_discovery();
+    test_stream_config();
+    test_function_blocks();
+    test_send_packets();
+    return check_report("test_ump");
+}
@@ -1,39 +1,251 @@
 #include "USBMIDI.h"
+#include "USBMIDIUMP.h"
 
 USBMIDI_ USBMIDI;
 
+USBMIDI_::USBMIDI_() {
+#if WCH_USBMIDI_NUM_CABLES > 1
+    for(uint8_t i = 0; i < WCH_USBMIDI_NUM_CABLES - 1; i++) {
+        extraCables[i].cableNumber = i + 1;
+    }
+#endif
+}
+
 void USBMIDI_::begin() {
     USB_init();
 }
 
-void USBMIDI_::sendPacket(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3) {
-    uint8_t packet[4];
-    packet[0] = (cin & 0x0F); // Cable 0
-    packet[1] = b1;
-    packet[2] = b2;
-    packet[3] = b3;
-    USB_write(packet, 4);
+USBMIDICable& USBMIDI_::cable(uint8_t n) {
+#if WCH_USBMIDI_NUM_CABLES > 1
+    if(n > 0 && n < WCH_USBMIDI_NUM_CABLES) return extraCables[n - 1];
+#endif
+    (void)n;
+    return *this;
+}
+
+uint32_t USBMIDI_::sendPackets(const uint32_t* packets, uint32_t count) {
+#if WCH_USBMIDI_MIDI2
+    if(USB_ump_active()) {
+        // Converted in full first, so that one write queues all or none
+        uint32_t words[64];                   // The TX FIFO
+        uint32_t n = 0;
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t ump[2];
+            uint8_t len = usbmidiPacketToUMP(packets[i], ump, WCH_USBMIDI_MIDI2_PROTOCOL == 0x11);
+            if(!len || n + len > 64) return 0;
+            for(uint8_t j = 0; j < len; j++) words[n++] = ump[j];
+        }
+        return USB_write(words, n) == n ? count : 0;
+    }
+#endif
+    return USB_write(packets, count);
+}
+
+#if WCH_USBMIDI_MIDI2
+bool USBMIDI_::umpActive() {
+    return USB_ump_active();
+}
+
+bool USBMIDI_::sendUMP(const uint32_t* words, uint8_t count) {
+    if(!USB_ump_active() || count == 0 || count != UMP_WORD_COUNT(words[0])) return false;
+    return USB_write(words, count) == count;
+}
+
+void USBMIDI_::setHandleUMP(MidiCallbackUMP func) { cbUMP = func; }
+
+// UMP Stream status codes (UMP and MIDI 2.0 Protocol 1.1, section 7.1)
+#define STREAM_ENDPOINT_DISCOVERY  0x000
+#define STREAM_ENDPOINT_INFO       0x001
+#define STREAM_ENDPOINT_NAME       0x003
+#define STREAM_PRODUCT_INSTANCE_ID 0x004
+#define STREAM_CONFIG_REQUEST      0x005
+#define STREAM_CONFIG_NOTIFY       0x006
+#define STREAM_FB_DISCOVERY        0x010
+#define STREAM_FB_INFO             0x011
+#define STREAM_FB_NAME             0x012
+
+// Stream protocol code of WCH_USBMIDI_MIDI2_PROTOCOL: 2 MIDI 2.0, 1 MIDI 1.0
+#define STREAM_PROTOCOL (WCH_USBMIDI_MIDI2_PROTOCOL == 0x11 ? 0x02 : 0x01)
+
+// Replies wait for FIFO space from poll(), not inside the USB interrupt
+void USBMIDI_::sendStream(const uint32_t* ump) {
+    if(interruptDispatch) USB_write(ump, 4);
+    else cable(0).writeBlocking(ump, 4);
+}
+
+// Text as many messages as it takes, 14 bytes each (13 after the block
+// number of a Function Block Name), flagged complete/start/continue/end
+void USBMIDI_::sendStreamText(uint16_t status, int16_t block, const char* text, uint8_t length) {
+    uint8_t first = block < 0 ? 2 : 3, per = 16 - first, pos = 0;
+    do {
+        uint8_t n = length - pos < per ? length - pos : per;
+        uint32_t format = pos == 0 ? (n == length ? 0 : 1) : (pos + n == length ? 3 : 2);
+        uint32_t ump[4] = { 0xF0000000u | (format << 26) | ((uint32_t)status << 16), 0, 0, 0 };
+        if(block >= 0) ump[0] |= (uint32_t)block << 8;
+        for(uint8_t i = 0; i < n; i++) {
+            uint8_t b = first + i;
+            ump[b / 4] |= (uint32_t)(uint8_t)text[pos + i] << (8 * (3 - b % 4));
+        }
+        sendStream(ump);
+        pos += n;
+    } while(pos < length);
+}
+
+// One static function block per cable, matching the Group Terminal Blocks.
+// The protocol is fixed at build time, so a configuration request is
+// answered with the one in use. Other stream messages are left to the UMP
+// callback.
+void USBMIDI_::answerStream(const uint32_t* words) {
+    uint16_t status = (words[0] >> 16) & 0x3FF;
+    uint8_t filter = words[1] & 0xFF;
+    if(status == STREAM_ENDPOINT_DISCOVERY) {
+        if(filter & 0x01) {
+            uint32_t ump[4] = { 0xF0000000u | (STREAM_ENDPOINT_INFO << 16) | 0x0101,
+                                0x80000000u | ((uint32_t)WCH_USBMIDI_NUM_CABLES << 24)
+                                | (STREAM_PROTOCOL == 0x02 ? 0x200 : 0x100), 0, 0 };
+            sendStream(ump);
+        }
+        if(filter & 0x04) {
+            sendStreamText(STREAM_ENDPOINT_NAME, -1, WCH_USBMIDI_PROD_STR, WCH_USBMIDI_PROD_LEN);
+        }
+        if(filter & 0x08) {
+            char serial[WCH_USBMIDI_SERIAL_LEN];
+            for(uint8_t i = 0; i < WCH_USBMIDI_SERIAL_LEN; i++) serial[i] = (char)wch_usbmidi_SerDescr.bString[i];
+            sendStreamText(STREAM_PRODUCT_INSTANCE_ID, -1, serial, WCH_USBMIDI_SERIAL_LEN);
+        }
+        if(filter & 0x10) {
+            uint32_t ump[4] = { 0xF0000000u | (STREAM_CONFIG_NOTIFY << 16) | (STREAM_PROTOCOL << 8), 0, 0, 0 };
+            sendStream(ump);
+        }
+    } else if(status == STREAM_CONFIG_REQUEST) {
+        uint32_t ump[4] = { 0xF0000000u | (STREAM_CONFIG_NOTIFY << 16) | (STREAM_PROTOCOL << 8), 0, 0, 0 };
+        sendStream(ump);
+    } else if(status == STREAM_FB_DISCOVERY) {
+        uint8_t block = (words[0] >> 8) & 0xFF;
+        filter = words[0] & 0xFF;
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) {
+            if(block != 0xFF && block != c) continue;
+            if(filter & 0x01) {
+                // Active, bidirectional, sender and receiver; group c only
+                uint32_t ump[4] = { 0xF0000000u | (STREAM_FB_INFO << 16) | 0x8000 | ((uint32_t)c << 8) | 0x33,
+                                    ((uint32_t)c << 24) | (1u << 16), 0, 0 };
+                sendStream(ump);
+            }
+            if(filter & 0x02) {
+                char name[WCH_USBMIDI_PROD_LEN + 3];
+                uint8_t length = WCH_USBMIDI_PROD_LEN;
+                memcpy(name, WCH_USBMIDI_PROD_STR, length);
+                if(WCH_USBMIDI_NUM_CABLES > 1) {
+                    name[length++] = ' ';
+                    if(c >= 9) name[length++] = '1';
+                    name[length++] = '0' + (c + 1) % 10;
+                }
+                sendStreamText(STREAM_FB_NAME, c, name, length);
+            }
+        }
+    }
+}
+#endif
+
+void USBMIDI_::beginBatch() {
+    USB_batch_begin();
+}
+
+void USBMIDI_::endBatch() {
+    USB_batch_end();
+}
+
+void USBMIDI_::setCoalescing(bool enable) {
+    USB_set_coalescing(enable);
 }
 
 // --- Send Functions ---
 
-void USBMIDI_::sendNoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
+// Queues a USB-MIDI packet, as a UMP on the MIDI 2.0 setting
+bool USBMIDICable::writePacket(uint32_t packet) {
+#if WCH_USBMIDI_MIDI2
+    if(USB_ump_active()) {
+        uint32_t ump[2];
+        uint8_t count = usbmidiPacketToUMP(packet, ump, WCH_USBMIDI_MIDI2_PROTOCOL == 0x11);
+        return count && USB_write(ump, count) == count;
+    }
+#endif
+    return USB_write(&packet, 1) == 1;
+}
+
+bool USBMIDICable::sendPacket(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3) {
+    uint32_t packet = USB_MIDI_PACKET((cableNumber << 4) | (cin & 0x0F), b1, b2, b3);
+    if(outputTransform && !outputTransform->apply(packet)) return true;
+    // The queue and the note and parameter state change together, even with
+    // interrupt dispatch callbacks sending as well
+    USB_tx_lock();
+    bool queued = writePacket(packet);
+    if(queued) {
+#if WCH_USBMIDI_NOTE_TRACKING
+        // As sent, so releaseHeldNotes() needs no transform
+        trackNote(cin & 0x0F, USB_MIDI_BYTE(packet, 1), USB_MIDI_BYTE(packet, 2), USB_MIDI_BYTE(packet, 3));
+#endif
+        // A parameter number sent by hand (or a controller reset) leaves the
+        // receiver's selection unknown
+        if((cin & 0x0F) == 0x0B && ((b2 >= 98 && b2 <= 101) || b2 == 121)) {
+            txParam[b1 & 0x0F] = PARAM_NONE;
+        }
+    }
+    USB_tx_unlock();
+    return queued;
+}
+
+#if WCH_USBMIDI_NOTE_TRACKING
+// Called for packets actually queued: a refused Note On is not held, a
+// refused Note Off stays held and is released later
+void USBMIDICable::trackNote(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3) {
+    uint32_t* words = heldNotes[b1 & 0x0F];
+    uint32_t bit = 1ul << (b2 & 31);
+    if(cin == 0x09 && b3 > 0) {
+        words[(b2 >> 5) & 3] |= bit;
+    } else if(cin == 0x08 || cin == 0x09) {
+        words[(b2 >> 5) & 3] &= ~bit;
+    } else if(cin == 0x0B && (b2 == 120 || b2 == 123)) { // All Sound / Notes Off
+        words[0] = words[1] = words[2] = words[3] = 0;
+    }
+}
+
+bool USBMIDICable::releaseHeldNotes() {
+    for(uint8_t ch = 0; ch < 16; ch++) {
+        if(allNotesOff & (1u << ch)) {
+            if(!writePacket(USB_MIDI_PACKET((cableNumber << 4) | 0x0B, 0xB0 | ch, 123, 0))) return false;
+            allNotesOff &= ~(1u << ch);
+            heldNotes[ch][0] = heldNotes[ch][1] = heldNotes[ch][2] = heldNotes[ch][3] = 0;
+        }
+        for(uint8_t w = 0; w < 4; w++) {
+            while(heldNotes[ch][w]) {
+                uint8_t note = w * 32 + __builtin_ctz(heldNotes[ch][w]);
+                if(!writePacket(USB_MIDI_PACKET((cableNumber << 4) | 0x08, 0x80 | ch, note, 0))) return false;
+                heldNotes[ch][w] &= heldNotes[ch][w] - 1;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+void USBMIDICable::sendNoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
     sendPacket(0x09, 0x90 | (channel & 0x0F), note, velocity);
 }
 
-void USBMIDI_::sendNoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
+void USBMIDICable::sendNoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
     sendPacket(0x08, 0x80 | (channel & 0x0F), note, velocity);
 }
 
-void USBMIDI_::sendControlChange(uint8_t channel, uint8_t control, uint8_t value) {
+void USBMIDICable::sendControlChange(uint8_t channel, uint8_t control, uint8_t value) {
     sendPacket(0x0B, 0xB0 | (channel & 0x0F), control, value);
 }
 
-void USBMIDI_::sendProgramChange(uint8_t channel, uint8_t program) {
+void USBMIDICable::sendProgramChange(uint8_t channel, uint8_t program) {
     sendPacket(0x0C, 0xC0 | (channel & 0x0F), program, 0);
 }
 
-void USBMIDI_::sendPitchBend(uint8_t channel, int value) {
+void USBMIDICable::sendPitchBend(uint8_t channel, int value) {
     // Value -8192..8191 maps to 0..16383
     uint16_t mapped = (uint16_t)(value + 8192);
     uint8_t lsb = mapped & 0x7F;
@@ -41,97 +253,503 @@ void USBMIDI_::sendPitchBend(uint8_t channel, int value) {
     sendPacket(0x0E, 0xE0 | (channel & 0x0F), lsb, msb);
 }
 
-void USBMIDI_::sendPolyPressure(uint8_t channel, uint8_t note, uint8_t pressure) {
+void USBMIDICable::sendPolyPressure(uint8_t channel, uint8_t note, uint8_t pressure) {
     sendPacket(0x0A, 0xA0 | (channel & 0x0F), note, pressure);
 }
 
-void USBMIDI_::sendAfterTouch(uint8_t channel, uint8_t pressure) {
+void USBMIDICable::sendAfterTouch(uint8_t channel, uint8_t pressure) {
     sendPacket(0x0D, 0xD0 | (channel & 0x0F), pressure, 0);
 }
 
-void USBMIDI_::sendRealTime(uint8_t realtimebyte) {
+void USBMIDICable::sendRealTime(uint8_t realtimebyte) {
     // CIN 0x0F is for Single Byte messages (RealTime, TuneRequest)
     // 0xF8 = Clock, 0xFA = Start, 0xFB = Continue, 0xFC = Stop, 0xFE = ActiveSensing, 0xFF = Reset
-    sendPacket(0x0F, realtimebyte, 0, 0);
+    if(realtimebyte < 0xF8) {
+        sendPacket(0x0F, realtimebyte, 0, 0);
+        return;
+    }
+    // Priority lane: goes out ahead of queued channel messages
+    uint32_t packet = USB_MIDI_PACKET((cableNumber << 4) | 0x0F, realtimebyte, 0, 0);
+#if WCH_USBMIDI_MIDI2
+    if(USB_ump_active()) usbmidiPacketToUMP(packet, &packet, false);
+#endif
+    USB_write_realtime(packet);
+}
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+bool USBMIDICable::sendAt(uint32_t time, uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3) {
+    uint32_t packet = USB_MIDI_PACKET((cableNumber << 4) | (cin & 0x0F), b1, b2, b3);
+    if(outputTransform && !outputTransform->apply(packet)) return true;
+#if WCH_USBMIDI_MIDI2
+    // Events are one word: MIDI 1.0 channel voice in UMP
+    if(USB_ump_active() && !usbmidiPacketToUMP(packet, &packet, false)) return false;
+#endif
+    return USB_write_at(time, packet);
+}
+
+bool USBMIDICable::sendNoteOnAt(uint32_t time, uint8_t channel, uint8_t note, uint8_t velocity) {
+    return sendAt(time, 0x09, 0x90 | (channel & 0x0F), note, velocity);
+}
+
+bool USBMIDICable::sendNoteOffAt(uint32_t time, uint8_t channel, uint8_t note, uint8_t velocity) {
+    return sendAt(time, 0x08, 0x80 | (channel & 0x0F), note, velocity);
+}
+
+bool USBMIDICable::sendControlChangeAt(uint32_t time, uint8_t channel, uint8_t control, uint8_t value) {
+    return sendAt(time, 0x0B, 0xB0 | (channel & 0x0F), control, value);
+}
+
+bool USBMIDICable::sendRealTimeAt(uint32_t time, uint8_t realtimebyte) {
+    return sendAt(time, 0x0F, realtimebyte, 0, 0);
+}
+#endif
+
+// --- Parameter engine ---
+
+void USBMIDICable::resetParameters() {
+    for(uint8_t ch = 0; ch < 16; ch++) {
+        txParam[ch] = PARAM_NONE;
+        rxParam[ch] = PARAM_NONE;
+        rxDataMsb[ch] = 0;
+        rxCC14Control[ch] = 0xFF;
+        rxCC14Msb[ch] = 0;
+    }
+    rxDataPending = rxCC14Pending = 0;
+}
+
+void USBMIDICable::sendControlChange14(uint8_t channel, uint8_t control, uint16_t value) {
+    USB_tx_lock(); // A callback's controller cannot land in between
+    USB_batch_begin();
+    sendControlChange(channel, control & 0x1F, (value >> 7) & 0x7F);
+    sendControlChange(channel, (control & 0x1F) + 32, value & 0x7F);
+    USB_batch_end();
+    USB_tx_unlock();
+}
+
+bool USBMIDICable::sendRPN(uint8_t channel, uint16_t number, uint16_t value) {
+    return sendParameter(channel, number, value, false);
+}
+
+bool USBMIDICable::sendNRPN(uint8_t channel, uint16_t number, uint16_t value) {
+    return sendParameter(channel, number, value, true);
+}
+
+bool USBMIDICable::sendParameter(uint8_t channel, uint16_t number, uint16_t value, bool nrpn) {
+    channel &= 0x0F;
+    uint16_t selected = (number & 0x3FFF) | (nrpn ? PARAM_NRPN : 0);
+    bool ok = true;
+#if WCH_USBMIDI_MIDI2
+    if(USB_ump_active() && WCH_USBMIDI_MIDI2_PROTOCOL == 0x11) {
+        // MIDI 2.0 has one self-contained message for it. The transform
+        // sees it as the number MSB controller it replaces.
+        if(outputTransform) {
+            uint32_t probe = USB_MIDI_PACKET((cableNumber << 4) | 0x0B, 0xB0 | channel, nrpn ? 99 : 101, 0);
+            if(!outputTransform->apply(probe)) return true;
+            channel = USB_MIDI_BYTE(probe, 1) & 0x0F;
+        }
+        uint32_t ump[2];
+        ump[0] = ((uint32_t)UMP_MT_MIDI2 << 28) | ((uint32_t)cableNumber << 24)
+               | ((uint32_t)((nrpn ? 0x30 : 0x20) | channel) << 16)
+               | (((number >> 7) & 0x7F) << 8) | (number & 0x7F);
+        ump[1] = usbmidiScaleUp(value & 0x3FFF, 14, 32);
+        return USB_write(ump, 2) == 2;
+    }
+#endif
+    USB_tx_lock(); // Selection and value stay together
+    USB_batch_begin();
+    if(txParam[channel] != selected) {
+        ok = sendPacket(0x0B, 0xB0 | channel, nrpn ? 99 : 101, (number >> 7) & 0x7F)
+          && sendPacket(0x0B, 0xB0 | channel, nrpn ? 98 : 100, number & 0x7F);
+    }
+    ok = ok && sendPacket(0x0B, 0xB0 | channel, 6, (value >> 7) & 0x7F)
+            && sendPacket(0x0B, 0xB0 | channel, 38, value & 0x7F);
+    // Skipped the selection next time only if the receiver surely has it
+    // and the value went out with it
+    txParam[channel] = ok ? selected : (uint16_t)PARAM_NONE;
+    USB_batch_end();
+    USB_tx_unlock();
+    return ok;
+}
+
+void USBMIDICable::receiveParameter(uint8_t channel, uint8_t control, uint8_t value) {
+    uint16_t bit = 1u << channel;
+    uint16_t param = rxParam[channel];
+
+    // Anything but the awaited LSB completes pending values first, so the
+    // callbacks keep the order of the messages
+    bool awaited = ((rxDataPending & bit) && control == 38)
+                || ((rxCC14Pending & bit) && control == rxCC14Control[channel] + 32);
+    if(!awaited && (rxDataPending | rxCC14Pending)) flushParameters();
+
+    if(cbParameter) {
+        switch(control) {
+            case 99: case 101:   // Parameter number MSB
+            case 98: case 100: { // Parameter number LSB
+                uint16_t type = control < 100 ? PARAM_NRPN : 0;
+                // Switching between RPN and NRPN starts a new number
+                uint16_t number = (param & PARAM_NRPN) == type ? (param & 0x3FFF) : 0;
+                if(control & 1) number = (number & 0x007F) | ((uint16_t)value << 7);
+                else number = (number & 0x3F80) | value;
+                rxParam[channel] = number | type;
+                rxDataMsb[channel] = 0;
+                return;
+            }
+            case 6: // Data Entry MSB: held until its LSB arrives
+                if((param & 0x3FFF) == PARAM_NONE) return;
+                rxDataMsb[channel] = value;
+                rxDataPending |= bit;
+                return;
+            case 38: // Data Entry LSB, alone it refines the last MSB
+                if((param & 0x3FFF) == PARAM_NONE) return;
+                rxDataPending &= ~bit;
+                cbParameter(channel, param & 0x3FFF, ((uint16_t)rxDataMsb[channel] << 7) | value, param & PARAM_NRPN);
+                return;
+            default:
+                break;
+        }
+    }
+
+    if(cbControlChange14 && control < 64 && control != 6 && control != 38) {
+        uint8_t msbControl = control & 0x1F;
+        if(!((cc14Controls >> msbControl) & 1)) return;
+        if(control < 32) {
+            rxCC14Control[channel] = control;
+            rxCC14Msb[channel] = value;
+            rxCC14Pending |= bit;
+        } else if(rxCC14Control[channel] == msbControl) {
+            rxCC14Pending &= ~bit;
+            cbControlChange14(channel, msbControl, ((uint16_t)rxCC14Msb[channel] << 7) | value);
+        }
+    }
+}
+
+// Delivers values whose LSB has not arrived, with LSB 0
+void USBMIDICable::flushParameters() {
+    while(rxDataPending) {
+        uint8_t ch = __builtin_ctz(rxDataPending);
+        rxDataPending &= rxDataPending - 1;
+        if(cbParameter) {
+            cbParameter(ch, rxParam[ch] & 0x3FFF, (uint16_t)rxDataMsb[ch] << 7, rxParam[ch] & PARAM_NRPN);
+        }
+    }
+    while(rxCC14Pending) {
+        uint8_t ch = __builtin_ctz(rxCC14Pending);
+        rxCC14Pending &= rxCC14Pending - 1;
+        if(cbControlChange14) cbControlChange14(ch, rxCC14Control[ch], (uint16_t)rxCC14Msb[ch] << 7);
+    }
+}
+
+// Waits for FIFO space; gives up if unplugged or the host stops reading
+bool USBMIDICable::writeBlocking(const uint32_t* words, uint8_t count) {
+    unsigned long start = millis();
+    while(!USB_write(words, count)) {
+        if(!USB_configured() || millis() - start >= WCH_USBMIDI_TX_TIMEOUT_MS) return false;
+    }
+    return true;
+}
+
+bool USBMIDICable::sendSysEx(const uint8_t* data, size_t length) {
+    if(length == 0) return true;
+    if(!USB_configured()) return false;
+
+    // Byte i of the framed message, adding F0/F7 where the caller left them out
+    bool addStart = data[0] != 0xF0;
+    bool addEnd = data[length - 1] != 0xF7;
+    size_t total = length + addStart + addEnd;
+    auto byteAt = [&](size_t i) -> uint8_t {
+        if(addStart) {
+            if(i == 0) return 0xF0;
+            i--;
+        }
+        return i < length ? data[i] : 0xF7;
+    };
+
+    bool ok = true;
+    USB_batch_begin();
+#if WCH_USBMIDI_MIDI2
+    if(USB_ump_active()) {
+        // 7-bit SysEx UMPs carry up to 6 bytes between F0 and F7
+        size_t payload = total - 2;
+        size_t i = 0;
+        do {
+            uint8_t chunk[6];
+            uint8_t n = payload - i > 6 ? 6 : (uint8_t)(payload - i);
+            for(uint8_t k = 0; k < n; k++) chunk[k] = byteAt(1 + i + k);
+            uint8_t status = i == 0 ? (i + n == payload ? 0 : 1) : (i + n == payload ? 3 : 2);
+            uint32_t ump[2];
+            usbmidiSysExToUMP(cableNumber, status, chunk, n, ump);
+            ok = writeBlocking(ump, 2);
+            i += n;
+        } while(i < payload && ok);
+        USB_batch_end();
+        return ok;
+    }
+#endif
+    for(size_t i = 0; i < total && ok; i += 3) {
+        size_t remaining = total - i;
+        // CIN 0x4: SysEx starts/continues, 0x5/0x6/0x7: ends with 1/2/3 bytes
+        uint8_t cin = remaining > 3 ? 0x04 : (uint8_t)(0x04 + remaining);
+        uint8_t b1 = byteAt(i);
+        uint8_t b2 = remaining > 1 ? byteAt(i + 1) : 0;
+        uint8_t b3 = remaining > 2 ? byteAt(i + 2) : 0;
+        uint32_t packet = USB_MIDI_PACKET((cableNumber << 4) | cin, b1, b2, b3);
+        ok = writeBlocking(&packet, 1);
+    }
+    USB_batch_end();
+    return ok;
 }
 
 // --- Callback Registration ---
 
-void USBMIDI_::setHandleNoteOn(MidiCallbackNote func) { cbNoteOn = func; }
-void USBMIDI_::setHandleNoteOff(MidiCallbackNote func) { cbNoteOff = func; }
-void USBMIDI_::setHandleControlChange(MidiCallbackCC func) { cbControlChange = func; }
-void USBMIDI_::setHandleProgramChange(MidiCallbackPC func) { cbProgramChange = func; }
-void USBMIDI_::setHandlePitchBend(MidiCallbackPB func) { cbPitchBend = func; }
-void USBMIDI_::setHandleAfterTouch(MidiCallbackCP func) { cbAfterTouch = func; }
-void USBMIDI_::setHandlePolyPressure(MidiCallbackPP func) { cbPolyPressure = func; }
-void USBMIDI_::setHandleRealTime(MidiCallbackRT func) { cbRealTime = func; }
+void USBMIDICable::setHandleNoteOn(MidiCallbackNote func) { cbNoteOn = func; }
+void USBMIDICable::setHandleNoteOff(MidiCallbackNote func) { cbNoteOff = func; }
+void USBMIDICable::setHandleControlChange(MidiCallbackCC func) { cbControlChange = func; }
+void USBMIDICable::setHandleProgramChange(MidiCallbackPC func) { cbProgramChange = func; }
+void USBMIDICable::setHandlePitchBend(MidiCallbackPB func) { cbPitchBend = func; }
+void USBMIDICable::setHandleAfterTouch(MidiCallbackCP func) { cbAfterTouch = func; }
+void USBMIDICable::setHandlePolyPressure(MidiCallbackPP func) { cbPolyPressure = func; }
+void USBMIDICable::setHandleRealTime(MidiCallbackRT func) { cbRealTime = func; }
+void USBMIDICable::setHandleSysExChunk(MidiCallbackSysExChunk func) { cbSysExChunk = func; }
+void USBMIDICable::setHandleSysEx(MidiCallbackSysEx func) { cbSysEx = func; }
+
+void USBMIDICable::setSysExBuffer(uint8_t* buffer, size_t size) {
+    sysexBuf = buffer;
+    sysexSize = size;
+    sysexLen = 0;
+    sysexOverflow = false;
+}
+
+void USBMIDICable::setHandleParameter(MidiCallbackParam func) { cbParameter = func; }
+
+void USBMIDICable::setHandleControlChange14(MidiCallbackCC14 func, uint32_t controls) {
+    cbControlChange14 = func;
+    cc14Controls = controls;
+}
+
+void USBMIDICable::setStateCache(USBMIDIStateCache* cache) { stateCache = cache; }
+void USBMIDICable::setInputTransform(const USBMIDITransform* transform) { inputTransform = transform; }
+void USBMIDICable::setOutputTransform(const USBMIDITransform* transform) { outputTransform = transform; }
+
+// --- Statistics ---
+
+USBMIDIStats USBMIDI_::getStats() {
+    USBMIDIStats s;
+    USB_get_stats(&s);
+    return s;
+}
+
+void USBMIDI_::resetStats() {
+    USB_reset_stats();
+}
 
 // --- Reception ---
 
+// Function-pointer handler set behind the setHandle* API: routes each message
+// to the callbacks registered on its cable.
+struct USBMIDICallbacks : USBMIDIHandlers {
+    void onNoteOn(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbNoteOn) c.cbNoteOn(channel, note, velocity);
+    }
+    void onNoteOff(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbNoteOff) c.cbNoteOff(channel, note, velocity);
+    }
+    void onControlChange(uint8_t cable, uint8_t channel, uint8_t control, uint8_t value) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbControlChange) c.cbControlChange(channel, control, value);
+        c.receiveParameter(channel, control, value);
+    }
+    void onProgramChange(uint8_t cable, uint8_t channel, uint8_t program) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbProgramChange) c.cbProgramChange(channel, program);
+    }
+    void onPitchBend(uint8_t cable, uint8_t channel, int value) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbPitchBend) c.cbPitchBend(channel, value);
+    }
+    void onAfterTouch(uint8_t cable, uint8_t channel, uint8_t pressure) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbAfterTouch) c.cbAfterTouch(channel, pressure);
+    }
+    void onPolyPressure(uint8_t cable, uint8_t channel, uint8_t note, uint8_t pressure) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbPolyPressure) c.cbPolyPressure(channel, note, pressure);
+    }
+    void onRealTime(uint8_t cable, uint8_t realtimebyte) {
+        USBMIDICable& c = USBMIDI.cable(cable);
+        if(c.cbRealTime) c.cbRealTime(realtimebyte);
+    }
+    void onSysExChunk(uint8_t cable, const uint8_t* data, uint8_t length, bool last) {
+        USBMIDI.cable(cable).receiveSysEx(data, length, last);
+    }
+    void onPacket(uint32_t packet, uint32_t timestamp) {
+        if(USBMIDI.cbPacket) USBMIDI.cbPacket(packet, timestamp);
+    }
+#if WCH_USBMIDI_MIDI2
+    void onUMP(const uint32_t* words, uint8_t count, uint32_t timestamp) {
+        if(USBMIDI.cbUMP) USBMIDI.cbUMP(words, count, timestamp);
+    }
+#endif
+};
+
+uint8_t USBMIDI_::connectionState() {
+    return USB_get_state();
+}
+
+bool USBMIDI_::connected() {
+    return USB_get_state() == USB_STATE_CONFIGURED;
+}
+
+void USBMIDI_::setHandleConnection(MidiCallbackConnection func) { cbConnection = func; }
+
+#if WCH_USBMIDI_NOTE_TRACKING
+// Note Offs a bus reset or SET_INTERFACE dropped from the TX queues had
+// already cleared their notes: hold those again so they are released. If
+// more were dropped than the handler kept, All Notes Off goes out instead.
+void USBMIDI_::recoverLostNoteOffs() {
+    uint32_t packets[8], count;
+    while((count = USB_read_lost_note_offs(packets, 8)) > 0) {
+        for(uint32_t i = 0; i < count; i++) {
+            uint8_t c = USB_MIDI_BYTE(packets[i], 0) >> 4;
+            uint8_t ch = USB_MIDI_BYTE(packets[i], 1) & 0x0F, note = USB_MIDI_BYTE(packets[i], 2);
+            if(c < WCH_USBMIDI_NUM_CABLES) cable(c).heldNotes[ch][(note >> 5) & 3] |= 1ul << (note & 31);
+        }
+    }
+    uint8_t overflows = USB_lost_note_offs_overflows();
+    if(overflows != lostNoteOffOverflows) {
+        lostNoteOffOverflows = overflows;
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) cable(c).allNotesOff = 0xFFFF;
+    }
+}
+#endif
+
+// Reports state changes and, after any reset or suspend, releases the notes
+// the host may still consider held as soon as it is listening again
+void USBMIDI_::serviceConnection() {
+    uint8_t events = USB_link_events();
+    uint8_t state = USB_get_state();
+    if(events != linkEvents) {
+        linkEvents = events;
+        releasePending = true;
+#if WCH_USBMIDI_NOTE_TRACKING
+        USB_tx_lock();
+        recoverLostNoteOffs();
+        USB_tx_unlock();
+#endif
+        // The host side may have restarted: select parameters again
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) {
+            for(uint8_t ch = 0; ch < 16; ch++) cable(c).txParam[ch] = PARAM_NONE;
+        }
+#if WCH_USBMIDI_MIDI2
+        umpFill = 0; // The setting may have changed: drop any partial message
+#endif
+    }
+    if(state != linkState) {
+        linkState = state;
+        if(cbConnection) cbConnection(state);
+    }
+#if WCH_USBMIDI_NOTE_TRACKING
+    if(releasePending && state == USB_STATE_CONFIGURED) {
+        releasePending = false;
+        USB_tx_lock();     // Callbacks may be sending notes meanwhile
+        USB_batch_begin(); // One compact burst
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) {
+            if(!cable(c).releaseHeldNotes()) releasePending = true;
+        }
+        USB_batch_end();
+        USB_tx_unlock();
+    }
+#endif
+}
+
 void USBMIDI_::poll() {
-    uint8_t packet[4];
-    while(USB_available() >= 4) {
-        if(USB_read(packet, 4) == 4) {
-            uint8_t cin = packet[0] & 0x0F;
-            uint8_t b1 = packet[1];
-            uint8_t b2 = packet[2];
-            uint8_t b3 = packet[3];
-            dispatch(cin, b1, b2, b3);
-        }
-    }
-}
-
-void USBMIDI_::dispatch(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3) {
-    uint8_t channel = b1 & 0x0F;
-    
-    switch(cin) {
-        case 0x08: // Note Off
-            if(cbNoteOff) cbNoteOff(channel, b2, b3);
-            break;
-            
-        case 0x09: // Note On
-            if(cbNoteOn && (b3 > 0)) cbNoteOn(channel, b2, b3);
-            else if (cbNoteOff && (b3 == 0)) cbNoteOff(channel, b2, 0); // Vel 0 = Off
-            break;
-            
-        case 0x0A: // Poly Key Pressure
-            if(cbPolyPressure) cbPolyPressure(channel, b2, b3);
-            break;
-            
-        case 0x0B: // Control Change
-            if(cbControlChange) cbControlChange(channel, b2, b3);
-            break;
-            
-        case 0x0C: // Program Change
-            if(cbProgramChange) cbProgramChange(channel, b2);
-            break;
-            
-        case 0x0D: // Channel Pressure (Aftertouch)
-            if(cbAfterTouch) cbAfterTouch(channel, b2);
-            break;
-            
-        case 0x0E: // Pitch Bend
-            if(cbPitchBend) {
-                // Reconstruct 14-bit value from LSB (b2) and MSB (b3)
-                int val = (b2 & 0x7F) | ((b3 & 0x7F) << 7);
-                val -= 8192; // Center at 0
-                cbPitchBend(channel, val);
-            }
-            break;
-            
-        case 0x0F: // Single Byte (Real Time)
-            if(cbRealTime) cbRealTime(b1);
-            break;
-            
-        // 0x05 could be SysEx end OR standard 1-byte System Common (Tune Request 0xF6)
-        case 0x05: 
-            if(b1 >= 0xF8) { // If it's real time embedded here (rare but legal)
-                if(cbRealTime) cbRealTime(b1);
-            }
-            break;
-            
-        default:
-            // SysEx (0x04, 0x06, 0x07) and others ignored
-            break;
+    USBMIDICallbacks callbacks;
+    poll(callbacks);
+    if(interruptDispatch) return;
+    for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) cable(c).flushParameters();
+}
+
+uint32_t USBMIDI_::poll(uint32_t maxPackets) {
+    USBMIDICallbacks callbacks;
+    uint32_t left = receive(callbacks, maxPackets, 0);
+    // An LSB may still be waiting in the buffer
+    if(!left && !interruptDispatch) {
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) cable(c).flushParameters();
+    }
+    return left;
+}
+
+uint32_t USBMIDI_::pollFor(uint32_t microseconds) {
+    USBMIDICallbacks callbacks;
+    uint32_t left = pollFor(callbacks, microseconds);
+    if(!left && !interruptDispatch) {
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) cable(c).flushParameters();
+    }
+    return left;
+}
+
+uint32_t USBMIDI_::readPackets(uint32_t* packets, uint32_t count) {
+    if(interruptDispatch) return 0;
+    serviceConnection();
+    uint32_t n = USB_read_realtime(packets, nullptr, count);
+    return n + USB_read(packets + n, count - n);
+}
+
+void USBMIDI_::enableTimestamps(bool enable) {
+    USB_timestamps_enable(enable);
+}
+
+uint32_t USBMIDI_::now() {
+    return USB_now();
+}
+
+void USBMIDI_::setHandlePacket(MidiCallbackPacket func) { cbPacket = func; }
+
+void USBMIDI_::setInterruptDispatch(bool enable) {
+    if(enable == interruptDispatch) return;
+    if(enable) poll(); // Deliver what is already queued first, in order
+    interruptDispatch = enable;
+    USB_set_rx_hook(enable ? interruptHook : nullptr);
+}
+
+// One USB transfer, in interrupt context
+void USBMIDI_::interruptHook(const uint32_t* packets, uint8_t count, uint32_t time, uint8_t realtime) {
+    uint32_t times[16];
+    USBMIDICallbacks callbacks;
+    for(uint8_t i = 0; i < count; i++) times[i] = time;
+    USBMIDI.dispatch(callbacks, packets, times, count, realtime);
+    // A value pair split over two transfers is delivered without its LSB
+    if(!realtime) {
+        for(uint8_t c = 0; c < WCH_USBMIDI_NUM_CABLES; c++) USBMIDI.cable(c).flushParameters();
+    }
+}
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+uint32_t USBMIDI_::scheduled() {
+    return USB_scheduled();
+}
+
+void USBMIDI_::clearScheduled() {
+    USB_sched_clear();
+}
+#endif
+
+void USBMIDICable::receiveSysEx(const uint8_t* chunk, uint8_t length, bool last) {
+    if(cbSysExChunk) cbSysExChunk(chunk, length, last);
+
+    if(!sysexBuf) return;
+    if(chunk[0] == 0xF0) { // A new message discards any unterminated one
+        sysexLen = 0;
+        sysexOverflow = false;
+    }
+    for(uint8_t i = 0; i < length; i++) {
+        if(sysexLen < sysexSize) sysexBuf[sysexLen++] = chunk[i];
+        else sysexOverflow = true;
+    }
+    if(last) {
+        if(cbSysEx) cbSysEx(sysexBuf, sysexLen, sysexOverflow);
+        sysexLen = 0;
+        sysexOverflow = false;
     }
 }
@@ -4,6 +4,11 @@
 #include <stdint.h>
 
 #include "internal/wch_usbmidi_internal.h"
+#include "USBMIDIStateCache.h"
+#include "USBMIDITransform.h"
+#if WCH_USBMIDI_MIDI2
+#include "USBMIDIUMP.h"
+#endif
 
 // Callback function types
 typedef void (*MidiCallbackNote)(uint8_t channel, uint8_t note, uint8_t velocity);
@@ -13,13 +18,127 @@ typedef void (*MidiCallbackPB)(uint8_t channel, int value); // Value -8192 to 81
 typedef void (*MidiCallbackCP)(uint8_t channel, uint8_t pressure); // Channel Pressure
 typedef void (*MidiCallbackPP)(uint8_t channel, uint8_t note, uint8_t pressure); // Poly Pressure
 typedef void (*MidiCallbackRT)(uint8_t realtimebyte); // 0xF8 clock, 0xFA start, etc.
+// SysEx pieces as they arrive (1-3 bytes, up to 8 on the MIDI 2.0 setting,
+// F0/F7 included); last marks the F7 chunk
+typedef void (*MidiCallbackSysExChunk)(const uint8_t* data, uint8_t length, bool last);
+// Complete SysEx reassembled into the buffer given to setSysExBuffer()
+typedef void (*MidiCallbackSysEx)(const uint8_t* data, size_t length, bool overflow);
+// Reassembled RPN/NRPN data entry: 14-bit parameter number and value
+typedef void (*MidiCallbackParam)(uint8_t channel, uint16_t number, uint16_t value, bool nrpn);
+// 14-bit Control Change pair (MSB on control 0-31, LSB on control + 32)
+typedef void (*MidiCallbackCC14)(uint8_t channel, uint8_t control, uint16_t value);
+// Connection state changes (USB_STATE_DEFAULT, _CONFIGURED, _SUSPENDED)
+typedef void (*MidiCallbackConnection)(uint8_t state);
+// Every received USB-MIDI packet (see USB_MIDI_PACKET) with its receive time
+// in microseconds (see USBMIDI.enableTimestamps), before it is decoded
+typedef void (*MidiCallbackPacket)(uint32_t packet, uint32_t timestamp);
+// Every received Universal MIDI Packet (1-4 words) on the MIDI 2.0 setting,
+// before it is translated to MIDI 1.0 for the other callbacks
+typedef void (*MidiCallbackUMP)(const uint32_t* words, uint8_t count, uint32_t timestamp);
 
-class USBMIDI_ {
+// Compile-time handler set for USBMIDI.poll(handlers). Derive from this and
+// define only the handlers you need (same names and signatures); the rest
+// fall back to these empty inline defaults and compile out, and the handlers
+// inline into the receive loop. Member state gives the handlers context.
+//
+//   struct Synth : USBMIDIHandlers {
+//       void onNoteOn(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) { ... }
+//   };
+//   Synth synth;
+//   void loop() { USBMIDI.poll(synth); }
+struct USBMIDIHandlers {
+    void onNoteOn(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {}
+    void onNoteOff(uint8_t cable, uint8_t channel, uint8_t note, uint8_t velocity) {}
+    void onControlChange(uint8_t cable, uint8_t channel, uint8_t control, uint8_t value) {}
+    void onProgramChange(uint8_t cable, uint8_t channel, uint8_t program) {}
+    void onPitchBend(uint8_t cable, uint8_t channel, int value) {} // -8192 to 8191
+    void onAfterTouch(uint8_t cable, uint8_t channel, uint8_t pressure) {}
+    void onPolyPressure(uint8_t cable, uint8_t channel, uint8_t note, uint8_t pressure) {}
+    void onRealTime(uint8_t cable, uint8_t realtimebyte) {}
+    void onSysExChunk(uint8_t cable, const uint8_t* data, uint8_t length, bool last) {}
+    void onPacket(uint32_t packet, uint32_t timestamp) {} // Raw, before decoding
+    void onUMP(const uint32_t* words, uint8_t count, uint32_t timestamp) {} // MIDI 2.0 setting only
+};
+
+// Decodes one USB-MIDI packet and calls the matching handler
+template<class Handlers>
+inline void usbmidiDispatch(Handlers& h, uint32_t packet) {
+    uint8_t cable = USB_MIDI_BYTE(packet, 0) >> 4;
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    uint8_t b1 = USB_MIDI_BYTE(packet, 1);
+    uint8_t b2 = USB_MIDI_BYTE(packet, 2);
+    uint8_t b3 = USB_MIDI_BYTE(packet, 3);
+    uint8_t channel = b1 & 0x0F;
+    if(cable >= WCH_USBMIDI_NUM_CABLES) return; // No such jack
+
+    switch(cin) {
+        case 0x08: // Note Off
+            h.onNoteOff(cable, channel, b2, b3);
+            break;
+
+        case 0x09: // Note On
+            if(b3 > 0) h.onNoteOn(cable, channel, b2, b3);
+            else h.onNoteOff(cable, channel, b2, 0); // Vel 0 = Off
+            break;
+
+        case 0x0A: // Poly Key Pressure
+            h.onPolyPressure(cable, channel, b2, b3);
+            break;
+
+        case 0x0B: // Control Change
+            h.onControlChange(cable, channel, b2, b3);
+            break;
+
+        case 0x0C: // Program Change
+            h.onProgramChange(cable, channel, b2);
+            break;
+
+        case 0x0D: // Channel Pressure (Aftertouch)
+            h.onAfterTouch(cable, channel, b2);
+            break;
+
+        case 0x0E: // Pitch Bend
+            // Reconstruct 14-bit value from LSB (b2) and MSB (b3), centered at 0
+            h.onPitchBend(cable, channel, (int)((b2 & 0x7F) | ((b3 & 0x7F) << 7)) - 8192);
+            break;
+
+        case 0x0F: // Single Byte (Real Time)
+            h.onRealTime(cable, b1);
+            break;
+
+        case 0x04:   // SysEx starts or continues
+        case 0x06:   // SysEx ends with 2 bytes
+        case 0x07: { // SysEx ends with 3 bytes
+            const uint8_t chunk[3] = { b1, b2, b3 };
+            h.onSysExChunk(cable, chunk, cin == 0x04 ? 3 : cin - 4, cin != 0x04);
+            break;
+        }
+
+        // 0x05 could be SysEx end OR standard 1-byte System Common (Tune Request 0xF6)
+        case 0x05:
+            if(b1 >= 0xF8) { // If it's real time embedded here (rare but legal)
+                h.onRealTime(cable, b1);
+            } else if(b1 == 0xF7) {
+                h.onSysExChunk(cable, &b1, 1, true);
+            }
+            break;
+
+        default:
+            // System Common (0x02, 0x03) and reserved CINs ignored
+            break;
+    }
+}
+
+// One virtual MIDI cable (USB-MIDI jack pair). All cables share the EP2
+// bulk endpoints; USBMIDI itself is cable 0, USBMIDI.cable(n) the others.
+class USBMIDICable {
 public:
-    void begin();
-    
-    // Low level packet send
-    void sendPacket(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3);
+    explicit USBMIDICable(uint8_t number = 0) : cableNumber(number) { resetParameters(); }
+
+    uint8_t number() const { return cableNumber; }
+
+    // Low level packet send; false if it was not queued
+    bool sendPacket(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3);
     
     // High Level Send
     void sendNoteOn(uint8_t channel, uint8_t note, uint8_t velocity);
@@ -29,7 +148,33 @@ public:
     void sendPitchBend(uint8_t channel, int value);
     void sendPolyPressure(uint8_t channel, uint8_t note, uint8_t pressure);
     void sendAfterTouch(uint8_t channel, uint8_t pressure); // Channel Pressure
-    void sendRealTime(uint8_t realtimebyte); // e.g. 0xF8
+    void sendRealTime(uint8_t realtimebyte); // e.g. 0xF8, sent ahead of queued messages
+    // Streams a SysEx message straight into the TX FIFO. F0/F7 are added if
+    // missing. Blocks while the FIFO is full; returns false if the device is
+    // not configured or the host stops reading.
+    bool sendSysEx(const uint8_t* data, size_t length);
+
+    // High resolution: 14-bit values (0-16383). sendControlChange14 sends the
+    // MSB on control (0-31) and the LSB on control + 32. sendRPN/sendNRPN
+    // select the parameter (CC 101/100 or 99/98) only when it differs from
+    // the last one sent on that channel, then send Data Entry (CC 6/38);
+    // false if any of it was not queued (the selection is sent again next
+    // time).
+    void sendControlChange14(uint8_t channel, uint8_t control, uint16_t value);
+    bool sendRPN(uint8_t channel, uint16_t number, uint16_t value);
+    bool sendNRPN(uint8_t channel, uint16_t number, uint16_t value);
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    // Scheduled sends: queued now, sent in the first USB frame starting at
+    // or after time (a USBMIDI.now() timestamp in microseconds). Messages
+    // with the same time keep their order. false if the schedule is full or
+    // the device is not configured; a bus reset drops what is pending.
+    bool sendAt(uint32_t time, uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3);
+    bool sendNoteOnAt(uint32_t time, uint8_t channel, uint8_t note, uint8_t velocity);
+    bool sendNoteOffAt(uint32_t time, uint8_t channel, uint8_t note, uint8_t velocity = 0);
+    bool sendControlChangeAt(uint32_t time, uint8_t channel, uint8_t control, uint8_t value);
+    bool sendRealTimeAt(uint32_t time, uint8_t realtimebyte);
+#endif
 
     // Callback Registration
     void setHandleNoteOn(MidiCallbackNote func);
@@ -40,11 +185,42 @@ public:
     void setHandleAfterTouch(MidiCallbackCP func);
     void setHandlePolyPressure(MidiCallbackPP func);
     void setHandleRealTime(MidiCallbackRT func);
+    void setHandleSysExChunk(MidiCallbackSysExChunk func);
+    void setHandleSysEx(MidiCallbackSysEx func);
+    // RPN/NRPN sequences and 14-bit CC pairs delivered as one callback each
+    // (the raw CCs still reach setHandleControlChange). A value whose LSB
+    // never comes is delivered with LSB 0 at the end of poll(). controls is
+    // a bitmask of the MSB controllers (0-31) treated as 14-bit; Data Entry
+    // (6) is always left to the parameter handler.
+    void setHandleParameter(MidiCallbackParam func);
+    void setHandleControlChange14(MidiCallbackCC14 func, uint32_t controls = 0xFFFFFFFF);
+    void setSysExBuffer(uint8_t* buffer, size_t size);
+    // Keep cache up to date with everything received on this cable (nullptr to detach)
+    void setStateCache(USBMIDIStateCache* cache);
+    // Rewrite channel messages through transform (nullptr to detach): input
+    // ahead of the callbacks and the state cache, output in the send*()
+    // calls (not sendPackets or sendUMP). A filtered send counts as sent.
+    void setInputTransform(const USBMIDITransform* transform);
+    void setOutputTransform(const USBMIDITransform* transform);
 
-    // Poll for incoming data
-    void poll();
+#if WCH_USBMIDI_NOTE_TRACKING
+    // Notes sent On through this cable and not yet Off; a Note Off that a
+    // bus reset threw away before the host had it counts as not sent.
+    // releaseHeldNotes() sends Note Off for each of them (as poll() does
+    // after a bus reset or resume); false if the TX FIFO filled up first,
+    // call again later.
+    bool noteHeld(uint8_t channel, uint8_t note) const {
+        return (heldNotes[channel & 0x0F][(note >> 5) & 3] >> (note & 31)) & 1;
+    }
+    bool releaseHeldNotes();
+#endif
 
 private:
+    friend class USBMIDI_;
+    friend struct USBMIDICallbacks;
+
+    uint8_t cableNumber;
+
     MidiCallbackNote cbNoteOn = nullptr;
     MidiCallbackNote cbNoteOff = nullptr;
     MidiCallbackCC cbControlChange = nullptr;
@@ -53,8 +229,289 @@ private:
     MidiCallbackCP cbAfterTouch = nullptr;
     MidiCallbackPP cbPolyPressure = nullptr;
     MidiCallbackRT cbRealTime = nullptr;
+    USBMIDIStateCache* stateCache = nullptr;
+    const USBMIDITransform* inputTransform = nullptr;
+    const USBMIDITransform* outputTransform = nullptr;
+    MidiCallbackSysExChunk cbSysExChunk = nullptr;
+    MidiCallbackSysEx cbSysEx = nullptr;
+    MidiCallbackParam cbParameter = nullptr;
+    MidiCallbackCC14 cbControlChange14 = nullptr;
 
-    void dispatch(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3);
+    // SysEx reassembly (caller-supplied buffer)
+    uint8_t* sysexBuf = nullptr;
+    size_t sysexSize = 0;
+    size_t sysexLen = 0;
+    bool sysexOverflow = false;
+
+#if WCH_USBMIDI_NOTE_TRACKING
+    uint32_t heldNotes[16][4] = {}; // Bitmap per channel, bit n of word w = note 32w + n
+    uint16_t allNotesOff = 0;       // Channels to send All Notes Off on first
+    void trackNote(uint8_t cin, uint8_t b1, uint8_t b2, uint8_t b3);
+#endif
+
+    // Parameter engine state per channel. Selections are 14-bit numbers with
+    // PARAM_NRPN set for NRPN; PARAM_NONE means unknown (TX) or null (RX).
+    enum : uint16_t { PARAM_NRPN = 0x8000, PARAM_NONE = 0x3FFF };
+    uint16_t txParam[16];
+    uint16_t rxParam[16];
+    uint8_t  rxDataMsb[16];
+    uint8_t  rxCC14Control[16];     // Controller of the last 14-bit MSB
+    uint8_t  rxCC14Msb[16];
+    uint16_t rxDataPending = 0;     // Channels with an MSB waiting for its LSB
+    uint16_t rxCC14Pending = 0;
+    uint32_t cc14Controls = 0;
+
+    void resetParameters();
+    bool sendParameter(uint8_t channel, uint16_t number, uint16_t value, bool nrpn);
+    void receiveParameter(uint8_t channel, uint8_t control, uint8_t value);
+    void flushParameters();
+
+    void receiveSysEx(const uint8_t* chunk, uint8_t length, bool last);
+    bool writePacket(uint32_t packet);
+    bool writeBlocking(const uint32_t* words, uint8_t count);
 };
 
-extern USBMIDI_ USBMIDI;
\ No newline at end of file
+class USBMIDI_ : public USBMIDICable {
+public:
+    USBMIDI_();
+
+    void begin();
+
+    // Cable n (0 .. WCH_USBMIDI_NUM_CABLES-1); out of range maps to cable 0
+    USBMIDICable& cable(uint8_t n);
+    
+    // Raw USB-MIDI packets (see USB_MIDI_PACKET), cable taken from each
+    // packet. Returns packets queued: either all of them or 0 if the TX FIFO
+    // has no room for all of them. One call takes at most 64 packets (the
+    // TX FIFO), so more always return 0; on the MIDI 2.0 setting each packet
+    // becomes one or two UMP words, and a SysEx packet returns 0. They go out
+    // as is: no output transform, and no note tracking (releaseHeldNotes()
+    // does not know about notes sent this way).
+    uint32_t sendPackets(const uint32_t* packets, uint32_t count);
+
+    // Batching: sends between beginBatch() and endBatch() are held back and
+    // go out together in full 64-byte transfers. Batches nest; a batch larger
+    // than the TX FIFO (64 packets) is flushed early.
+    void beginBatch();
+    void endBatch();
+
+    // Coalescing: controller updates (CC, pitch bend, pressure) still waiting
+    // in the TX FIFO are overwritten by newer values instead of queued behind
+    // them, and 8 FIFO slots stay reserved for Note Off (more than 8 into a
+    // full FIFO are still dropped). For control surfaces that can produce
+    // data faster than the host reads it.
+    void setCoalescing(bool enable);
+
+    // Connection: USB_STATE_DEFAULT (not configured), USB_STATE_CONFIGURED or
+    // USB_STATE_SUSPENDED (host asleep or cable pulled). Sends are dropped
+    // unless connected(), so a sketch can skip generating traffic meanwhile.
+    // Notes left On are released by poll() once the host is back after a
+    // reset or suspend. The callback runs from poll() on each change.
+    uint8_t connectionState();
+    bool connected();
+    void setHandleConnection(MidiCallbackConnection func);
+
+    // Poll for incoming data, dispatching to the setHandle* callbacks.
+    // Real-Time messages (clock, transport) are delivered ahead of the
+    // channel messages received before them.
+    void poll();
+    // Budgeted poll: handles at most maxPackets packets, or stops once
+    // microseconds have passed (checked every 4 packets), so a burst from
+    // the host cannot stretch loop(). Returns the packets still waiting;
+    // call again next loop(). Anything left stays queued (the host is held
+    // off, nothing is lost).
+    uint32_t poll(uint32_t maxPackets);
+    uint32_t pollFor(uint32_t microseconds);
+    // Poll with a compile-time handler set (see USBMIDIHandlers)
+    template<class Handlers, class = decltype(&Handlers::onPacket)>
+    void poll(Handlers& handlers) {
+        receive(handlers, 0xFFFFFFFF, 0);
+    }
+    template<class Handlers>
+    uint32_t poll(Handlers& handlers, uint32_t maxPackets) {
+        return receive(handlers, maxPackets, 0);
+    }
+    template<class Handlers>
+    uint32_t pollFor(Handlers& handlers, uint32_t microseconds) {
+        return receive(handlers, 0xFFFFFFFF, microseconds ? microseconds : 1);
+    }
+
+    // Raw USB-MIDI packets (see USB_MIDI_PACKET) straight from the receive
+    // buffer, realtime first, without any callbacks; instead of poll().
+    // Returns the number read (up to count).
+    uint32_t readPackets(uint32_t* packets, uint32_t count);
+
+    // Timestamps: microseconds on the USB frame clock (1 ms SOF frames plus
+    // a sub-millisecond timer offset). Off by default; enabling adds one
+    // interrupt per frame. timestamp() is the receive time of the message
+    // being handled, for use inside callbacks; 0 while disabled.
+    void enableTimestamps(bool enable = true);
+    uint32_t now();
+    uint32_t timestamp() const { return packetTime; }
+    void setHandlePacket(MidiCallbackPacket func);
+
+    // Interrupt dispatch: the setHandle* callbacks run as each USB transfer
+    // arrives, from the USB interrupt (or the low-priority software interrupt
+    // with WCH_USBMIDI_RX_DEFERRED=1), instead of waiting for poll(). Input
+    // latency then no longer depends on how long loop() takes; poll() is
+    // still needed for connection handling. Call from setup(). In the
+    // callbacks: keep it short, do not block or wait for TX space (no
+    // sendSysEx), and share data with loop() through volatile variables.
+    // Callbacks may send (sendNoteOn etc.) while loop() sends too: sends
+    // from loop() mask the interrupt for the few instructions of each queue
+    // update, so a SysEx from loop() can still have a callback's packets
+    // between its chunks.
+    void setInterruptDispatch(bool enable);
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    // Scheduled messages not yet sent, and dropping all of them (e.g. on stop)
+    uint32_t scheduled();
+    void clearScheduled();
+#endif
+
+#if WCH_USBMIDI_MIDI2
+    // MIDI 2.0: true while the host uses the UMP setting. Sends and the
+    // callbacks keep working in MIDI 1.0 terms either way (translated, group
+    // n = cable n); sendUMP() queues one complete UMP as is, and
+    // setHandleUMP() sees every received UMP before translation.
+    bool umpActive();
+    bool sendUMP(const uint32_t* words, uint8_t count);
+    void setHandleUMP(MidiCallbackUMP func);
+#endif
+
+    // Statistics
+    USBMIDIStats getStats();
+    void resetStats();
+
+private:
+    friend struct USBMIDICallbacks;
+
+    template<class Handlers>
+    void dispatch(Handlers& handlers, const uint32_t* packets, const uint32_t* times, uint32_t count,
+                  bool realtime = false) {
+#if WCH_USBMIDI_MIDI2
+        if(USB_ump_active()) {
+            for(uint32_t i = 0; i < count; i++) {
+                if(realtime) dispatchUMP(handlers, &packets[i], 1, times[i]);
+                else receiveUMP(handlers, packets[i], times[i]);
+            }
+            return;
+        }
+#endif
+        (void)realtime;
+        for(uint32_t i = 0; i < count; i++) dispatchPacket(handlers, packets[i], times[i]);
+    }
+
+    template<class Handlers>
+    void dispatchPacket(Handlers& handlers, uint32_t packet, uint32_t time) {
+        uint8_t c = USB_MIDI_BYTE(packet, 0) >> 4;
+        if(c < WCH_USBMIDI_NUM_CABLES) {
+            USBMIDICable& port = cable(c);
+            if(port.inputTransform && !port.inputTransform->apply(packet)) return;
+            if(port.stateCache) port.stateCache->update(packet);
+        }
+        packetTime = time;
+        handlers.onPacket(packet, time);
+        usbmidiDispatch(handlers, packet);
+    }
+
+#if WCH_USBMIDI_MIDI2
+    // Collects the words of one UMP: a read can end mid-message. Realtime
+    // arrives on its own lane as single words and skips this.
+    template<class Handlers>
+    void receiveUMP(Handlers& handlers, uint32_t word, uint32_t time) {
+        if(umpFill == 0) umpLength = UMP_WORD_COUNT(word);
+        umpWords[umpFill++] = word;
+        if(umpFill < umpLength) return;
+        umpFill = 0;
+        dispatchUMP(handlers, umpWords, umpLength, time);
+    }
+
+    template<class Handlers>
+    void dispatchUMP(Handlers& handlers, const uint32_t* words, uint8_t length, uint32_t time) {
+        packetTime = time;
+        handlers.onUMP(words, length, time);
+        uint8_t c = (words[0] >> 24) & 0x0F;
+        if((words[0] >> 28) == UMP_MT_STREAM) {
+            answerStream(words);
+            return;
+        }
+        if((words[0] >> 28) == UMP_MT_SYSEX7) {
+            uint8_t data[8];
+            bool last;
+            uint8_t n = usbmidiUMPSysEx(words, data, &last);
+            if(c < WCH_USBMIDI_NUM_CABLES) handlers.onSysExChunk(c, data, n, last);
+            return;
+        }
+        uint32_t translated[4];
+        uint8_t n = usbmidiUMPToPackets(words, translated);
+        for(uint8_t i = 0; i < n; i++) dispatchPacket(handlers, translated[i], time);
+    }
+
+    // UMP Stream requests (endpoint and function block discovery, stream
+    // configuration) are answered here, after the UMP callback has seen them
+    void answerStream(const uint32_t* words);
+    void sendStream(const uint32_t* ump);
+    void sendStreamText(uint16_t status, int16_t block, const char* text, uint8_t length);
+
+    uint32_t umpWords[4];
+    uint8_t umpFill = 0;
+    uint8_t umpLength = 0;
+    MidiCallbackUMP cbUMP = nullptr;
+#endif
+
+    template<class Handlers>
+    uint32_t receive(Handlers& handlers, uint32_t maxPackets, uint32_t budget) {
+        uint32_t packets[16];
+        uint32_t times[16];
+        uint32_t count;
+        uint32_t start = budget ? micros() : 0;
+        serviceConnection();
+        if(interruptDispatch) return 0; // The interrupt reads the queues
+        while(maxPackets) {
+            uint32_t chunk = maxPackets < 16 ? maxPackets : 16;
+            if(budget && chunk > 4) chunk = 4;
+            if((count = USB_read_realtime(packets, times, chunk)) > 0) {
+                dispatch(handlers, packets, times, count, true);
+            } else if((count = USB_read_timestamped(packets, times, chunk)) > 0) {
+                dispatch(handlers, packets, times, count);
+            } else {
+                break;
+            }
+            maxPackets -= count;
+            if(budget && (uint32_t)micros() - start >= budget) break;
+        }
+        return USB_available() + USB_available_realtime();
+    }
+
+    void serviceConnection();
+    static void interruptHook(const uint32_t* packets, uint8_t count, uint32_t time, uint8_t realtime);
+
+    bool interruptDispatch = false;
+
+    uint32_t packetTime = 0;
+    MidiCallbackPacket cbPacket = nullptr;
+    MidiCallbackConnection cbConnection = nullptr;
+    uint8_t linkEvents = 0;
+    uint8_t linkState = USB_STATE_DEFAULT;
+    bool releasePending = false;
+#if WCH_USBMIDI_NOTE_TRACKING
+    uint8_t lostNoteOffOverflows = 0;
+    void recoverLostNoteOffs();
+#endif
+#if WCH_USBMIDI_NUM_CABLES > 1
+    USBMIDICable extraCables[WCH_USBMIDI_NUM_CABLES - 1];
+#endif
+};
+
+extern USBMIDI_ USBMIDI;
+
+// Scoped batch: sends made while an instance is alive are flushed together
+// when it goes out of scope.
+class USBMIDIBatch {
+public:
+    USBMIDIBatch() { USBMIDI.beginBatch(); }
+    ~USBMIDIBatch() { USBMIDI.endBatch(); }
+    USBMIDIBatch(const USBMIDIBatch&) = delete;
+    USBMIDIBatch& operator=(const USBMIDIBatch&) = delete;
+};
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "USBMIDIClock.h"
+#include "USBMIDI.h"
+
+// Filter gains (close to critically damped): while acquiring, phase 1/4
+// and period 1/32 of the timing error, which settles within about a
+// quarter note; once locked, 1/8 and 1/128 to average out more jitter
+#define CLOCK_PHASE_SHIFT         2
+#define CLOCK_PERIOD_GAIN         8  // 256 / 32, error in us to period Q8
+#define CLOCK_LOCKED_PHASE_SHIFT  3
+#define CLOCK_LOCKED_PERIOD_GAIN  2  // 256 / 128
+
+void USBMIDIClockFollower::reset() {
+    period = 0;
+    estimate = lastTick = 0;
+    seen = settled = 0;
+    gapTicks = gapCounted = 0;
+    tickCount = 0;
+    isRunning = startPending = false;
+}
+
+float USBMIDIClockFollower::bpm() const {
+    // 60 s / (24 ticks * period)
+    return period ? 2500000.0f * 256.0f / (float)period : 0.0f;
+}
+
+void USBMIDIClockFollower::handlePacket(uint32_t packet, uint32_t time) {
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    uint8_t status = USB_MIDI_BYTE(packet, 1);
+    if((cin == 0x0F || cin == 0x05) && status >= 0xF8) {
+        handleRealTime(status, time);
+    } else if(cin == 0x03 && status == 0xF2) { // Song Position Pointer, in 16th notes
+        tickCount = ((uint32_t)(USB_MIDI_BYTE(packet, 2) & 0x7F) | ((uint32_t)(USB_MIDI_BYTE(packet, 3) & 0x7F) << 7)) * 6;
+    }
+}
+
+void USBMIDIClockFollower::handleRealTime(uint8_t realtimebyte, uint32_t time) {
+    switch(realtimebyte) {
+        case 0xFA: // Start
+            tickCount = 0;
+            isRunning = true;
+            startPending = true;
+            return;
+        case 0xFB: // Continue
+            isRunning = true;
+            return;
+        case 0xFC: // Stop
+            isRunning = false;
+            return;
+        case 0xF8:
+            break;
+        default:
+            return;
+    }
+
+    // An interval of 2 or 3 periods (within a quarter of that) is ticks lost
+    // on the way, not a tempo change: counted, and the filter sees the
+    // error spread over them. That holds only if the next interval fits the
+    // old period again; the same multiple twice, or an interval that fits
+    // no multiple, means the tempo dropped: the ticks counted for the gap
+    // are taken back and the filter starts over from this tick
+    uint32_t interval = time - lastTick;
+    uint32_t ticksPeriod = period >> 8;
+    uint8_t ticks = 1;
+    bool fits = false;
+    lastTick = time;
+    if(seen >= 2) {
+        for(uint8_t n = 3; n >= 1; n--) {
+            uint32_t expected = ticksPeriod * n;
+            if(interval >= expected - expected / 4 && interval <= expected + expected / 4) {
+                fits = true;
+                if(n > 1) ticks = n;
+            }
+        }
+    }
+    bool slower = gapTicks > 1 && (ticks == gapTicks || !fits);
+    if(slower) {
+        tickCount -= gapCounted;
+        ticks = 1;
+    }
+    gapTicks = ticks;
+    gapCounted = 0;
+
+    // Position: the first tick after Start is tick 0
+    if(isRunning) {
+        if(startPending) startPending = false;
+        else tickCount++;
+        tickCount += ticks - 1;
+        gapCounted = ticks - 1;
+    }
+
+    // Tempo
+    if(seen < 2) {
+        if(seen++ == 1) {
+            period = interval << 8;
+            estimate = time;
+        }
+        return;
+    }
+    uint32_t predicted = estimate + ((period * ticks) >> 8);
+    int32_t error = (int32_t)(time - predicted);
+    int32_t tickError = error / ticks;
+    // A gap or burst (clock stopped and restarted, tempo jump) is not
+    // jitter: start over from this tick
+    if(slower || (ticks == 1 && (interval > ticksPeriod * 2 || interval < ticksPeriod / 2))) {
+        period = interval << 8;
+        estimate = time;
+        settled = 0;
+        return;
+    }
+    bool lock = locked();
+    estimate = predicted + (error >> (lock ? CLOCK_LOCKED_PHASE_SHIFT : CLOCK_PHASE_SHIFT));
+    int32_t adjusted = (int32_t)period + tickError * (lock ? CLOCK_LOCKED_PERIOD_GAIN : CLOCK_PERIOD_GAIN);
+    if(adjusted > 256) period = (uint32_t)adjusted;
+    // Settled: a full quarter note within 1/4 of a tick
+    uint32_t magnitude = tickError < 0 ? (uint32_t)-tickError : (uint32_t)tickError;
+    if(magnitude < ticksPeriod / 4) {
+        if(settled < 255) settled++;
+    } else {
+        settled = 0;
+    }
+}
+
+// --- Generator ---
+
+void USBMIDIClockGenerator::setTempo(float bpm) {
+    if(bpm < 1.0f) bpm = 1.0f;
+    period = (uint32_t)(2500000.0f * 256.0f / bpm);
+}
+
+float USBMIDIClockGenerator::tempo() const {
+    return 2500000.0f * 256.0f / (float)period;
+}
+
+void USBMIDIClockGenerator::begin(uint8_t message) {
+    USBMIDICable& port = USBMIDI.cable(cableNumber);
+    USBMIDI.enableTimestamps();
+    // A frame ahead, so the message and the first tick share their frame
+    uint32_t at = USBMIDI.now() + 1000;
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    port.sendRealTimeAt(at, message);
+#else
+    port.sendRealTime(message);
+#endif
+    next = (uint64_t)at << 8;
+    lastQueued = at;
+    isRunning = true;
+    update();
+}
+
+void USBMIDIClockGenerator::start() {
+    tickCount = 0;
+    begin(0xFA);
+}
+
+void USBMIDIClockGenerator::resume() {
+    begin(0xFB);
+}
+
+void USBMIDIClockGenerator::stop() {
+    if(!isRunning) return;
+    isRunning = false;
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    // Same time as the last queued tick: released right after it
+    USBMIDI.cable(cableNumber).sendRealTimeAt(lastQueued, 0xFC);
+#else
+    USBMIDI.cable(cableNumber).sendRealTime(0xFC);
+#endif
+}
+
+void USBMIDIClockGenerator::update() {
+    if(!isRunning) return;
+    USBMIDICable& port = USBMIDI.cable(cableNumber);
+    uint32_t now = USBMIDI.now();
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    // Queue ticks up to 4 ms ahead
+    while((int32_t)((uint32_t)(next >> 8) - now) <= 4000) {
+        uint32_t at = (uint32_t)(next >> 8);
+        if(!port.sendRealTimeAt(at, 0xF8)) break; // Schedule full: next time
+        lastQueued = at;
+        next += period;
+        tickCount++;
+    }
+#else
+    // No scheduler: sent when due, to within one loop()
+    while((int32_t)((uint32_t)(next >> 8) - now) <= 0) {
+        port.sendRealTime(0xF8);
+        next += period;
+        tickCount++;
+    }
+#endif
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+
+// MIDI clock (24 ticks per quarter note) in both directions.
+
+// Follows an incoming clock: feed it every received packet with its receive
+// time, e.g. from USBMIDI.setHandlePacket(), using USBMIDI.timestamp()
+// (taken in the USB interrupt, see USBMIDI.enableTimestamps) or micros().
+// An alpha-beta filter (a phase-locked loop on the tick times) smooths the
+// tick-to-tick jitter of USB and serial transport into a steady tempo and a
+// prediction of the next tick. Start/Continue/Stop and Song Position
+// Pointer keep the song position. An interval of two or three tick periods
+// is taken as one or two lost ticks: they are counted, and the tempo holds.
+// If the next interval does not fit the old period again, the tempo really
+// dropped: the extra ticks are taken back and the new tempo followed.
+//
+//   USBMIDIClockFollower clock;
+//   void onPacket(uint32_t packet, uint32_t timestamp) { clock.handlePacket(packet, timestamp); }
+//   ... lfoRate = clock.bpm() / 60;
+class USBMIDIClockFollower {
+public:
+    USBMIDIClockFollower() { reset(); }
+
+    // Any USB-MIDI packet (see USB_MIDI_PACKET); only clock, transport and
+    // Song Position Pointer are used. time in microseconds.
+    void handlePacket(uint32_t packet, uint32_t time);
+    // Clock and transport bytes (0xF8-0xFC) alone, e.g. from setHandleRealTime
+    void handleRealTime(uint8_t realtimebyte, uint32_t time);
+    // Forgets tempo, position and transport state
+    void reset();
+
+    // Filtered tempo, 0 until two ticks have been seen
+    float bpm() const;
+    // Filtered time between ticks in microseconds (1/256 us resolution in
+    // tickPeriodQ8), 0 until known
+    uint32_t tickPeriod() const { return period >> 8; }
+    uint32_t tickPeriodQ8() const { return period; }
+    // Predicted time of the next tick, on the clock passed to handle*()
+    uint32_t nextTick() const { return estimate + (period >> 8); }
+    // True once the estimate has settled (a quarter note of ticks within a
+    // small error)
+    bool locked() const { return settled >= 24; }
+
+    // Transport: running between Start/Continue and Stop. ticks() counts
+    // clock ticks since the song start while running (Song Position Pointer
+    // sets it); songPosition() is the same in MIDI beats (16th notes).
+    bool running() const { return isRunning; }
+    uint32_t ticks() const { return tickCount; }
+    uint32_t songPosition() const { return tickCount / 6; }
+
+private:
+    uint32_t period;     // Microseconds per tick, Q8
+    uint32_t estimate;   // Filtered time of the last tick
+    uint32_t lastTick;   // Raw time of the last tick
+    uint8_t seen;        // Ticks since the filter (re)started, up to 2
+    uint8_t settled;
+    uint8_t gapTicks;    // Ticks the last interval was read as
+    uint8_t gapCounted;  // Of those, added to tickCount beyond the one
+    uint32_t tickCount;
+    bool isRunning;
+    bool startPending;   // Start seen: the next tick is tick 0
+};
+
+// Generates a 24-PPQN clock on a cable. Ticks are queued ahead on the USB
+// frame clock (USBMIDI.sendAt) and released by the Start-of-Frame interrupt,
+// so they keep their spacing even when loop() is busy; call update() at
+// least every few milliseconds. Fractional tick periods are accumulated, so
+// the tempo does not drift.
+class USBMIDIClockGenerator {
+public:
+    explicit USBMIDIClockGenerator(uint8_t cable = 0) : cableNumber(cable) {}
+
+    void setTempo(float bpm);
+    float tempo() const;
+
+    void start();        // Start (0xFA), song position 0
+    void resume();       // Continue (0xFB) from the current position
+    void stop();         // Stop (0xFC); ticks already queued go out first
+    void update();
+
+    // Position as queued: runs up to 4 ms ahead of what the host has received
+    bool running() const { return isRunning; }
+    uint32_t ticks() const { return tickCount; }
+    uint32_t songPosition() const { return tickCount / 6; }
+
+private:
+    void begin(uint8_t message);
+
+    uint8_t cableNumber;
+    bool isRunning = false;
+    uint32_t period = 20833u << 8; // 120 BPM, microseconds per tick Q8
+    uint64_t next = 0;             // Time of the next tick, Q8
+    uint32_t lastQueued = 0;
+    uint32_t tickCount = 0;
+};
@@ -0,0 +1,13 @@
+#include "USBMIDIRouter.h"
+#include "USBMIDI.h"
+
+bool usbmidiRouterToUSB(uint32_t packet, void* context) {
+    (void)context;
+    USBMIDICable& port = USBMIDI.cable(USB_MIDI_BYTE(packet, 0) >> 4);
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    if(cin == 0x0F && USB_MIDI_BYTE(packet, 1) >= 0xF8) {
+        port.sendRealTime(USB_MIDI_BYTE(packet, 1));
+        return true;
+    }
+    return port.sendPacket(cin, USB_MIDI_BYTE(packet, 1), USB_MIDI_BYTE(packet, 2), USB_MIDI_BYTE(packet, 3));
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "internal/wch_usbmidi_internal.h"
+
+// Sink for one router output: delivers a USB-MIDI packet (see
+// USB_MIDI_PACKET), false if it could not be taken. usbmidiRouterToUSB
+// sends to the cable in the packet.
+typedef bool (*USBMIDIRouterSink)(uint32_t packet, void* context);
+bool usbmidiRouterToUSB(uint32_t packet, void* context);
+
+// Message classes for route filters
+enum : uint8_t {
+    ROUTE_NOTES     = 0x01, // Note On/Off, poly pressure
+    ROUTE_CC        = 0x02,
+    ROUTE_PROGRAM   = 0x04,
+    ROUTE_PRESSURE  = 0x08, // Channel pressure
+    ROUTE_PITCHBEND = 0x10,
+    ROUTE_SYSEX     = 0x20,
+    ROUTE_COMMON    = 0x40, // MTC, song position/select, tune request
+    ROUTE_REALTIME  = 0x80,
+    ROUTE_ALL       = 0xFF
+};
+
+// Routing matrix and merger: Inputs sources (USB cables, UARTs, local
+// controls, ...) to Outputs sinks. Each source/output pair is a route with
+// its own channel and message filters and channel/cable remaps.
+//
+// Merging keeps messages whole: once a source starts a SysEx or an
+// RPN/NRPN sequence (CC 99-101/98 ... 6/38) on an output, other sources'
+// messages for that output wait in a queue of HoldSize packets until it
+// ends. Realtime messages never wait. A parameter sequence also ends when
+// its source sends anything else or the queue fills up; a SysEx does not,
+// and packets that find the queue full are dropped (see dropped()), except
+// Note Off, All Sound Off and All Notes Off: those take the place of the
+// newest held packet of another kind (not SysEx), so no note is left
+// hanging by a long dump from another source.
+//
+// No allocation; each input() costs one filter step per output plus, when
+// a sequence ends, at most HoldSize queued packets.
+//
+//   USBMIDIRouter<2, 2> router;                  // 0: USB in, 1: UART in
+//   router.setOutput(0, usbmidiRouterToUSB);     // 0: USB out
+//   router.setOutput(1, toUart, &bridge);        // 1: UART out
+//   router.connect(1, 0);                        // UART -> USB
+//   router.connect(0, 1, 0x0001);                // USB channel 1 only -> UART
+//   router.remapChannel(0, 1, 9);                //   ...played on channel 10
+template<uint8_t Inputs, uint8_t Outputs, uint8_t HoldSize = 32>
+class USBMIDIRouter {
+public:
+    static const uint8_t KEEP = 0xFF;
+
+    void setOutput(uint8_t output, USBMIDIRouterSink sink, void* context = nullptr) {
+        if(output >= Outputs) return;
+        outputs[output].sink = sink;
+        outputs[output].context = context;
+    }
+
+    // channels: bit n passes source channel n; types: ROUTE_* flags
+    void connect(uint8_t input, uint8_t output, uint16_t channels = 0xFFFF, uint8_t types = ROUTE_ALL) {
+        if(input >= Inputs || output >= Outputs) return;
+        Route& r = routes[input][output];
+        r.channels = channels;
+        r.types = types;
+        r.channel = KEEP;
+        r.cable = KEEP;
+    }
+    void disconnect(uint8_t input, uint8_t output) {
+        if(input < Inputs && output < Outputs) routes[input][output].types = 0;
+    }
+    // Channel messages on this route go out on channel (0-15), KEEP to undo
+    void remapChannel(uint8_t input, uint8_t output, uint8_t channel) {
+        if(input < Inputs && output < Outputs) routes[input][output].channel = channel;
+    }
+    // Packets on this route go out on cable (0-15), KEEP to undo
+    void remapCable(uint8_t input, uint8_t output, uint8_t cable) {
+        if(input < Inputs && output < Outputs) routes[input][output].cable = cable;
+    }
+
+    // Routes one packet from input to every connected output
+    void input(uint8_t source, uint32_t packet) {
+        if(source >= Inputs) return;
+        uint8_t type = typeOf(packet);
+        if(!type) return;
+        for(uint8_t o = 0; o < Outputs; o++) {
+            const Route& r = routes[source][o];
+            if(!(r.types & type)) continue;
+            uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+            uint32_t out = packet;
+            if(cin >= 0x08 && cin <= 0x0E) {
+                if(!((r.channels >> (USB_MIDI_BYTE(packet, 1) & 0x0F)) & 1)) continue;
+                if(r.channel != KEEP) out = (out & ~0x0F00ul) | ((uint32_t)(r.channel & 0x0F) << 8);
+            }
+            if(r.cable != KEEP) out = (out & ~0xF0ul) | ((uint32_t)(r.cable & 0x0F) << 4);
+            deliver(o, source, out, type);
+        }
+    }
+
+    // Ends whatever sequence source has open (e.g. its device was unplugged
+    // in the middle of a SysEx) and lets waiting packets through
+    void release(uint8_t source) {
+        for(uint8_t o = 0; o < Outputs; o++) {
+            if(outputs[o].owner == source) {
+                outputs[o].owner = NONE;
+                drain(o);
+            }
+        }
+    }
+
+    // Packets held back on output right now, and packets lost so far
+    uint8_t held(uint8_t output) const { return output < Outputs ? outputs[output].count : 0; }
+    uint32_t dropped() const { return droppedPackets; }
+
+private:
+    static const uint8_t NONE = 0xFF;
+    enum : uint8_t { LOCK_SYSEX, LOCK_PARAM };
+
+    struct Route {
+        uint16_t channels = 0xFFFF;
+        uint8_t types = 0;           // Disconnected
+        uint8_t channel = KEEP;
+        uint8_t cable = KEEP;
+    };
+
+    struct Output {
+        USBMIDIRouterSink sink = nullptr;
+        void* context = nullptr;
+        uint8_t owner = NONE;        // Source with a sequence in progress
+        uint8_t lock = LOCK_SYSEX;
+        uint8_t lockChannel = 0;
+        uint8_t head = 0, count = 0; // Held packets ring
+        uint32_t packets[HoldSize];
+        uint8_t sources[HoldSize];
+        uint8_t types[HoldSize];
+    };
+
+    static uint8_t typeOf(uint32_t packet) {
+        uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+        uint8_t b1 = USB_MIDI_BYTE(packet, 1);
+        switch(cin) {
+            case 0x08: case 0x09: case 0x0A: return ROUTE_NOTES;
+            case 0x0B: return ROUTE_CC;
+            case 0x0C: return ROUTE_PROGRAM;
+            case 0x0D: return ROUTE_PRESSURE;
+            case 0x0E: return ROUTE_PITCHBEND;
+            case 0x04: case 0x06: case 0x07: return ROUTE_SYSEX;
+            case 0x02: case 0x03: return ROUTE_COMMON;
+            case 0x05: return b1 == 0xF7 ? ROUTE_SYSEX : ROUTE_COMMON;
+            case 0x0F: return b1 >= 0xF8 ? ROUTE_REALTIME : ROUTE_COMMON;
+            default: return 0;
+        }
+    }
+
+    void emit(uint8_t o, uint32_t packet) {
+        Output& out = outputs[o];
+        if(!out.sink || !out.sink(packet, out.context)) droppedPackets++;
+    }
+
+    // Sends and tracks the sequence state of the output
+    void pass(uint8_t o, uint8_t source, uint32_t packet, uint8_t type) {
+        Output& out = outputs[o];
+        uint8_t channel = USB_MIDI_BYTE(packet, 1) & 0x0F;
+        uint8_t control = USB_MIDI_BYTE(packet, 2);
+        bool paramSelect = type == ROUTE_CC && control >= 98 && control <= 101;
+        bool dataEntry = type == ROUTE_CC && (control == 6 || control == 38);
+
+        // The owner moving on to something else ends its parameter sequence
+        if(out.owner == source && out.lock == LOCK_PARAM && type != ROUTE_REALTIME
+           && !((paramSelect || dataEntry) && channel == out.lockChannel)) {
+            out.owner = NONE;
+        }
+        emit(o, packet);
+        if(type == ROUTE_SYSEX) {
+            uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+            if(cin == 0x04) {
+                out.owner = source;
+                out.lock = LOCK_SYSEX;
+            } else if(out.owner == source) {
+                out.owner = NONE;
+            }
+        } else if(paramSelect) {
+            out.owner = source;
+            out.lock = LOCK_PARAM;
+            out.lockChannel = channel;
+        } else if(out.owner == source && out.lock == LOCK_PARAM && control == 38 && dataEntry) {
+            out.owner = NONE;
+        }
+    }
+
+    void deliver(uint8_t o, uint8_t source, uint32_t packet, uint8_t type) {
+        Output& out = outputs[o];
+        if(type == ROUTE_REALTIME) { // Never waits, never breaks a sequence
+            emit(o, packet);
+            return;
+        }
+        drain(o);
+        if(out.owner == source || out.owner == NONE) { // Nothing held if NONE
+            pass(o, source, packet, type);
+            if(out.owner == NONE) drain(o);
+            return;
+        }
+        if(out.count == HoldSize && out.lock == LOCK_PARAM) {
+            // A stalled parameter sequence gives way; draining frees at
+            // least one slot, so this retries once
+            out.owner = NONE;
+            deliver(o, source, packet, type);
+            return;
+        }
+        // A SysEx cannot be cut: drop the newcomer unless it ends notes and
+        // something else can make room
+        if(out.count == HoldSize && !(endsNotes(packet, type) && evict(out))) {
+            droppedPackets++;
+            return;
+        }
+        uint8_t slot = (uint8_t)((out.head + out.count++) % HoldSize);
+        out.packets[slot] = packet;
+        out.sources[slot] = source;
+        out.types[slot] = type;
+    }
+
+    static bool endsNotes(uint32_t packet, uint8_t type) {
+        uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+        if(type == ROUTE_NOTES) return cin == 0x08 || (cin == 0x09 && USB_MIDI_BYTE(packet, 3) == 0);
+        return type == ROUTE_CC && (USB_MIDI_BYTE(packet, 2) == 120 || USB_MIDI_BYTE(packet, 2) == 123);
+    }
+
+    // Drops the newest held packet that neither ends notes nor belongs to a
+    // SysEx; false if there is none
+    bool evict(Output& out) {
+        for(uint8_t i = out.count; i-- > 0;) {
+            uint8_t slot = (uint8_t)((out.head + i) % HoldSize);
+            if(out.types[slot] == ROUTE_SYSEX || endsNotes(out.packets[slot], out.types[slot])) continue;
+            for(uint8_t j = i + 1; j < out.count; j++, slot = (uint8_t)((slot + 1) % HoldSize)) {
+                uint8_t next = (uint8_t)((slot + 1) % HoldSize);
+                out.packets[slot] = out.packets[next];
+                out.sources[slot] = out.sources[next];
+                out.types[slot] = out.types[next];
+            }
+            out.count--;
+            droppedPackets++;
+            return true;
+        }
+        return false;
+    }
+
+    // Sends held packets in order while no sequence is open, and the owner's
+    // own held packets while one is; leaves nothing held if the output ends
+    // up free
+    void drain(uint8_t o) {
+        Output& out = outputs[o];
+        for(;;) {
+            while(out.count && (out.owner == NONE || out.owner == out.sources[out.head])) {
+                uint8_t slot = out.head;
+                out.head = (uint8_t)((out.head + 1) % HoldSize);
+                out.count--;
+                pass(o, out.sources[slot], out.packets[slot], out.types[slot]);
+            }
+            if(!out.count) return;
+
+            // Held behind another source: take the owner's packets out of
+            // the queue, in order, keeping the rest in place
+            bool passed = false;
+            uint8_t kept = 0;
+            for(uint8_t i = 0; i < out.count; i++) {
+                uint8_t slot = (uint8_t)((out.head + i) % HoldSize);
+                if(out.owner != NONE && out.sources[slot] == out.owner) {
+                    pass(o, out.sources[slot], out.packets[slot], out.types[slot]);
+                    passed = true;
+                    continue;
+                }
+                uint8_t to = (uint8_t)((out.head + kept++) % HoldSize);
+                out.packets[to] = out.packets[slot];
+                out.sources[to] = out.sources[slot];
+                out.types[to] = out.types[slot];
+            }
+            out.count = kept;
+            if(!passed || out.owner != NONE) return;
+        }
+    }
+
+    Route routes[Inputs][Outputs];
+    Output outputs[Outputs];
+    uint32_t droppedPackets = 0;
+};
@@ -0,0 +1,103 @@
+#include "USBMIDISerial.h"
+#include "internal/wch_usbmidi_internal.h"
+
+void USBMIDISerialParser::reset() {
+    status = needed = count = 0;
+    sysex = false;
+}
+
+// The bytes collected so far plus F7 as the closing SysEx packet (CIN 5/6/7)
+uint8_t USBMIDISerialParser::sysexEnd(uint32_t* packet) {
+    data[count] = 0xF7;
+    uint8_t length = count + 1;
+    *packet = USB_MIDI_PACKET((cableNumber << 4) | (0x04 + length), data[0],
+                              length > 1 ? data[1] : 0, length > 2 ? data[2] : 0);
+    sysex = false;
+    count = 0;
+    return 1;
+}
+
+uint8_t USBMIDISerialParser::parse(uint8_t byte, uint32_t* packets) {
+    uint8_t n = 0;
+
+    if(byte >= 0xF8) { // Realtime: passes through, state untouched
+        if(byte == 0xF9 || byte == 0xFD) return 0; // Undefined
+        packets[0] = USB_MIDI_PACKET((cableNumber << 4) | 0x0F, byte, 0, 0);
+        return 1;
+    }
+
+    if(!(byte & 0x80)) { // Data byte
+        if(sysex) {
+            data[count++] = byte;
+            if(count == 3) {
+                packets[0] = USB_MIDI_PACKET((cableNumber << 4) | 0x04, data[0], data[1], data[2]);
+                count = 0;
+                return 1;
+            }
+            return 0;
+        }
+        if(!status) return 0; // No status to apply it to
+        data[count++] = byte;
+        if(count < needed) return 0;
+        count = 0;
+        uint8_t cin;
+        if(status < 0xF0) cin = status >> 4;
+        else cin = status == 0xF2 ? 0x03 : 0x02;
+        packets[0] = USB_MIDI_PACKET((cableNumber << 4) | cin, status, data[0], needed > 1 ? data[1] : 0);
+        if(status >= 0xF0) status = 0; // System Common has no running status
+        return 1;
+    }
+
+    // Status byte: any but F7 also ends a SysEx in progress
+    if(sysex) {
+        n = sysexEnd(packets);
+        if(byte == 0xF7) return n;
+    }
+    count = 0;
+    status = 0;
+    switch(byte) {
+        case 0xF0:
+            sysex = true;
+            data[count++] = byte;
+            break;
+        case 0xF1: case 0xF3: // MTC quarter frame, song select
+            status = byte;
+            needed = 1;
+            break;
+        case 0xF2: // Song position
+            status = byte;
+            needed = 2;
+            break;
+        case 0xF6: // Tune request
+            packets[n++] = USB_MIDI_PACKET((cableNumber << 4) | 0x05, byte, 0, 0);
+            break;
+        case 0xF4: case 0xF5: case 0xF7: // Undefined, stray EOX
+            break;
+        default: // Channel message
+            status = byte;
+            needed = (byte & 0xE0) == 0xC0 ? 1 : 2; // Program change, channel pressure: 1
+            break;
+    }
+    return n;
+}
+
+uint8_t USBMIDISerialEncoder::encode(uint32_t packet, uint8_t* bytes) {
+    static const uint8_t lengths[16] = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 };
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    uint8_t b1 = USB_MIDI_BYTE(packet, 1);
+    uint8_t length = lengths[cin];
+    uint8_t n = 0;
+
+    if(cin >= 0x08 && cin <= 0x0E) {
+        if(b1 != runningStatus) bytes[n++] = b1;
+        runningStatus = b1;
+        for(uint8_t i = 2; i <= length; i++) bytes[n++] = USB_MIDI_BYTE(packet, i);
+        return n;
+    }
+    if(length == 0) return 0;
+
+    // Realtime keeps the run going; SysEx and System Common end it
+    if(!(cin == 0x0F || cin == 0x05) || b1 < 0xF8) runningStatus = 0;
+    for(uint8_t i = 1; i <= length; i++) bytes[n++] = USB_MIDI_BYTE(packet, i);
+    return n;
+}
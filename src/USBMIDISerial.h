@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+// Byte stream (DIN / TRS serial MIDI) <-> USB-MIDI packets (see
+// USB_MIDI_PACKET). Plain state machines without hardware access; the
+// bridge in USBMIDISerialBridge.h runs them against a UART.
+
+// Serial MIDI in: running status, realtime bytes anywhere (also inside
+// SysEx and between data bytes), SysEx of any length and System Common.
+//
+//   uint32_t packets[2];
+//   uint8_t n = parser.parse(byte, packets);
+class USBMIDISerialParser {
+public:
+    explicit USBMIDISerialParser(uint8_t cable = 0) : cableNumber(cable & 0x0F) { reset(); }
+
+    // Feeds one byte. Returns the packets it completed (0-2, the second only
+    // when a status byte cuts a SysEx short and is itself a whole message).
+    uint8_t parse(uint8_t byte, uint32_t* packets);
+    // Forgets running status and any partial message
+    void reset();
+
+private:
+    uint8_t sysexEnd(uint32_t* packet);
+
+    uint8_t cableNumber;
+    uint8_t status;          // Running status, or system common in progress; 0 = none
+    uint8_t needed;          // Data bytes the status takes
+    uint8_t count;           // Data bytes (or SysEx bytes) collected
+    uint8_t data[3];
+    bool sysex;
+};
+
+// Serial MIDI out: one USB-MIDI packet to its bytes, leaving out the status
+// byte while it repeats (running status). Realtime bytes do not break a run;
+// System Common and SysEx end it, as receivers expect.
+class USBMIDISerialEncoder {
+public:
+    // Bytes to send for packet (0-3); 0 for reserved CINs
+    uint8_t encode(uint32_t packet, uint8_t* bytes);
+    // Sends the status byte again with the next message (e.g. after the
+    // receiver may have missed it)
+    void reset() { runningStatus = 0; }
+
+private:
+    uint8_t runningStatus = 0;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "USBMIDI.h"
+#include "USBMIDISerial.h"
+#if WCH_USBMIDI_MIDI2
+#include "USBMIDIUMP.h"
+#endif
+
+// USB <-> serial MIDI bridge for one cable. Port is any Arduino Stream
+// (HardwareSerial, SoftwareSerial, ...) opened at 31250 baud.
+//
+//   USBMIDISerialBridge<HardwareSerial> bridge(Serial1);
+//   void onPacket(uint32_t packet, uint32_t timestamp) { bridge.write(packet); }
+//   void setup() { USBMIDI.begin(); Serial1.begin(31250); USBMIDI.setHandlePacket(onPacket); }
+//   void loop() { USBMIDI.poll(); bridge.update(); }
+//
+// Serial input is parsed completely (running status, SysEx, System Common,
+// realtime) and queued for USB in batches; realtime goes out on the priority
+// lane. When the USB TX FIFO is full, reading pauses and the bytes wait in
+// the UART's receive buffer instead of being dropped. Output to serial uses
+// running status.
+//
+// On the USB MIDI 2.0 setting SysEx travels as 7-bit SysEx UMPs: serial
+// SysEx is repacked into them, and received ones reach the port through
+// writeUMP() (hook it up with USBMIDI.setHandleUMP); everything else still
+// comes through write().
+//
+// The port is used through the Stream interface rather than driving the
+// USART with DMA: the core's HardwareSerial already owns the USART and its
+// interrupt and buffers both directions, and the bridge stays usable with
+// any other Stream.
+template<class Port>
+class USBMIDISerialBridge {
+public:
+    explicit USBMIDISerialBridge(Port& serialPort, uint8_t cable = 0)
+        : port(serialPort), cableNumber(cable), parser(cable) {}
+
+    // Serial -> USB: call from loop()
+    void update() {
+        USBMIDICable& usb = USBMIDI.cable(cableNumber);
+        USB_batch_begin();
+        while(flushPending(usb) && port.available() > 0) {
+            pendingCount = parser.parse((uint8_t)port.read(), pending);
+            pendingSent = 0;
+        }
+        USB_batch_end();
+    }
+
+    // USB -> serial: received packets for this bridge's cable are written
+    // out, others ignored. Blocks while the UART transmit buffer is full.
+    void write(uint32_t packet) {
+        uint8_t bytes[3];
+        if((USB_MIDI_BYTE(packet, 0) >> 4) != cableNumber) return;
+        uint8_t n = encoder.encode(packet, bytes);
+        if(n) port.write(bytes, n);
+    }
+
+#if WCH_USBMIDI_MIDI2
+    // USB -> serial on the MIDI 2.0 setting: SysEx UMPs of this bridge's
+    // group are written out, other UMPs ignored (they arrive translated
+    // through write()).
+    void writeUMP(const uint32_t* words) {
+        uint8_t bytes[8];
+        bool last;
+        if((words[0] >> 28) != UMP_MT_SYSEX7 || ((words[0] >> 24) & 0x0F) != cableNumber) return;
+        uint8_t n = usbmidiUMPSysEx(words, bytes, &last);
+        encoder.reset(); // SysEx ends running status
+        port.write(bytes, n);
+    }
+#endif
+
+    // Forget running status on both sides (e.g. after the serial device was
+    // replugged)
+    void reset() {
+        parser.reset();
+        encoder.reset();
+#if WCH_USBMIDI_MIDI2
+        sysexFill = 0;
+        sysexStarted = false;
+#endif
+    }
+
+private:
+    // Sends what the last byte produced; false while USB has no room
+    bool flushPending(USBMIDICable& usb) {
+        for(;;) {
+#if WCH_USBMIDI_MIDI2
+            if(!flushSysEx()) return false;
+#endif
+            if(pendingSent == pendingCount) return true;
+            uint32_t packet = pending[pendingSent++];
+            uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+#if WCH_USBMIDI_MIDI2
+            if(USBMIDI.umpActive() && cin >= 0x04 && cin <= 0x07 && !(cin == 0x05 && USB_MIDI_BYTE(packet, 1) != 0xF7)) {
+                sysexToUMP(packet);
+                continue;
+            }
+#endif
+            if(cin == 0x0F && USB_MIDI_BYTE(packet, 1) >= 0xF8) {
+                usb.sendRealTime(USB_MIDI_BYTE(packet, 1));
+            } else if(!usb.sendPacket(cin, USB_MIDI_BYTE(packet, 1), USB_MIDI_BYTE(packet, 2),
+                                      USB_MIDI_BYTE(packet, 3))) {
+                // Nobody listening: drop rather than stall the UART forever
+                if(!USBMIDI.connected()) continue;
+                pendingSent--;
+                return false;
+            }
+        }
+    }
+
+#if WCH_USBMIDI_MIDI2
+    // The bytes of one SysEx packet into 7-bit SysEx UMPs, 6 payload bytes
+    // each. A full UMP is only sent once the next byte shows whether it is
+    // the last one; at most two come out of one packet.
+    void sysexToUMP(uint32_t packet) {
+        static const uint8_t lengths[4] = { 3, 1, 2, 3 }; // CIN 4-7
+        uint8_t length = lengths[(USB_MIDI_BYTE(packet, 0) & 0x0F) - 0x04];
+        for(uint8_t i = 1; i <= length; i++) {
+            uint8_t byte = USB_MIDI_BYTE(packet, i);
+            if(byte == 0xF0) {
+                sysexFill = 0;
+                sysexStarted = false;
+            } else if(byte == 0xF7) {
+                queueSysEx(sysexStarted ? 3 : 0); // End, or complete in one
+                sysexStarted = false;
+            } else {
+                if(sysexFill == 6) {
+                    queueSysEx(sysexStarted ? 2 : 1); // Continue, or start
+                    sysexStarted = true;
+                }
+                sysexData[sysexFill++] = byte;
+            }
+        }
+    }
+
+    void queueSysEx(uint8_t status) {
+        usbmidiSysExToUMP(cableNumber, status, sysexData, sysexFill, sysexOut[sysexCount++]);
+        sysexFill = 0;
+    }
+
+    // Sends the queued SysEx UMPs; false while USB has no room. Dropped if
+    // nobody is listening or the host left the MIDI 2.0 setting.
+    bool flushSysEx() {
+        for(; sysexSent < sysexCount; sysexSent++) {
+            if(USBMIDI.sendUMP(sysexOut[sysexSent], 2)) continue;
+            if(USBMIDI.connected() && USBMIDI.umpActive()) return false;
+        }
+        sysexSent = sysexCount = 0;
+        return true;
+    }
+#endif
+
+    Port& port;
+    uint8_t cableNumber;
+    USBMIDISerialParser parser;
+    USBMIDISerialEncoder encoder;
+    uint32_t pending[2];
+    uint8_t pendingCount = 0;
+    uint8_t pendingSent = 0;
+#if WCH_USBMIDI_MIDI2
+    uint8_t sysexData[6];
+    uint8_t sysexFill = 0;
+    bool sysexStarted = false;
+    uint32_t sysexOut[2][2];
+    uint8_t sysexCount = 0;
+    uint8_t sysexSent = 0;
+#endif
+};
@@ -0,0 +1,121 @@
+#include "USBMIDIStateCache.h"
+#include "internal/wch_usbmidi_internal.h"
+#include <string.h>
+
+void USBMIDIStateCache::reset() {
+    USB_tx_lock(); // With interrupt dispatch, update() runs in the interrupt
+    memset(ccValue, 0, sizeof(ccValue));
+    memset(notes, 0, sizeof(notes));
+    memset(ccDirty, 0, sizeof(ccDirty));
+    memset(bend, 0, sizeof(bend));
+    memset(chanPressure, 0, sizeof(chanPressure));
+    memset(programNumber, 0, sizeof(programNumber));
+    memset(dirtyFlags, 0, sizeof(dirtyFlags));
+    dirtyChannels = 0;
+    USB_tx_unlock();
+}
+
+void USBMIDIStateCache::update(uint32_t packet) {
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    uint8_t channel = USB_MIDI_BYTE(packet, 1) & 0x0F;
+    uint8_t b2 = USB_MIDI_BYTE(packet, 2) & 0x7F;
+    uint8_t b3 = USB_MIDI_BYTE(packet, 3) & 0x7F;
+    uint32_t bit = 1ul << (b2 & 31);
+    uint32_t& noteWord = notes[channel][b2 >> 5];
+
+    switch(cin) {
+        case 0x09: // Note On (velocity 0 = Off)
+            if(b3 > 0) {
+                if(!(noteWord & bit)) { noteWord |= bit; markDirty(channel, CHANGED_NOTES); }
+                break;
+            }
+            // fall through
+        case 0x08: // Note Off
+            if(noteWord & bit) { noteWord &= ~bit; markDirty(channel, CHANGED_NOTES); }
+            break;
+
+        case 0x0B: // Control Change
+            if(b2 == 120 || b2 == 123) { // All Sound Off / All Notes Off
+                if(notes[channel][0] | notes[channel][1] | notes[channel][2] | notes[channel][3]) {
+                    memset(notes[channel], 0, sizeof(notes[channel]));
+                    markDirty(channel, CHANGED_NOTES);
+                }
+            }
+            setCC(channel, b2, b3);
+            if(b2 == 121) resetControllers(channel);
+            break;
+
+        case 0x0C: // Program Change
+            if(programNumber[channel] != b2) { programNumber[channel] = b2; markDirty(channel, CHANGED_PROGRAM); }
+            break;
+
+        case 0x0D: // Channel Pressure
+            if(chanPressure[channel] != b2) { chanPressure[channel] = b2; markDirty(channel, CHANGED_PRESSURE); }
+            break;
+
+        case 0x0E: { // Pitch Bend
+            int16_t value = (int16_t)((b2 | (b3 << 7)) - 8192);
+            if(bend[channel] != value) { bend[channel] = value; markDirty(channel, CHANGED_PITCHBEND); }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void USBMIDIStateCache::setCC(uint8_t channel, uint8_t control, uint8_t value) {
+    if(ccValue[channel][control] != value) {
+        ccValue[channel][control] = value;
+        ccDirty[channel][control >> 5] |= 1ul << (control & 31);
+        markDirty(channel, CHANGED_CC);
+    }
+}
+
+// Reset All Controllers as RP-015 has it: modulation, the pedals and
+// pressure to 0, expression to 127, bend centered. Volume, pan, bank and
+// program are kept.
+void USBMIDIStateCache::resetControllers(uint8_t channel) {
+    setCC(channel, 1, 0);
+    setCC(channel, 11, 127);
+    for(uint8_t control = 64; control <= 67; control++) setCC(channel, control, 0);
+    if(chanPressure[channel]) { chanPressure[channel] = 0; markDirty(channel, CHANGED_PRESSURE); }
+    if(bend[channel]) { bend[channel] = 0; markDirty(channel, CHANGED_PITCHBEND); }
+}
+
+uint8_t USBMIDIStateCache::activeNoteCount(uint8_t channel) const {
+    const uint32_t* words = notes[channel & 0x0F];
+    return __builtin_popcount(words[0]) + __builtin_popcount(words[1])
+         + __builtin_popcount(words[2]) + __builtin_popcount(words[3]);
+}
+
+uint8_t USBMIDIStateCache::takeChanges(uint8_t channel) {
+    channel &= 0x0F;
+    USB_tx_lock(); // Keeps interrupt dispatch's update() out of the bitmaps
+    uint8_t flags = dirtyFlags[channel];
+    uint32_t* cc = ccDirty[channel];
+    dirtyFlags[channel] = (cc[0] | cc[1] | cc[2] | cc[3]) ? CHANGED_CC : 0;
+    if(!dirtyFlags[channel]) dirtyChannels &= (uint16_t)~(1u << channel);
+    USB_tx_unlock();
+    return flags;
+}
+
+int USBMIDIStateCache::takeChangedCC(uint8_t channel) {
+    channel &= 0x0F;
+    int control = -1;
+    USB_tx_lock();
+    uint32_t* cc = ccDirty[channel];
+    for(uint8_t w = 0; w < 4; w++) {
+        if(cc[w]) {
+            control = w * 32 + __builtin_ctz(cc[w]);
+            cc[w] &= cc[w] - 1;
+            if(!(cc[0] | cc[1] | cc[2] | cc[3])) {
+                dirtyFlags[channel] &= ~CHANGED_CC;
+                if(!dirtyFlags[channel]) dirtyChannels &= (uint16_t)~(1u << channel);
+            }
+            break;
+        }
+    }
+    USB_tx_unlock();
+    return control;
+}
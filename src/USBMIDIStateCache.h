@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+// Current state of the 16 MIDI channels of one cable, updated from received
+// packets once attached with USBMIDI.setStateCache() (about 2.6 KB of RAM).
+// Queries are O(1); changes are tracked in dirty bits that the take*()
+// calls read and clear, so a display can redraw only what moved. With
+// interrupt dispatch the cache is updated in the USB interrupt; take*() and
+// reset() mask it for the few cycles they need, so they are safe from the
+// main loop. Reset All Controllers (CC 121) resets modulation, expression,
+// the pedals (CC 64-67), pressure and pitch bend, as RP-015 describes.
+//
+//   USBMIDIStateCache midiState;
+//   USBMIDI.setStateCache(&midiState);
+//   ...
+//   int cc;
+//   while((cc = midiState.takeChangedCC(0)) >= 0) drawKnob(cc, midiState.cc(0, cc));
+class USBMIDIStateCache {
+public:
+    // takeChanges() flags
+    enum {
+        CHANGED_NOTES     = 0x01,
+        CHANGED_CC        = 0x02,
+        CHANGED_PITCHBEND = 0x04,
+        CHANGED_PRESSURE  = 0x08,
+        CHANGED_PROGRAM   = 0x10
+    };
+
+    USBMIDIStateCache() { reset(); }
+
+    // Feeds one USB-MIDI packet (see USB_MIDI_PACKET); cable is ignored
+    void update(uint32_t packet);
+    // Back to power-on state: notes off, controllers and programs 0, bend centered
+    void reset();
+
+    uint8_t cc(uint8_t channel, uint8_t control) const { return ccValue[channel & 0x0F][control & 0x7F]; }
+    int pitchBend(uint8_t channel) const { return bend[channel & 0x0F]; } // -8192 to 8191
+    uint8_t pressure(uint8_t channel) const { return chanPressure[channel & 0x0F]; }
+    uint8_t program(uint8_t channel) const { return programNumber[channel & 0x0F]; }
+    bool noteOn(uint8_t channel, uint8_t note) const {
+        return (notes[channel & 0x0F][(note >> 5) & 3] >> (note & 31)) & 1;
+    }
+    uint8_t activeNoteCount(uint8_t channel) const;
+
+    // Calls f(note) for every held note on channel, lowest first; visits
+    // only set bits, e.g. forEachActiveNote(ch, [&](uint8_t n) { USBMIDI.sendNoteOff(ch, n); })
+    template<class F>
+    void forEachActiveNote(uint8_t channel, F f) const {
+        const uint32_t* words = notes[channel & 0x0F];
+        for(uint8_t w = 0; w < 4; w++) {
+            for(uint32_t bits = words[w]; bits; bits &= bits - 1) {
+                f((uint8_t)(w * 32 + __builtin_ctz(bits)));
+            }
+        }
+    }
+
+    // Channels with pending changes (bit n = channel n)
+    uint16_t changedChannels() const { return dirtyChannels; }
+    // CHANGED_* flags of a channel since the last call, then cleared.
+    // CHANGED_CC stays set until every changed controller has been taken.
+    uint8_t takeChanges(uint8_t channel);
+    // Lowest controller changed since it was last taken, or -1
+    int takeChangedCC(uint8_t channel);
+
+private:
+    void setCC(uint8_t channel, uint8_t control, uint8_t value);
+    void resetControllers(uint8_t channel);
+    void markDirty(uint8_t channel, uint8_t flags) {
+        dirtyFlags[channel] |= flags;
+        dirtyChannels |= (uint16_t)(1u << channel);
+    }
+
+    uint8_t  ccValue[16][128];
+    uint32_t notes[16][4];      // Note bitmap, bit n of word w = note 32w + n
+    uint32_t ccDirty[16][4];    // Same layout, per controller
+    int16_t  bend[16];
+    uint8_t  chanPressure[16];
+    uint8_t  programNumber[16];
+    uint8_t  dirtyFlags[16];
+    uint16_t dirtyChannels;
+};
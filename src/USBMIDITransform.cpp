@@ -0,0 +1,71 @@
+#include "USBMIDITransform.h"
+#include <math.h>
+
+void USBMIDITransform::reset() {
+    for(uint8_t i = 0; i < 8; i++) pass[i] = 0xFFFF;
+    keyChannels = velocityChannels = controlChannels = 0;
+    for(uint8_t ch = 0; ch < 16; ch++) channelMap[ch] = ch;
+    for(uint8_t n = 0; n < 128; n++) {
+        noteMap[n] = n;
+        keyChannel[n] = KEEP;
+        velocityMap[n] = n;
+        controlMap[n] = n;
+    }
+}
+
+void USBMIDITransform::filter(uint16_t channels, uint8_t types) {
+    // Status nibbles 8-E, in the order of kind in apply()
+    static const uint8_t kindTypes[7] = { NOTES, NOTES, NOTES, CC, PROGRAM, PRESSURE, PITCHBEND };
+    for(uint8_t kind = 0; kind < 7; kind++) {
+        if(types & kindTypes[kind]) pass[kind] = channels;
+    }
+}
+
+void USBMIDITransform::remapChannel(uint8_t from, uint8_t to) {
+    channelMap[from & 0x0F] = to & 0x0F;
+}
+
+void USBMIDITransform::transpose(int8_t semitones, uint16_t channels, uint8_t low, uint8_t high) {
+    for(int n = low; n <= high && n < 128; n++) {
+        int shifted = n + semitones;
+        noteMap[n] = (shifted < 0 || shifted > 127) ? DROP : (uint8_t)shifted;
+    }
+    keyChannels |= channels;
+}
+
+void USBMIDITransform::keyZone(uint8_t low, uint8_t high, uint8_t channel, uint16_t channels) {
+    for(int n = low; n <= high && n < 128; n++) {
+        keyChannel[n] = channel == KEEP ? KEEP : (channel & 0x0F);
+    }
+    keyChannels |= channels;
+}
+
+void USBMIDITransform::mapNote(uint8_t note, uint8_t to, uint16_t channels) {
+    noteMap[note & 0x7F] = to == DROP ? DROP : (to & 0x7F);
+    keyChannels |= channels;
+}
+
+void USBMIDITransform::velocityCurve(float exponent, uint8_t minimum, uint8_t maximum, uint16_t channels) {
+    if(minimum < 1) minimum = 1;
+    if(maximum > 127) maximum = 127;
+    if(maximum < minimum) maximum = minimum;
+    velocityMap[0] = 0;
+    for(uint8_t v = 1; v < 128; v++) {
+        float scaled = powf(v / 127.0f, exponent) * (maximum - minimum);
+        velocityMap[v] = minimum + (uint8_t)(scaled + 0.5f);
+    }
+    velocityChannels |= channels;
+}
+
+void USBMIDITransform::mapVelocity(uint8_t velocity, uint8_t to, uint16_t channels) {
+    velocity &= 0x7F;
+    if(velocity == 0) return; // A Note Off stays one
+    to &= 0x7F;
+    velocityMap[velocity] = to ? to : 1;
+    velocityChannels |= channels;
+}
+
+void USBMIDITransform::mapControl(uint8_t control, uint8_t to, uint16_t channels) {
+    controlMap[control & 0x7F] = to == DROP ? DROP : (to & 0x7F);
+    controlChannels |= channels;
+}
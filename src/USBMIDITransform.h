@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "internal/wch_usbmidi_internal.h"
+
+// Rewrites channel messages through precomputed tables: per-channel
+// filters, channel remap, key transpose/split, velocity curve and
+// controller remap. Attach it to a cable for received messages
+// (setInputTransform) or sent ones (setOutputTransform). Each message costs
+// the same few table loads however many rules are set; no allocation,
+// about 550 bytes of RAM.
+//
+// Each stage (keys, velocity, controllers) has one table, used on the
+// channels it is enabled on; the channels arguments add to that set, and
+// reset() clears everything. Change the tables between notes: a Note Off
+// is rewritten by the tables of the moment, not those of its Note On.
+//
+//   USBMIDITransform split;
+//   split.keyZone(0, 59, 1);              // Keys below middle C play channel 2
+//   split.transpose(12, 0xFFFF, 0, 59);   //   an octave up
+//   split.velocityCurve(0.6f);            // Lighter touch
+//   split.mapControl(1, 74);              // Mod wheel drives cutoff
+//   USBMIDI.setInputTransform(&split);
+class USBMIDITransform {
+public:
+    // filter() message types, same values as ROUTE_*
+    enum : uint8_t {
+        NOTES     = 0x01, // Note On/Off, poly pressure
+        CC        = 0x02,
+        PROGRAM   = 0x04,
+        PRESSURE  = 0x08, // Channel pressure
+        PITCHBEND = 0x10,
+        ALL       = 0x1F
+    };
+    static const uint8_t KEEP = 0xFF; // keyZone(): leave the channel alone
+    static const uint8_t DROP = 0xFF; // mapNote(), mapControl(): remove the message
+
+    USBMIDITransform() { reset(); }
+
+    // Everything passes unchanged
+    void reset();
+
+    // Messages of types pass only on channels (bit n = channel n); other
+    // types keep their filter
+    void filter(uint16_t channels, uint8_t types = ALL);
+    // Channel messages on from go out on to (0-15)
+    void remapChannel(uint8_t from, uint8_t to);
+
+    // Keys (Note On/Off, poly pressure). transpose() shifts notes low-high
+    // by semitones, dropping those pushed out of 0-127; keyZone() moves
+    // notes low-high to channel (ahead of remapChannel); mapNote() sets one
+    // entry of the note table.
+    void transpose(int8_t semitones, uint16_t channels = 0xFFFF, uint8_t low = 0, uint8_t high = 127);
+    void keyZone(uint8_t low, uint8_t high, uint8_t channel, uint16_t channels = 0xFFFF);
+    void mapNote(uint8_t note, uint8_t to, uint16_t channels = 0xFFFF);
+
+    // Note On velocity: out = minimum + (maximum - minimum) * (v / 127)^exponent.
+    // Exponent below 1 makes soft playing louder, above 1 quieter. A Note On
+    // never becomes velocity 0 (a Note Off); Note Off velocity is untouched.
+    void velocityCurve(float exponent, uint8_t minimum = 1, uint8_t maximum = 127, uint16_t channels = 0xFFFF);
+    void mapVelocity(uint8_t velocity, uint8_t to, uint16_t channels = 0xFFFF);
+
+    // Control Change number remap, DROP to remove a controller
+    void mapControl(uint8_t control, uint8_t to, uint16_t channels = 0xFFFF);
+
+    // Rewrites a USB-MIDI packet (see USB_MIDI_PACKET) in place; false if
+    // it is filtered out. SysEx, System Common and realtime pass unchanged.
+    bool apply(uint32_t& packet) const {
+        uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+        if(cin < 0x08 || cin > 0x0E) return true;
+        uint8_t status = USB_MIDI_BYTE(packet, 1);
+        uint8_t channel = status & 0x0F;
+        uint8_t kind = (status >> 4) & 7; // 0 Note Off ... 6 pitch bend
+        uint16_t bit = 1u << channel;
+        if(!(pass[kind] & bit)) return false;
+
+        uint8_t d1 = USB_MIDI_BYTE(packet, 2) & 0x7F;
+        uint8_t d2 = USB_MIDI_BYTE(packet, 3);
+        uint8_t out = channelMap[channel];
+        if(kind <= 2) {
+            if(keyChannels & bit) {
+                if(keyChannel[d1] != KEEP) out = keyChannel[d1];
+                d1 = noteMap[d1];
+                if(d1 == DROP) return false;
+            }
+            if(kind == 1 && d2 && (velocityChannels & bit)) d2 = velocityMap[d2 & 0x7F];
+        } else if(kind == 3 && (controlChannels & bit)) {
+            d1 = controlMap[d1];
+            if(d1 == DROP) return false;
+        }
+        packet = USB_MIDI_PACKET(USB_MIDI_BYTE(packet, 0), (status & 0xF0) | out, d1, d2);
+        return true;
+    }
+
+private:
+    uint16_t pass[8];          // Channels passed, per status nibble 8-F
+    uint16_t keyChannels;
+    uint16_t velocityChannels;
+    uint16_t controlChannels;
+    uint8_t  channelMap[16];
+    uint8_t  noteMap[128];
+    uint8_t  keyChannel[128];
+    uint8_t  velocityMap[128];
+    uint8_t  controlMap[128];
+};
@@ -0,0 +1,179 @@
+#include "USBMIDIUMP.h"
+#include "internal/wch_usbmidi_internal.h"
+
+uint32_t usbmidiScaleUp(uint32_t value, uint8_t srcBits, uint8_t dstBits) {
+    uint8_t scaleBits = dstBits - srcBits;
+    uint32_t shifted = value << scaleBits;
+    if(value <= (1ul << (srcBits - 1))) return shifted; // Up to center: plain shift
+
+    // Above center the lower source bits are repeated to fill the new ones
+    uint8_t repeatBits = srcBits - 1;
+    uint32_t repeat = value & ((1ul << repeatBits) - 1);
+    if(scaleBits > repeatBits) repeat <<= scaleBits - repeatBits;
+    else repeat >>= repeatBits - scaleBits;
+    while(repeat) {
+        shifted |= repeat;
+        repeat >>= repeatBits;
+    }
+    return shifted;
+}
+
+uint8_t usbmidiPacketToUMP(uint32_t packet, uint32_t* ump, bool midi2) {
+    uint32_t group = (uint32_t)(USB_MIDI_BYTE(packet, 0) >> 4) << 24;
+    uint8_t cin = USB_MIDI_BYTE(packet, 0) & 0x0F;
+    uint8_t b1 = USB_MIDI_BYTE(packet, 1);
+    uint8_t b2 = USB_MIDI_BYTE(packet, 2) & 0x7F;
+    uint8_t b3 = USB_MIDI_BYTE(packet, 3) & 0x7F;
+
+    switch(cin) {
+        case 0x08: case 0x09: case 0x0A: case 0x0B:
+        case 0x0C: case 0x0D: case 0x0E:
+            if(!midi2) {
+                ump[0] = ((uint32_t)UMP_MT_MIDI1 << 28) | group | ((uint32_t)b1 << 16) | (b2 << 8) | b3;
+                return 1;
+            }
+            if(cin == 0x09 && b3 == 0) b1 &= 0x8F; // Note On velocity 0 is a Note Off
+            ump[0] = ((uint32_t)UMP_MT_MIDI2 << 28) | group | ((uint32_t)b1 << 16);
+            switch(b1 >> 4) {
+                case 0x8: case 0x9: // Velocity in the upper half, no attribute
+                    ump[0] |= b2 << 8;
+                    ump[1] = usbmidiScaleUp(b3, 7, 16) << 16;
+                    break;
+                case 0xA: case 0xB: // Per note / per controller 32-bit value
+                    ump[0] |= b2 << 8;
+                    ump[1] = usbmidiScaleUp(b3, 7, 32);
+                    break;
+                case 0xC: // No bank
+                    ump[1] = (uint32_t)b2 << 24;
+                    break;
+                case 0xD:
+                    ump[1] = usbmidiScaleUp(b2, 7, 32);
+                    break;
+                default: // 0xE Pitch Bend
+                    ump[1] = usbmidiScaleUp(b2 | (b3 << 7), 14, 32);
+                    break;
+            }
+            return 2;
+
+        case 0x02: // Two byte system common (MTC quarter frame, song select)
+        case 0x03: // Song position pointer
+        case 0x05: // Single byte (tune request) or realtime
+        case 0x0F:
+            if(cin == 0x05 && b1 < 0xF6) return 0; // SysEx end
+            ump[0] = ((uint32_t)UMP_MT_SYSTEM << 28) | group | ((uint32_t)b1 << 16);
+            if(cin == 0x02 || cin == 0x03) ump[0] |= b2 << 8;
+            if(cin == 0x03) ump[0] |= b3;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// CC packet helper for the (N)RPN and bank expansions below
+static uint32_t ccPacket(uint8_t hdr, uint8_t channel, uint8_t control, uint8_t value) {
+    return USB_MIDI_PACKET(hdr, 0xB0 | channel, control, value & 0x7F);
+}
+
+uint8_t usbmidiUMPToPackets(const uint32_t* ump, uint32_t* packets) {
+    uint32_t w0 = ump[0];
+    uint8_t cable = (w0 >> 24) & 0x0F;
+    uint8_t status = (w0 >> 16) & 0xFF;
+    uint8_t d1 = (w0 >> 8) & 0x7F;
+    uint8_t d2 = w0 & 0x7F;
+
+    switch(w0 >> 28) {
+        case UMP_MT_SYSTEM: {
+            uint8_t cin;
+            if(status >= 0xF8) cin = 0x0F;
+            else if(status == 0xF6) cin = 0x05;
+            else if(status == 0xF1 || status == 0xF3) cin = 0x02;
+            else if(status == 0xF2) cin = 0x03;
+            else return 0;
+            packets[0] = USB_MIDI_PACKET((cable << 4) | cin, status, cin == 0x0F || cin == 0x05 ? 0 : d1,
+                                         cin == 0x03 ? d2 : 0);
+            return 1;
+        }
+
+        case UMP_MT_MIDI1:
+            if(status < 0x80 || status >= 0xF0) return 0;
+            packets[0] = USB_MIDI_PACKET((cable << 4) | (status >> 4), status, d1, d2);
+            return 1;
+
+        case UMP_MT_MIDI2: {
+            uint32_t w1 = ump[1];
+            uint8_t hdr = (cable << 4) | 0x0B;
+            uint8_t channel = status & 0x0F;
+            switch(status >> 4) {
+                case 0x8: // Note Off
+                    packets[0] = USB_MIDI_PACKET((cable << 4) | 0x08, status, d1, w1 >> 25);
+                    return 1;
+                case 0x9: { // Note On; a tiny velocity must not turn it into a Note Off
+                    uint8_t velocity = w1 >> 25;
+                    packets[0] = USB_MIDI_PACKET((cable << 4) | 0x09, status, d1, velocity ? velocity : 1);
+                    return 1;
+                }
+                case 0xA: case 0xB: // Poly Pressure, Control Change
+                    packets[0] = USB_MIDI_PACKET((cable << 4) | (status >> 4), status, d1, w1 >> 25);
+                    return 1;
+                case 0xC: { // Program Change, optionally with bank
+                    uint8_t n = 0;
+                    if(w0 & 0x01) {
+                        packets[n++] = ccPacket(hdr, channel, 0, w1 >> 8);
+                        packets[n++] = ccPacket(hdr, channel, 32, w1);
+                    }
+                    packets[n++] = USB_MIDI_PACKET((cable << 4) | 0x0C, status, (w1 >> 24) & 0x7F, 0);
+                    return n;
+                }
+                case 0xD: // Channel Pressure
+                    packets[0] = USB_MIDI_PACKET((cable << 4) | 0x0D, status, w1 >> 25, 0);
+                    return 1;
+                case 0xE: { // Pitch Bend
+                    uint16_t value = w1 >> 18;
+                    packets[0] = USB_MIDI_PACKET((cable << 4) | 0x0E, status, value & 0x7F, value >> 7);
+                    return 1;
+                }
+                case 0x2: case 0x3: { // RPN, NRPN: bank/index in d1/d2, 32-bit data
+                    bool nrpn = (status >> 4) == 0x3;
+                    uint16_t value = w1 >> 18;
+                    packets[0] = ccPacket(hdr, channel, nrpn ? 99 : 101, d1);
+                    packets[1] = ccPacket(hdr, channel, nrpn ? 98 : 100, d2);
+                    packets[2] = ccPacket(hdr, channel, 6, value >> 7);
+                    packets[3] = ccPacket(hdr, channel, 38, value);
+                    return 4;
+                }
+                default: // Per-note and relative controllers have no MIDI 1.0 form
+                    return 0;
+            }
+        }
+
+        default:
+            return 0;
+    }
+}
+
+uint8_t usbmidiUMPSysEx(const uint32_t* ump, uint8_t* data, bool* last) {
+    uint8_t status = (ump[0] >> 20) & 0x0F;
+    uint8_t count = (ump[0] >> 16) & 0x0F;
+    uint8_t n = 0;
+    if(count > 6) count = 6;
+    if(status == 0 || status == 1) data[n++] = 0xF0;
+    for(uint8_t i = 0; i < count; i++) {
+        // Payload: bytes 2-3 of word 0, then word 1 from the top
+        uint8_t byte = i < 2 ? (ump[0] >> (8 - 8 * i)) : (ump[1] >> (24 - 8 * (i - 2)));
+        data[n++] = byte & 0x7F;
+    }
+    *last = status == 0 || status == 3;
+    if(*last) data[n++] = 0xF7;
+    return n;
+}
+
+void usbmidiSysExToUMP(uint8_t group, uint8_t status, const uint8_t* payload, uint8_t length,
+                       uint32_t* ump) {
+    uint8_t bytes[6] = { 0 };
+    if(length > 6) length = 6;
+    for(uint8_t i = 0; i < length; i++) bytes[i] = payload[i] & 0x7F;
+    ump[0] = ((uint32_t)UMP_MT_SYSEX7 << 28) | ((uint32_t)(group & 0x0F) << 24)
+           | ((uint32_t)(status & 0x0F) << 20) | ((uint32_t)length << 16) | (bytes[0] << 8) | bytes[1];
+    ump[1] = ((uint32_t)bytes[2] << 24) | ((uint32_t)bytes[3] << 16) | (bytes[4] << 8) | bytes[5];
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Translation between USB-MIDI 1.0 event packets (see USB_MIDI_PACKET) and
+// Universal MIDI Packets, used on the USB MIDI 2.0 setting. Cable n maps to
+// UMP group n. Plain functions without hardware access.
+
+// UMP message types (top nibble of the first word)
+#define UMP_MT_UTILITY      0x0
+#define UMP_MT_SYSTEM       0x1
+#define UMP_MT_MIDI1        0x2 // MIDI 1.0 channel voice, 32 bits
+#define UMP_MT_SYSEX7       0x3
+#define UMP_MT_MIDI2        0x4 // MIDI 2.0 channel voice, 64 bits
+#define UMP_MT_STREAM       0xF // UMP Stream: endpoint and function block discovery
+
+// Widens a value by bit repetition so minimum, center and maximum map
+// exactly (the MIDI 2.0 translation rule), e.g. 7-bit velocity to 16 bits
+uint32_t usbmidiScaleUp(uint32_t value, uint8_t srcBits, uint8_t dstBits);
+
+// One USB-MIDI packet to a UMP message: channel voice becomes a MIDI 2.0
+// message (2 words) when midi2 is set, a MIDI 1.0 one (1 word) otherwise;
+// system common and realtime become system messages. Returns the words
+// written to ump (up to 2), or 0 for SysEx and reserved CINs.
+uint8_t usbmidiPacketToUMP(uint32_t packet, uint32_t* ump, bool midi2);
+
+// One complete UMP message (system, MIDI 1.0 or MIDI 2.0 channel voice) to
+// USB-MIDI packets. MIDI 2.0 values are narrowed; a program change with a
+// bank becomes Bank Select MSB/LSB + Program Change and an (N)RPN message
+// becomes its four-CC sequence. Returns the packets written (up to 4), or 0
+// for message types with no MIDI 1.0 equivalent (SysEx: see below).
+uint8_t usbmidiUMPToPackets(const uint32_t* ump, uint32_t* packets);
+
+// The bytes of a 7-bit SysEx UMP (2 words) as a USB-MIDI style chunk, with
+// F0/F7 added on the first/last piece. Returns the length (up to 8) and
+// sets last on the piece that ends the message.
+uint8_t usbmidiUMPSysEx(const uint32_t* ump, uint8_t* data, bool* last);
+
+// Builds a 7-bit SysEx UMP from up to 6 payload bytes (no F0/F7); status is
+// 0 complete, 1 start, 2 continue, 3 end
+void usbmidiSysExToUMP(uint8_t group, uint8_t status, const uint8_t* payload, uint8_t length,
+                       uint32_t* ump);
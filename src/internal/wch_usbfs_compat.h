@@ -39,6 +39,17 @@
 #define USBFS_UIS_TOG_OK                        USBFS_U_TOG_OK
 #endif
 
+#ifndef USBFS_UMS_SUSPEND
+#define USBFS_UMS_DEV_ATTACH                    ((uint8_t)0x01)
+#define USBFS_UMS_DM_LEVEL                      ((uint8_t)0x02)
+#define USBFS_UMS_SUSPEND                       ((uint8_t)0x04)
+#define USBFS_UMS_BUS_RESET                     ((uint8_t)0x08)
+#define USBFS_UMS_R_FIFO_RDY                    ((uint8_t)0x10)
+#define USBFS_UMS_SIE_FREE                      ((uint8_t)0x20)
+#define USBFS_UMS_SOF_ACT                       ((uint8_t)0x40)
+#define USBFS_UMS_SOF_PRES                      ((uint8_t)0x80)
+#endif
+
 #ifndef USBFS_UIS_TOKEN_SETUP
 #define USBFS_UIS_H_RES_MASK                    ((uint8_t)0x0f)
 #define USBFS_UIS_ENDP_MASK                     ((uint8_t)0x0f)
@@ -81,6 +92,11 @@
 #define USBFS_UEP2_RX_EN                        ((uint8_t)0x08)
 #endif
 
+#ifndef USBFS_UEP2_BUF_MOD
+#define USBFS_UEP2_BUF_MOD                      ((uint8_t)0x01)
+#define USBFS_UEP3_BUF_MOD                      ((uint8_t)0x10)
+#endif
+
 // AFIO compatibility for USB pull-up config
 #ifndef AFIO_CTLR_UDM_PUE
 #define AFIO_CTLR_UDM_PUE                        ((uint32_t)0x00000003)
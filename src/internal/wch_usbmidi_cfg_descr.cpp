@@ -0,0 +1,80 @@
+#include "wch_usbmidi_internal.h"
+#include "wch_usbmidi_descr_builder.h"
+
+// Configuration Descriptor (Pure MIDI)
+// Built at compile time from typed pieces so all lengths follow the cable
+// count and packet size; the bytes are a constant in flash.
+
+using namespace wch_usbmidi_descr;
+
+static_assert(WCH_USBMIDI_NUM_CABLES >= 1 && WCH_USBMIDI_NUM_CABLES <= 16,
+              "WCH_USBMIDI_NUM_CABLES must be between 1 and 16");
+
+static constexpr size_t kCables = WCH_USBMIDI_NUM_CABLES;
+
+// Interface 0: Audio Control, no endpoints, points at interface 1
+static constexpr auto kAudioControl =
+      interface(0, 0, 0, USB_DEV_CLASS_AUDIO, USB_SUBCLASS_AUDIOCONTROL)
+    + acHeader(1);
+
+// Interface 1: MIDI Streaming, EP2 OUT (host -> device) and EP2 IN (device -> host)
+static constexpr auto kMidiStreaming =
+      interface(1, 0, 2, USB_DEV_CLASS_AUDIO, USB_SUBCLASS_MIDISTREAMING)
+    + msHeader(midiCables<kCables>())
+    + endpoint(USB_ENDP_ADDR_EP2_OUT, USB_ENDP_TYPE_BULK, EP2_SIZE)
+    + msEndpoint<kCables>(1)   // Emb MIDI IN jacks
+    + endpoint(USB_ENDP_ADDR_EP2_IN, USB_ENDP_TYPE_BULK, EP2_SIZE)
+    + msEndpoint<kCables>(3);  // Emb MIDI OUT jacks
+
+#if WCH_USBMIDI_MIDI2
+// Interface 1, alternate setting 1: USB MIDI 2.0 on the same endpoints
+static constexpr auto kMidiStreaming2 =
+      interface(1, 1, 2, USB_DEV_CLASS_AUDIO, USB_SUBCLASS_MIDISTREAMING)
+    + msHeader2()
+    + endpoint(USB_ENDP_ADDR_EP2_OUT, USB_ENDP_TYPE_BULK, EP2_SIZE)
+    + msEndpoint2<kCables>()
+    + endpoint(USB_ENDP_ADDR_EP2_IN, USB_ENDP_TYPE_BULK, EP2_SIZE)
+    + msEndpoint2<kCables>();
+
+alignas(4) static constexpr auto kCfgDescr =
+    configuration(2, 1, 0x80 /* Bus Powered */, WCH_USBMIDI_MAX_POWER_mA,
+                  kAudioControl + kMidiStreaming + kMidiStreaming2);
+
+// Returned for GET_DESCRIPTOR(CS_GR_TRM_BLOCK) on the MIDI 2.0 setting
+alignas(4) static constexpr auto kGtbDescr =
+    groupTerminalBlockHeader(groupTerminalBlocks<kCables>(WCH_USBMIDI_MIDI2_PROTOCOL));
+
+static_assert(kCfgDescr.size() == 65 + 32 * kCables + 9 + 7 + 2 * (7 + 4 + kCables),
+              "unexpected configuration size");
+static_assert(word(kGtbDescr.data + 3) == kGtbDescr.size(), "block header length mismatch");
+#else
+alignas(4) static constexpr auto kCfgDescr =
+    configuration(2, 1, 0x80 /* Bus Powered */, WCH_USBMIDI_MAX_POWER_mA,
+                  kAudioControl + kMidiStreaming);
+
+static_assert(kCfgDescr.size() == 65 + 32 * kCables, "unexpected configuration size");
+#endif
+
+// Layout checks: wTotalLength, MS header length and the offsets of the
+// class-specific endpoint descriptors must agree with the assembled bytes.
+static constexpr size_t kMsHeaderAt = 9 + kAudioControl.size() + 9;
+static constexpr size_t kOutCsAt = kMsHeaderAt + 7 + 30 * kCables + 7;
+static constexpr size_t kInCsAt  = kOutCsAt + 4 + kCables + 7;
+static_assert(word(kCfgDescr.data + 2) == kCfgDescr.size(), "wTotalLength mismatch");
+static_assert(kCfgDescr[kMsHeaderAt + 2] == 0x01 &&
+              word(kCfgDescr.data + kMsHeaderAt + 5) == 7 + 30 * kCables, "MS header mismatch");
+static_assert(kCfgDescr[kOutCsAt + 1] == USB_DESCR_TYP_CS_ENDP &&
+              kCfgDescr[kOutCsAt + 3] == kCables, "EP2 OUT jack list mismatch");
+static_assert(kCfgDescr[kInCsAt + 1] == USB_DESCR_TYP_CS_ENDP &&
+              kCfgDescr[kInCsAt + 4] == 3, "EP2 IN jack list mismatch");
+static_assert(kInCsAt + 4 + kCables == 9 + kAudioControl.size() + kMidiStreaming.size(),
+              "unexpected bytes after the MIDI 1.0 setting");
+
+extern "C" {
+const uint8_t* const wch_usbmidi_CfgDescr = kCfgDescr.data;
+const uint16_t wch_usbmidi_CfgDescrLen = sizeof(kCfgDescr.data);
+#if WCH_USBMIDI_MIDI2
+const uint8_t* const wch_usbmidi_GtbDescr = kGtbDescr.data;
+const uint16_t wch_usbmidi_GtbDescrLen = sizeof(kGtbDescr.data);
+#endif
+}
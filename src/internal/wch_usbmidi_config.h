@@ -1,8 +1,11 @@
 #pragma once
 
+// Unique ID words the serial number string is made from
+#ifndef CH32X035_ESIG_UNIID1
 #define CH32X035_ESIG_UNIID1    0x1FFFF7E8
 #define CH32X035_ESIG_UNIID2    0x1FFFF7EC
 #define CH32X035_ESIG_UNIID3    0x1FFFF7F0
+#endif
 
 #define WCH_USBMIDI_MANUF_STR            "WCH"
 #define WCH_USBMIDI_PROD_STR             "CH32X035-MIDI"
@@ -22,4 +25,77 @@
 #define WCH_USBMIDI_PRODUCT_ID       0x27DD
 #define WCH_USBMIDI_DEVICE_VERSION   0x0100
 #define WCH_USBMIDI_LANGUAGE         0x0409
-#define WCH_USBMIDI_MAX_POWER_mA     100
\ No newline at end of file
+#define WCH_USBMIDI_MAX_POWER_mA     100
+
+// Number of virtual cables (embedded jack pairs) exposed on the MIDI
+// streaming interface, 1..16. Each shows up as a separate port on the host.
+#ifndef WCH_USBMIDI_NUM_CABLES
+#define WCH_USBMIDI_NUM_CABLES       1
+#endif
+
+// USB MIDI 2.0: adds alternate setting 1 to the MIDI Streaming interface,
+// carrying Universal MIDI Packets, with one Group Terminal Block per cable
+// (cable n = group n). Hosts without MIDI 2.0 support keep using the MIDI
+// 1.0 setting. WCH_USBMIDI_MIDI2_PROTOCOL is the protocol the blocks
+// announce: 0x11 MIDI 2.0 (sends are translated to MIDI 2.0 messages) or
+// 0x01 MIDI 1.0 in UMP.
+#ifndef WCH_USBMIDI_MIDI2
+#define WCH_USBMIDI_MIDI2            0
+#endif
+#ifndef WCH_USBMIDI_MIDI2_PROTOCOL
+#define WCH_USBMIDI_MIDI2_PROTOCOL   0x11
+#endif
+
+// How long a blocking send (e.g. sendSysEx) waits for TX FIFO space before
+// giving up, in milliseconds
+#ifndef WCH_USBMIDI_TX_TIMEOUT_MS
+#define WCH_USBMIDI_TX_TIMEOUT_MS    100
+#endif
+
+// Remember which notes each cable has sent On (256 bytes per cable) so they
+// can be released after a bus reset or suspend; 0 disables
+#ifndef WCH_USBMIDI_NOTE_TRACKING
+#define WCH_USBMIDI_NOTE_TRACKING    1
+#endif
+
+// Hardware timer for the sub-millisecond part of SOF timestamps (see
+// USBMIDI.enableTimestamps) and for stats.isrMaxTicks. It must count up; the
+// default reads the low word of SysTick, which runs from HCLK or HCLK/8
+// depending on CTLR.STCLK. WCH_USBMIDI_TIMER_PERIOD() is the number of counts
+// before it wraps to 0, or 0 for a free-running 32-bit count; the default
+// follows CTLR.STRE, which the Arduino core sets (reload at CMP, 1 ms).
+// Frames are counted one per SOF interrupt and the timer only gives the
+// offset within the frame, so a reloading timer works as long as its period
+// is at least 1 ms. Frames whose SOF interrupt was missed (a busy ISR) are
+// recovered only with a free-running timer.
+#ifndef WCH_USBMIDI_TIMER_READ
+#define WCH_USBMIDI_TIMER_READ()        ((uint32_t)SysTick->CNT)
+#endif
+#ifndef WCH_USBMIDI_TIMER_TICKS_PER_US
+#define WCH_USBMIDI_TIMER_TICKS_PER_US  \
+    (((SysTick->CTLR & 0x04) ? SystemCoreClock : SystemCoreClock / 8) / 1000000)
+#endif
+#ifndef WCH_USBMIDI_TIMER_PERIOD
+#define WCH_USBMIDI_TIMER_PERIOD()      \
+    ((SysTick->CTLR & 0x08) ? (uint32_t)SysTick->CMP + 1 : 0)
+#endif
+
+// Capacity of the scheduled-output queue (USBMIDI.sendAt), in packets.
+// Each pending packet takes 12 bytes of RAM; 0 removes the scheduler.
+#ifndef WCH_USBMIDI_SCHED_CAPACITY
+#define WCH_USBMIDI_SCHED_CAPACITY   128
+#endif
+
+// Interrupt dispatch (USBMIDI.setInterruptDispatch): 0 runs the callbacks
+// inside the USB interrupt as each transfer arrives; 1 defers them to the
+// software interrupt (SW_Handler, lowest priority), which keeps the USB
+// interrupt short at the cost of a few microseconds.
+#ifndef WCH_USBMIDI_RX_DEFERRED
+#define WCH_USBMIDI_RX_DEFERRED      0
+#endif
+
+// Attribute applied to USBFS_IRQHandler (and SW_Handler). Override (e.g. define it empty) to
+// compile the handler outside the CH32X035 RISC-V toolchain.
+#ifndef WCH_USBMIDI_IRQ_ATTR
+#define WCH_USBMIDI_IRQ_ATTR         __attribute__((interrupt))
+#endif
\ No newline at end of file
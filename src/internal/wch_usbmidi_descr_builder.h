@@ -0,0 +1,151 @@
+#pragma once
+
+// Compile-time USB descriptor builder (C++ only).
+// Descriptors are assembled from typed pieces joined with '+'; every length
+// field is derived from the pieces it covers, so the result is a constant
+// byte array that lives in flash and needs no hand counting.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wch_usbmidi_descr {
+
+template<size_t N>
+struct Bytes {
+    uint8_t data[N];
+    constexpr uint8_t operator[](size_t i) const { return data[i]; }
+    constexpr size_t size() const { return N; }
+};
+
+template<size_t A, size_t B>
+constexpr Bytes<A + B> operator+(const Bytes<A>& a, const Bytes<B>& b) {
+    Bytes<A + B> r{};
+    for(size_t i = 0; i < A; i++) r.data[i] = a.data[i];
+    for(size_t i = 0; i < B; i++) r.data[A + i] = b.data[i];
+    return r;
+}
+
+constexpr uint8_t lo(size_t v) { return (uint8_t)(v & 0xFF); }
+constexpr uint8_t hi(size_t v) { return (uint8_t)((v >> 8) & 0xFF); }
+constexpr uint16_t word(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+// --- Standard descriptors ---
+
+// Configuration header; wTotalLength covers the header and everything in body
+template<size_t N>
+constexpr Bytes<9 + N> configuration(uint8_t numInterfaces, uint8_t value, uint8_t attributes,
+                                     uint16_t maxPower_mA, const Bytes<N>& body) {
+    static_assert(9 + N <= 0xFFFF, "configuration descriptor too long");
+    return Bytes<9>{{ 9, USB_DESCR_TYP_CONFIG, lo(9 + N), hi(9 + N), numInterfaces, value,
+                      0x00, attributes, (uint8_t)(maxPower_mA / 2) }} + body;
+}
+
+constexpr Bytes<9> interface(uint8_t number, uint8_t alternate, uint8_t numEndpoints,
+                             uint8_t cls, uint8_t subClass, uint8_t protocol = 0) {
+    return Bytes<9>{{ 9, USB_DESCR_TYP_INTERF, number, alternate, numEndpoints,
+                      cls, subClass, protocol, 0x00 }};
+}
+
+constexpr Bytes<7> endpoint(uint8_t address, uint8_t attributes, uint16_t maxPacket,
+                            uint8_t interval = 0) {
+    return Bytes<7>{{ 7, USB_DESCR_TYP_ENDP, address, attributes, lo(maxPacket), hi(maxPacket),
+                      interval }};
+}
+
+// --- Audio / MIDI 1.0 class-specific descriptors ---
+
+#define MIDI_JACK_EMBEDDED 0x01
+#define MIDI_JACK_EXTERNAL 0x02
+
+// Audio Control header pointing at a single MIDI Streaming interface
+constexpr Bytes<9> acHeader(uint8_t streamingInterface) {
+    return Bytes<9>{{ 9, USB_DESCR_TYP_CS_INTF, 0x01, 0x00, 0x01, 9, 0x00, 0x01,
+                      streamingInterface }};
+}
+
+// MS header; wTotalLength covers the header and the jack descriptors after it
+template<size_t N>
+constexpr Bytes<7 + N> msHeader(const Bytes<N>& jacks) {
+    return Bytes<7>{{ 7, USB_DESCR_TYP_CS_INTF, 0x01, 0x00, 0x01, lo(7 + N), hi(7 + N) }} + jacks;
+}
+
+constexpr Bytes<6> midiInJack(uint8_t jackType, uint8_t id) {
+    return Bytes<6>{{ 6, USB_DESCR_TYP_CS_INTF, 0x02, jackType, id, 0x00 }};
+}
+
+constexpr Bytes<9> midiOutJack(uint8_t jackType, uint8_t id, uint8_t sourceId) {
+    return Bytes<9>{{ 9, USB_DESCR_TYP_CS_INTF, 0x03, jackType, id, 0x01, sourceId, 0x01, 0x00 }};
+}
+
+// Cable c is an embedded/external jack pair in both directions:
+// Emb IN = 4c+1, Ext IN = 4c+2, Emb OUT = 4c+3, Ext OUT = 4c+4
+constexpr uint8_t midiJackId(size_t cable, uint8_t n) { return (uint8_t)(4 * cable + n); }
+
+constexpr Bytes<30> midiCableJacks(size_t c) {
+    return midiInJack(MIDI_JACK_EMBEDDED, midiJackId(c, 1))
+         + midiInJack(MIDI_JACK_EXTERNAL, midiJackId(c, 2))
+         + midiOutJack(MIDI_JACK_EMBEDDED, midiJackId(c, 3), midiJackId(c, 2))
+         + midiOutJack(MIDI_JACK_EXTERNAL, midiJackId(c, 4), midiJackId(c, 1));
+}
+
+template<size_t Cables>
+constexpr Bytes<30 * Cables> midiCables() {
+    Bytes<30 * Cables> r{};
+    for(size_t c = 0; c < Cables; c++) {
+        Bytes<30> jacks = midiCableJacks(c);
+        for(size_t i = 0; i < 30; i++) r.data[30 * c + i] = jacks.data[i];
+    }
+    return r;
+}
+
+// MS bulk endpoint; associates embedded jack n (1 = Emb IN, 3 = Emb OUT) of every cable
+template<size_t Cables>
+constexpr Bytes<4 + Cables> msEndpoint(uint8_t jack) {
+    Bytes<4 + Cables> r{{ 4 + Cables, USB_DESCR_TYP_CS_ENDP, 0x01, (uint8_t)Cables }};
+    for(size_t c = 0; c < Cables; c++) r.data[4 + c] = midiJackId(c, jack);
+    return r;
+}
+
+// --- USB MIDI 2.0 (alternate setting 1) ---
+
+// MS header of the UMP setting: bcdMSC 2.0, covers only itself
+constexpr Bytes<7> msHeader2() {
+    return Bytes<7>{{ 7, USB_DESCR_TYP_CS_INTF, 0x01, 0x00, 0x02, 7, 0x00 }};
+}
+
+// MS_GENERAL_2_0 endpoint; associates Group Terminal Blocks 1..Blocks
+template<size_t Blocks>
+constexpr Bytes<4 + Blocks> msEndpoint2() {
+    Bytes<4 + Blocks> r{{ 4 + Blocks, USB_DESCR_TYP_CS_ENDP, 0x02, (uint8_t)Blocks }};
+    for(size_t b = 0; b < Blocks; b++) r.data[4 + b] = (uint8_t)(b + 1);
+    return r;
+}
+
+#define MIDI_GTB_BIDIRECTIONAL 0x00
+
+// Group Terminal Block; groups are 0-based, bandwidths 0 = unknown
+constexpr Bytes<13> groupTerminalBlock(uint8_t id, uint8_t type, uint8_t firstGroup,
+                                       uint8_t numGroups, uint8_t protocol) {
+    return Bytes<13>{{ 13, USB_DESCR_TYP_CS_GR_TRM_BLOCK, 0x02, id, type, firstGroup, numGroups,
+                       0x00, protocol, 0x00, 0x00, 0x00, 0x00 }};
+}
+
+// One bidirectional single-group block per cable
+template<size_t Cables>
+constexpr Bytes<13 * Cables> groupTerminalBlocks(uint8_t protocol) {
+    Bytes<13 * Cables> r{};
+    for(size_t c = 0; c < Cables; c++) {
+        Bytes<13> block = groupTerminalBlock((uint8_t)(c + 1), MIDI_GTB_BIDIRECTIONAL,
+                                             (uint8_t)c, 1, protocol);
+        for(size_t i = 0; i < 13; i++) r.data[13 * c + i] = block.data[i];
+    }
+    return r;
+}
+
+// Block header; wTotalLength covers the header and the blocks after it
+template<size_t N>
+constexpr Bytes<5 + N> groupTerminalBlockHeader(const Bytes<N>& blocks) {
+    return Bytes<5>{{ 5, USB_DESCR_TYP_CS_GR_TRM_BLOCK, 0x01, lo(5 + N), hi(5 + N) }} + blocks;
+}
+
+} // namespace wch_usbmidi_descr
@@ -5,61 +5,380 @@ volatile uint8_t  USB_SetupReq, USB_SetupTyp, USB_Config, USB_Addr, USB_ENUM_OK;
 volatile uint16_t USB_SetupLen;
 const uint8_t*    USB_pDescr;
 
-// RX FIFO
-#define RX_FIFO_SIZE 256
-volatile uint8_t rx_fifo[RX_FIFO_SIZE];
-volatile uint16_t rx_head = 0;
-volatile uint16_t rx_tail = 0;
-
-void rx_fifo_push(uint8_t b) {
-    uint16_t next = (rx_head + 1) % RX_FIFO_SIZE;
-    if (next != rx_tail) {
-        rx_fifo[rx_head] = b;
-        rx_head = next;
-    }
-}
-
-// TX FIFO (Non-blocking output)
-#define TX_FIFO_SIZE 256
-volatile uint8_t tx_fifo[TX_FIFO_SIZE];
-volatile uint16_t tx_head = 0;
-volatile uint16_t tx_tail = 0;
-
-static int tx_fifo_push(const uint8_t* data, uint16_t len) {
-    uint16_t next;
-    for(uint16_t i=0; i<len; i++) {
-        next = (tx_head + 1) % TX_FIFO_SIZE;
-        if(next == tx_tail) return 0; // Buffer full
-        tx_fifo[tx_head] = data[i];
-        tx_head = next;
+// FIFOs are single-producer/single-consumer rings with free-running indices.
+// Each index is written by one side only (ISR or main loop), so neither side
+// ever masks the other; acquire/release ordering on the index publishes the
+// payload. Sizes must be powers of two. (The host simulator in extras/test
+// overrides both to let interrupts in at every index access.)
+#ifndef FIFO_LOAD
+#define FIFO_LOAD(idx)        __atomic_load_n(&(idx), __ATOMIC_ACQUIRE)
+#define FIFO_STORE(idx, val)  __atomic_store_n(&(idx), (val), __ATOMIC_RELEASE)
+#endif
+
+// The queues hold whole USB-MIDI event packets as 32-bit words (byte 0 of
+// the packet in bits 0-7), so a packet can never be torn and the endpoint
+// buffers are filled with word copies.
+typedef uint32_t __attribute__((may_alias)) usb_word_t;
+#define EP2_PACKETS   (EP2_SIZE / 4)
+
+// EP2 runs in double-buffer mode: the hardware picks the OUT half by R_TOG
+// and the IN half by T_TOG, so consecutive transfers alternate halves.
+// Layout: OUT0, OUT1, IN0, IN1 (EP2_SIZE bytes each).
+#define EP2_OUT_WORDS(half) ((usb_word_t*)(wch_usbmidi_EP2_buffer + (half) * EP2_SIZE))
+#define EP2_IN_WORDS(half)  ((usb_word_t*)(wch_usbmidi_EP2_buffer + (2 + (half)) * EP2_SIZE))
+
+// RX: OUT packets are consumed in place. Each completed transfer is queued as
+// (half, packet count) and the half stays owned by the main loop until it has
+// been read; meanwhile the host can fill the other half. When the half the
+// hardware will write next is still held, EP2 OUT answers NAK, so a slow main
+// loop throttles the host instead of losing data. USB_read re-arms it.
+static uint8_t ep2_rx_q_half[2];        // written by ISR at ep2_rx_wr
+static uint8_t ep2_rx_q_len[2];
+static uint32_t ep2_rx_q_time[2];
+static uint8_t ep2_rx_wr = 0;           // written by ISR only
+static uint8_t ep2_rx_rd = 0;           // written by main loop only
+static uint8_t ep2_rx_pos = 0;          // main loop: packets read from ep2_rx_rd
+static uint8_t ep2_rx_fill = 0;         // ISR: half the next OUT lands in (tracks R_TOG)
+static volatile uint8_t ep2_rx_nak = 0; // ISR: EP2 OUT currently NAKs
+
+// TX FIFO (producer: main loop, consumer: ISR). The ISR only sends up to
+// tx_commit; while a batch is open new packets accumulate past it and are
+// released together on flush. With a receive hook set the hook is a second
+// producer on this and the other TX queues; see USB_tx_lock.
+#define TX_FIFO_SIZE 64
+#define TX_FIFO_MASK (TX_FIFO_SIZE - 1)
+static uint32_t tx_fifo[TX_FIFO_SIZE];
+static uint16_t tx_head = 0;
+static uint16_t tx_commit = 0;
+static uint16_t tx_tail = 0;
+static uint8_t  tx_batch = 0;           // producers: open batch nesting depth
+static uint8_t  tx_coalesce = 0;        // main loop: coalescing mode (USB_set_coalescing)
+
+// Slots only Note Off may use in coalescing mode
+#define TX_NOTE_OFF_RESERVE 8
+
+// System Real-Time lanes. Clock and transport packets bypass the TX FIFO (and
+// any open batch) and are placed ahead of queued channel messages in the next
+// IN transfer; received ones are pulled out of each OUT half by the ISR so
+// poll() can deliver them before the packets queued in front of them.
+#define RT_FIFO_SIZE 16
+#define RT_FIFO_MASK (RT_FIFO_SIZE - 1)
+static uint32_t tx_rt_fifo[RT_FIFO_SIZE];
+static uint16_t tx_rt_head = 0;         // main loop
+static uint16_t tx_rt_tail = 0;         // ISR
+static uint32_t rx_rt_fifo[RT_FIFO_SIZE];
+static uint32_t rx_rt_time[RT_FIFO_SIZE];
+static uint16_t rx_rt_head = 0;         // ISR
+static uint16_t rx_rt_tail = 0;         // main loop
+
+// Slots left free when pre-staging the idle IN half, so realtime packets
+// queued meanwhile can still go in front of it
+#define TX_RT_RESERVE 4
+
+// CIN 0xF with a status byte of 0xF8 or above
+#define IS_REALTIME_PACKET(pkt) \
+    (((pkt) & 0x0F) == 0x0F && USB_MIDI_BYTE(pkt, 1) >= 0xF8)
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+// Scheduled output (USB_write_at). The main loop posts events through an SPSC
+// ring; the ISR moves them into a binary min-heap ordered by (time, seq) and,
+// on each SOF, releases the due ones into a small staging ring that
+// USB_stage_tx drains after the realtime lane. The heap is ISR-only.
+// Admission is checked on the main side against sched_posted - sched_retired,
+// so the heap can always take everything in the ring.
+typedef struct {
+    uint32_t time;
+    uint32_t packet;
+    uint16_t seq;       // posting order, keeps equal times FIFO
+} SchedEvent;
+
+#define SCHED_IN_SIZE  64
+#define SCHED_IN_MASK  (SCHED_IN_SIZE - 1)
+static SchedEvent sched_in[SCHED_IN_SIZE];
+static uint16_t sched_in_head = 0;      // main loop
+static uint16_t sched_in_tail = 0;      // ISR
+static uint32_t sched_posted = 0;       // main loop: events accepted
+static uint32_t sched_retired = 0;      // ISR: events released or cleared
+static uint16_t sched_seq = 0;          // main loop
+static volatile uint8_t sched_clear_req = 0;
+
+static SchedEvent sched_heap[WCH_USBMIDI_SCHED_CAPACITY];
+static uint16_t sched_count = 0;        // ISR
+
+#define SCHED_OUT_SIZE 16
+#define SCHED_OUT_MASK (SCHED_OUT_SIZE - 1)
+static uint32_t sched_out[SCHED_OUT_SIZE];
+static uint8_t  sched_out_head = 0;     // ISR only, like the tail
+static uint8_t  sched_out_tail = 0;
+#endif
+
+// SOF frame clock (ISR writes; main loop reads both until sof_frames is
+// stable). ts_enabled and ts_ticks_per_us are written by the main loop with
+// the SOF interrupt off, timer_period by begin, resetStats and enabling
+// timestamps.
+static volatile uint32_t sof_frames = 0;
+static volatile uint32_t sof_timer = 0;  // timer value at the last SOF
+static uint8_t sof_phase = 0;            // ISR: SOF_PHASE_*
+static uint32_t ts_ticks_per_us = 1;
+static uint32_t timer_period = 0;        // WCH_USBMIDI_TIMER_PERIOD(), 0 = free running
+static volatile uint8_t ts_enabled = 0;
+
+#define SOF_PHASE_NONE 0                 // No SOF seen since enabling
+#define SOF_PHASE_SET  1                 // sof_timer is when the last SOF was taken
+#define SOF_PHASE_KEPT 2                 // ... or the frame start it was taken late in
+
+// Timer counts from one reading to a later one, across at most one reload
+static inline uint32_t timer_elapsed(uint32_t from, uint32_t to) {
+    uint32_t d = to - from;
+    if(timer_period && to < from) d += timer_period;
+    return d;
+}
+
+// Link state, written by the ISR only
+static volatile uint8_t usb_alt = 0;     // MIDI Streaming alternate setting (1 = UMP)
+static volatile uint8_t usb_suspended = 0;
+static volatile uint8_t usb_link_events = 0;
+
+// Counters; each field has a single writer (ISR or main loop)
+static USBMIDIStats stats;
+static volatile USB_rx_hook_t rx_hook = 0;
+static volatile uint8_t rx_hook_running = 0; // ISR: inside the receive hook
+
+// The hook runs in this interrupt, so masking it keeps the hook's sends out
+// of a main-loop push
+#if WCH_USBMIDI_RX_DEFERRED
+#define RX_HOOK_IRQn Software_IRQn
+#else
+#define RX_HOOK_IRQn USBFS_IRQn
+#endif
+static uint8_t tx_lock_depth = 0;
+static uint8_t tx_lock_masked = 0;
+
+// Set while an EP2 IN transfer is armed. Written by the ISR only.
+static volatile uint8_t ep2_tx_busy = 0;
+// ISR only: half the next IN transfer uses (tracks T_TOG) and the number of
+// packets already staged in each half.
+static uint8_t ep2_tx_cur = 0;
+static uint8_t ep2_tx_staged[2];
+static uint8_t ep2_tx_rt_staged[2];     // leading realtime packets of each half
+
+static int tx_fifo_push(const uint32_t* packets, uint16_t count, uint16_t reserve) {
+    uint16_t head = tx_head;
+    uint16_t space = TX_FIFO_SIZE - (uint16_t)(head - FIFO_LOAD(tx_tail));
+    if(count + reserve > space) return 0; // Buffer full, never enqueue a partial write
+    for(uint16_t i=0; i<count; i++) {
+        tx_fifo[(uint16_t)(head + i) & TX_FIFO_MASK] = packets[i];
     }
+    FIFO_STORE(tx_head, (uint16_t)(head + count));
+    if(TX_FIFO_SIZE - space + count > stats.txHighWater) stats.txHighWater = TX_FIFO_SIZE - space + count;
     return 1;
 }
 
-// Helper: Attempt to send pending data from FIFO to USB hardware
-static void USB_send_from_fifo(void) {
-    // CRITICAL SECTION START: Prevent ISR from interrupting FIFO/Register access
-    NVIC_DisableIRQ(USBFS_IRQn);
-
-    // Only send if endpoint is ready (NAK indicates idle/ready for new TX)
-    if((USBFSD->UEP2_CTRL_H & USBFS_UEP_T_RES_MASK) == USBFS_UEP_T_RES_NAK) {
-        uint16_t count = 0;
-        // Fill USB packet buffer (up to 64 bytes) from FIFO
-        while(tx_head != tx_tail && count < 64) {
-            wch_usbmidi_EP2_buffer[64 + count] = tx_fifo[tx_tail];
-            tx_tail = (tx_tail + 1) % TX_FIFO_SIZE;
-            count++;
+// Top up an idle IN half, realtime packets first: they are inserted after the
+// realtime packets already staged but ahead of any channel messages. At most
+// limit packets are staged. ISR context only.
+//
+// Unlike OUT, IN is not zero-copy: senders write to tx_fifo, not to a DMA
+// half. The FIFO is where the TX policies act before a packet is committed
+// to the wire: realtime and due scheduled packets overtake it here,
+// coalescing rewrites queued slots, batches wait behind tx_commit, the Note
+// Off reserve counts free slots, and USB_tx_discard hands queued Note Offs
+// back to note tracking. Writing the halves directly would also let the
+// main loop touch a buffer whose ownership follows T_TOG, which only the ISR
+// tracks. The cost is one word copy per packet, at most EP2_PACKETS per
+// transfer.
+static uint8_t USB_stage_tx(uint8_t half, uint8_t limit) {
+    usb_word_t* buf = EP2_IN_WORDS(half);
+    uint8_t  staged = ep2_tx_staged[half];
+    uint16_t tail   = tx_rt_tail;
+    uint16_t count  = (uint16_t)(FIFO_LOAD(tx_rt_head) - tail);
+    if(staged >= limit) return staged;
+    if(count > (uint16_t)(limit - staged)) count = limit - staged;
+    if(count) {
+        uint8_t pos = ep2_tx_rt_staged[half];
+        for(uint8_t i = staged; i-- > pos;) buf[i + count] = buf[i];
+        for(uint16_t i=0; i<count; i++) {
+            buf[pos + i] = tx_rt_fifo[(uint16_t)(tail + i) & RT_FIFO_MASK];
         }
+        FIFO_STORE(tx_rt_tail, (uint16_t)(tail + count));
+        ep2_tx_rt_staged[half] = pos + count;
+        staged += count;
+    }
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    // Scheduled packets that are due go before the FIFO as well
+    while(staged < limit && sched_out_tail != sched_out_head) {
+        buf[staged++] = sched_out[sched_out_tail++ & SCHED_OUT_MASK];
+    }
+#endif
 
-        if(count > 0) {
-            USBFSD->UEP2_TX_LEN = count;
-            // Set to ACK to transmit
-            USBFSD->UEP2_CTRL_H = (USBFSD->UEP2_CTRL_H & ~USBFS_UEP_T_RES_MASK) | USBFS_UEP_T_RES_ACK;
+    tail  = tx_tail;
+    count = (uint16_t)(FIFO_LOAD(tx_commit) - tail);
+    if(count > (uint16_t)(limit - staged)) {
+        count = limit - staged;
+        // A Universal MIDI Packet never straddles two transfers
+        if(usb_alt) {
+            uint16_t whole = 0;
+            for(;;) {
+                uint8_t words = UMP_WORD_COUNT(tx_fifo[(uint16_t)(tail + whole) & TX_FIFO_MASK]);
+                if(whole + words > count) break;
+                whole += words;
+            }
+            count = whole;
         }
     }
-    
-    // CRITICAL SECTION END
-    NVIC_EnableIRQ(USBFS_IRQn);
+    if(count == 0) {
+        ep2_tx_staged[half] = staged;
+        return staged;
+    }
+
+    usb_word_t* dst = buf + staged;
+    for(uint16_t i=0; i<count; i++) {
+        dst[i] = tx_fifo[(uint16_t)(tail + i) & TX_FIFO_MASK];
+    }
+    FIFO_STORE(tx_tail, (uint16_t)(tail + count));
+    ep2_tx_staged[half] = staged + count;
+    return staged + count;
+}
+
+// Arm the current IN half and stage the other one while it is on the wire.
+// ISR context only: the ISR is the sole owner of the EP2 registers.
+static void USB_send_from_fifo(void) {
+    uint8_t half = ep2_tx_cur;
+    uint8_t count = USB_stage_tx(half, EP2_PACKETS);
+    if(count == 0) {
+        ep2_tx_busy = 0;
+        return;
+    }
+
+    USBFSD->UEP2_TX_LEN = count * 4;
+    // Set to ACK to transmit
+    USBFSD->UEP2_CTRL_H = (USBFSD->UEP2_CTRL_H & ~USBFS_UEP_T_RES_MASK) | USBFS_UEP_T_RES_ACK;
+    ep2_tx_busy = 1;
+    stats.txTransfers++;
+
+    USB_stage_tx(half ^ 1, EP2_PACKETS - TX_RT_RESERVE);
+}
+
+// Main loop side: ask the ISR to start a transfer if EP2 IN is idle. The
+// store publishing the packets must be visible before ep2_tx_busy is
+// sampled, otherwise an IN completion that just found the FIFOs empty could
+// be missed.
+static void USB_kick_tx_idle(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!ep2_tx_busy) NVIC_SetPendingIRQ(USBFS_IRQn);
+}
+
+// Main loop side: release everything queued so far and kick EP2 IN
+static void USB_kick_tx(void) {
+    FIFO_STORE(tx_commit, tx_head);
+    USB_kick_tx_idle();
+}
+
+#if WCH_USBMIDI_NOTE_TRACKING
+// Note Offs thrown away by USB_tx_discard, as USB-MIDI packets, for note
+// tracking to mark those notes held again (see USB_read_lost_note_offs)
+#define LOST_OFF_SIZE 32
+#define LOST_OFF_MASK (LOST_OFF_SIZE - 1)
+static uint32_t lost_off[LOST_OFF_SIZE];
+static uint8_t  lost_off_head = 0;      // ISR
+static uint8_t  lost_off_tail = 0;      // main loop
+static volatile uint8_t lost_off_overflows = 0; // ISR: discards that found more
+
+// Keep the Note Offs among count queued words (USB-MIDI packets, or UMPs on
+// the MIDI 2.0 setting). ISR context only.
+static void USB_keep_note_offs(const uint32_t* words, uint16_t first, uint16_t count, uint16_t mask) {
+    for(uint16_t i = 0; i < count;) {
+        uint32_t w = words[(uint16_t)(first + i) & mask], packet = 0;
+        if(!usb_alt) {
+            uint8_t cin = w & 0x0F;
+            if(cin == 0x08 || (cin == 0x09 && USB_MIDI_BYTE(w, 3) == 0)) packet = w;
+            i++;
+        } else {
+            // MIDI 1.0 (MT 2) or MIDI 2.0 (MT 4) channel voice Note Off
+            uint8_t mt = w >> 28, status = (w >> 16) & 0xF0, note = (w >> 8) & 0x7F;
+            if((mt == 0x2 && (status == 0x80 || (status == 0x90 && (w & 0x7F) == 0)))
+               || (mt == 0x4 && status == 0x80)) {
+                packet = USB_MIDI_PACKET(((w >> 20) & 0xF0) | 0x08, 0x80 | ((w >> 16) & 0x0F), note, 0);
+            }
+            i += UMP_WORD_COUNT(w);
+        }
+        if(!packet) continue;
+        if((uint8_t)(lost_off_head - FIFO_LOAD(lost_off_tail)) >= LOST_OFF_SIZE) {
+            lost_off_overflows++;
+            return;
+        }
+        lost_off[lost_off_head & LOST_OFF_MASK] = packet;
+        FIFO_STORE(lost_off_head, (uint8_t)(lost_off_head + 1));
+    }
+}
+#endif
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+// Drop every scheduled event posted so far, in the ring and in the heap.
+// Scheduled sends leave note tracking alone, so nothing is handed back.
+// ISR context only.
+static void USB_sched_drop(void) {
+    uint16_t head = FIFO_LOAD(sched_in_head);
+    uint32_t dropped = (uint32_t)(uint16_t)(head - sched_in_tail) + sched_count;
+    FIFO_STORE(sched_in_tail, head);
+    sched_count = 0;
+    FIFO_STORE(sched_retired, sched_retired + dropped);
+}
+#endif
+
+// Drop everything released for sending but not yet on the host, and
+// everything still scheduled: after a bus reset it belongs to a session the
+// host has forgotten. Packets of a batch that is still open stay queued.
+// Note Offs among the dropped packets are handed back to note tracking,
+// which cleared their notes when they were queued. Call before the staged
+// halves are reset. ISR context only.
+static void USB_tx_discard(void) {
+#if WCH_USBMIDI_NOTE_TRACKING
+    uint16_t tail = tx_tail;
+    for(uint8_t half = 0; half < 2; half++) {
+        USB_keep_note_offs(EP2_IN_WORDS(half), 0, ep2_tx_staged[half], 0xFFFF);
+    }
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    USB_keep_note_offs(sched_out, sched_out_tail, (uint8_t)(sched_out_head - sched_out_tail), SCHED_OUT_MASK);
+#endif
+    USB_keep_note_offs(tx_fifo, tail, (uint16_t)(FIFO_LOAD(tx_commit) - tail), TX_FIFO_MASK);
+#endif
+    FIFO_STORE(tx_tail, FIFO_LOAD(tx_commit));
+    FIFO_STORE(tx_rt_tail, FIFO_LOAD(tx_rt_head));
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    sched_out_tail = sched_out_head;
+    USB_sched_drop();
+#endif
+}
+
+// ACK the next OUT only if the half it would land in has been released.
+// ISR context only.
+static void USB_rx_update_response(void) {
+    uint8_t held = 0;
+    for(uint8_t i = FIFO_LOAD(ep2_rx_rd); i != ep2_rx_wr; i++) {
+        if(ep2_rx_q_half[i & 1] == ep2_rx_fill) held = 1;
+    }
+    USBFSD->UEP2_CTRL_H = (USBFSD->UEP2_CTRL_H & ~USBFS_UEP_R_RES_MASK)
+                        | (held ? USBFS_UEP_R_RES_NAK : USBFS_UEP_R_RES_ACK);
+    if(held && !ep2_rx_nak) stats.rxNaks++;
+    ep2_rx_nak = held;
+}
+
+// EP2 back to DATA0 with nothing armed (bus reset, SET_INTERFACE)
+static void USB_EP2_init(void) {
+  // EP2 used for both IN and OUT in MIDI, double buffered in both directions
+  USBFSD->UEP2_DMA    = (uint32_t)wch_usbmidi_EP2_buffer;
+  USBFSD->UEP2_3_MOD  = USBFS_UEP2_RX_EN | USBFS_UEP2_TX_EN | USBFS_UEP2_BUF_MOD;
+  USBFSD->UEP2_CTRL_H = USBFS_UEP_AUTO_TOG | USBFS_UEP_R_RES_ACK | USBFS_UEP_T_RES_NAK;
+  USBFSD->UEP2_TX_LEN = 0;
+  ep2_tx_busy = 0;
+  ep2_tx_cur  = 0;
+  ep2_tx_staged[0] = ep2_tx_staged[1] = 0;
+  ep2_tx_rt_staged[0] = ep2_tx_rt_staged[1] = 0;
+  // Toggles are back to DATA0; received data not yet read stays queued
+  ep2_rx_fill = 0;
+  USB_rx_update_response();
 }
 
 // Internal Init
@@ -68,11 +387,8 @@ static inline void USB_EP_init(void) {
   USBFSD->UEP0_CTRL_H = USBFS_UEP_R_RES_ACK | USBFS_UEP_T_RES_NAK;
   USBFSD->UEP0_TX_LEN = 0;
 
-  // EP2 used for both IN and OUT in MIDI
-  USBFSD->UEP2_DMA    = (uint32_t)wch_usbmidi_EP2_buffer;
-  USBFSD->UEP2_3_MOD  = USBFS_UEP2_RX_EN | USBFS_UEP2_TX_EN;
-  USBFSD->UEP2_CTRL_H = USBFS_UEP_AUTO_TOG | USBFS_UEP_R_RES_ACK | USBFS_UEP_T_RES_NAK;
-  USBFSD->UEP2_TX_LEN = 0;
+  USB_EP2_init();
+  usb_alt = 0;
 
   USB_ENUM_OK = 0;
   USB_Config  = 0;
@@ -141,18 +457,54 @@ void USB_init(void) {
     // Very long delay for enumeration
     for(volatile int i = 0; i < 100000; i++) __NOP();
 
+    timer_period = WCH_USBMIDI_TIMER_PERIOD();
+
     // Enable interrupts
-    USBFSD->INT_EN = USBFS_UIE_SUSPEND | USBFS_UIE_BUS_RST | USBFS_UIE_TRANSFER;
+    USBFSD->INT_EN = USBFS_UIE_SUSPEND | USBFS_UIE_BUS_RST | USBFS_UIE_TRANSFER
+                   | (ts_enabled ? USBFS_UIE_DEV_SOF : 0);
     NVIC_EnableIRQ(USBFS_IRQn);
 }
 
+uint8_t USB_configured(void) {
+    return USB_ENUM_OK;
+}
+
+uint8_t USB_get_state(void) {
+    if(usb_suspended) return USB_STATE_SUSPENDED;
+    return USB_ENUM_OK ? USB_STATE_CONFIGURED : USB_STATE_DEFAULT;
+}
+
+uint8_t USB_link_events(void) {
+    return usb_link_events;
+}
+
+#if WCH_USBMIDI_NOTE_TRACKING
+uint32_t USB_read_lost_note_offs(uint32_t* packets, uint32_t max) {
+    uint8_t tail = lost_off_tail, head = FIFO_LOAD(lost_off_head);
+    uint32_t n = 0;
+    for(; tail != head && n < max; tail++) packets[n++] = lost_off[tail & LOST_OFF_MASK];
+    FIFO_STORE(lost_off_tail, tail);
+    return n;
+}
+
+uint8_t USB_lost_note_offs_overflows(void) {
+    return lost_off_overflows;
+}
+#endif
+
+uint8_t USB_ump_active(void) {
+    return usb_alt;
+}
+
 void USB_EP0_copyDescr(uint8_t len) {
   uint8_t* tgt = wch_usbmidi_EP0_buffer;
   while(len--) *tgt++ = *USB_pDescr++;
 }
 
+#define USB_REQ_UNSUPPORTED 0xffff
+
 static inline void USB_EP0_SETUP(void) {
-  uint8_t len = 0;
+  uint16_t len = 0; // Configuration descriptor can exceed 255 bytes with many cables
   USB_SetupLen = ((uint16_t)USB_SetupBuf->wLengthH<<8) | (USB_SetupBuf->wLengthL);
   USB_SetupReq = USB_SetupBuf->bRequest;
   USB_SetupTyp = USB_SetupBuf->bRequestType;
@@ -177,9 +529,14 @@ static inline void USB_EP0_SETUP(void) {
             len = ((const uint8_t*)USB_pDescr)[0];
             break;
           }
-          default: len = 0xff; break;
+#if WCH_USBMIDI_MIDI2
+          case USB_DESCR_TYP_CS_GR_TRM_BLOCK: // Blocks of the MIDI 2.0 setting
+            if(USB_SetupBuf->wValueL != 1) { len = USB_REQ_UNSUPPORTED; break; }
+            USB_pDescr = wch_usbmidi_GtbDescr; len = wch_usbmidi_GtbDescrLen; break;
+#endif
+          default: len = USB_REQ_UNSUPPORTED; break;
         }
-        if(len != 0xff) {
+        if(len != USB_REQ_UNSUPPORTED) {
           if(USB_SetupLen > len) USB_SetupLen = len;
           len = USB_SetupLen >= EP0_SIZE ? EP0_SIZE : USB_SetupLen;
           USB_EP0_copyDescr(len);
@@ -190,18 +547,36 @@ static inline void USB_EP0_SETUP(void) {
       case 0x08: /* GET_CONFIGURATION */
         wch_usbmidi_EP0_buffer[0] = USB_Config; if(USB_SetupLen > 1) USB_SetupLen = 1; len = USB_SetupLen; break;
       case 0x09: /* SET_CONFIGURATION */
-        USB_Config  = USB_SetupBuf->wValueL; USB_ENUM_OK = 1; break;
+        USB_Config  = USB_SetupBuf->wValueL; USB_ENUM_OK = 1; usb_alt = 0; break;
+      case 0x0A: /* GET_INTERFACE */
+        wch_usbmidi_EP0_buffer[0] = USB_SetupBuf->wIndexL == 1 ? usb_alt : 0;
+        if(USB_SetupLen > 1) USB_SetupLen = 1;
+        len = USB_SetupLen; break;
+      case 0x0B: /* SET_INTERFACE */
+        if(USB_SetupBuf->wValueL == 0 || (USB_SetupBuf->wIndexL == 1 && USB_SetupBuf->wValueL <= WCH_USBMIDI_MIDI2)) {
+          if(USB_SetupBuf->wIndexL == 1) {
+            // New setting, new packet format: restart EP2 and drop queued output
+            USB_tx_discard();
+            usb_alt = USB_SetupBuf->wValueL;
+            USB_EP2_init();
+            usb_link_events++;
+          }
+        } else {
+          len = USB_REQ_UNSUPPORTED;
+        }
+        break;
       case 0x00: /* GET_STATUS */
         wch_usbmidi_EP0_buffer[0] = 0x00; wch_usbmidi_EP0_buffer[1] = 0x00; if(USB_SetupLen > 2) USB_SetupLen = 2; len = USB_SetupLen; break;
       default:
-        len = 0xff; break;
+        len = USB_REQ_UNSUPPORTED; break;
     }
   } else {
     // No Class requests for MIDI usually (unlike CDC)
-    len = 0xff;
+    len = USB_REQ_UNSUPPORTED;
   }
 
-  if(len == 0xff) {
+  if(len == USB_REQ_UNSUPPORTED) {
+    stats.setupStalls++;
     USB_SetupReq = 0xff;
     USBFSD->UEP0_CTRL_H = USBFS_UEP_T_TOG | USBFS_UEP_T_RES_STALL | USBFS_UEP_R_TOG | USBFS_UEP_R_RES_STALL;
   } else {
@@ -235,58 +610,504 @@ static inline void USB_EP0_OUT(void) {
   USBFSD->UEP0_CTRL_H = USBFS_UEP_T_TOG | USBFS_UEP_T_RES_ACK | USBFS_UEP_R_RES_ACK;
 }
 
+static uint32_t USB_timestamp(uint32_t frames, uint32_t at) {
+    uint32_t us = timer_elapsed(at, WCH_USBMIDI_TIMER_READ()) / ts_ticks_per_us;
+    if(us > 999) us = 999; // SOF late or missed: stay inside the frame
+    return frames * 1000 + us;
+}
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+static inline int sched_before(const SchedEvent* a, const SchedEvent* b) {
+    int32_t dt = (int32_t)(a->time - b->time);
+    return dt < 0 || (dt == 0 && (int16_t)(a->seq - b->seq) < 0);
+}
+
+static void sched_heap_push(const SchedEvent* ev) {
+    uint16_t i = sched_count++;
+    while(i > 0) {
+        uint16_t parent = (i - 1) / 2;
+        if(!sched_before(ev, &sched_heap[parent])) break;
+        sched_heap[i] = sched_heap[parent];
+        i = parent;
+    }
+    sched_heap[i] = *ev;
+}
+
+static void sched_heap_pop(void) {
+    SchedEvent last = sched_heap[--sched_count];
+    uint16_t i = 0;
+    for(;;) {
+        uint16_t child = 2 * i + 1;
+        if(child >= sched_count) break;
+        if(child + 1 < sched_count && sched_before(&sched_heap[child + 1], &sched_heap[child])) child++;
+        if(!sched_before(&sched_heap[child], &last)) break;
+        sched_heap[i] = sched_heap[child];
+        i = child;
+    }
+    sched_heap[i] = last;
+}
+
+// Take posted events into the heap and release those due by now into the
+// staging ring. ISR context only.
+static void USB_sched_service(uint32_t now) {
+    if(sched_clear_req) {
+        USB_sched_drop();
+        sched_clear_req = 0;
+    }
+    uint16_t tail = sched_in_tail;
+    uint16_t head = FIFO_LOAD(sched_in_head);
+    uint32_t retired = 0;
+
+    for(; tail != head; tail++) sched_heap_push(&sched_in[tail & SCHED_IN_MASK]);
+    FIFO_STORE(sched_in_tail, tail);
+
+    while(sched_count && (int32_t)(sched_heap[0].time - now) <= 0
+          && (uint8_t)(sched_out_head - sched_out_tail) < SCHED_OUT_SIZE) {
+        sched_out[sched_out_head++ & SCHED_OUT_MASK] = sched_heap[0].packet;
+        sched_heap_pop();
+        retired++;
+    }
+    if(retired) FIFO_STORE(sched_retired, sched_retired + retired);
+}
+#endif
+
+// One frame per SOF interrupt. A SOF flagged while another transfer was
+// pending is not reported on its own; only a free-running timer can tell how
+// many were missed, a reloading one (SysTick under the Arduino core) cannot.
+// With a free-running timer the frames are those whose start (on the phase
+// of the last SOF taken on time) has passed; an interrupt taken late keeps
+// that phase rather than its own, and the frame it may have counted ahead
+// is not counted again. Two late in a row take the new phase.
+static inline void USB_SOF(void) {
+    uint32_t now = WCH_USBMIDI_TIMER_READ();
+    uint32_t frames = 1;
+    if(!timer_period && sof_phase != SOF_PHASE_NONE) {
+        uint32_t ticks_per_ms = ts_ticks_per_us * 1000;
+        uint32_t slack = ticks_per_ms / 32;
+        uint32_t elapsed = now - sof_timer;
+        frames = (elapsed + slack) / ticks_per_ms;
+        if((int32_t)(elapsed - frames * ticks_per_ms) > (int32_t)slack && sof_phase == SOF_PHASE_SET) {
+            now = sof_timer + frames * ticks_per_ms;
+            sof_phase = SOF_PHASE_KEPT;
+        } else {
+            sof_phase = SOF_PHASE_SET;
+        }
+    }
+    if(sof_phase == SOF_PHASE_NONE) sof_phase = SOF_PHASE_SET;
+    sof_timer  = now;
+    sof_frames += frames;
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+    USB_sched_service(sof_frames * 1000);
+#endif
+}
+
+// Move realtime packets out of a received half into the RX realtime lane and
+// close the gaps; returns the packets left. If the lane is full the rest stay
+// in place and are delivered in order. ISR context only.
+static uint8_t USB_rx_extract_rt(usb_word_t* buf, uint8_t count, uint32_t time) {
+    uint16_t head = rx_rt_head;
+    uint16_t space = RT_FIFO_SIZE - (uint16_t)(head - FIFO_LOAD(rx_rt_tail));
+    uint8_t kept = 0;
+    if(usb_alt) {
+        // UMP: step over whole messages; realtime is a one-word system message
+        for(uint8_t i = 0; i < count;) {
+            uint32_t word = buf[i];
+            uint8_t words = UMP_WORD_COUNT(word);
+            if(space && (word >> 28) == 0x1 && ((word >> 16) & 0xFF) >= 0xF8) {
+                rx_rt_time[head & RT_FIFO_MASK] = time;
+                rx_rt_fifo[head++ & RT_FIFO_MASK] = word;
+                space--;
+                i++;
+                continue;
+            }
+            for(; words && i < count; words--) buf[kept++] = buf[i++];
+        }
+        FIFO_STORE(rx_rt_head, head);
+        return kept;
+    }
+    for(uint8_t i = 0; i < count; i++) {
+        uint32_t pkt = buf[i];
+        if(space && IS_REALTIME_PACKET(pkt)) {
+            rx_rt_time[head & RT_FIFO_MASK] = time;
+            rx_rt_fifo[head++ & RT_FIFO_MASK] = pkt;
+            space--;
+        } else {
+            buf[kept++] = pkt;
+        }
+    }
+    FIFO_STORE(rx_rt_head, head);
+    return kept;
+}
+
 static inline void MIDI_EP2_OUT(void) {
     if(USBFSD->INT_ST & USBFS_UIS_TOG_OK) {
-        uint8_t len = USBFSD->RX_LEN;
-        // Simple ring buffer push
-        for(int i=0; i<len; i++) {
-            rx_fifo_push(wch_usbmidi_EP2_buffer[i]);
+        uint8_t half = ep2_rx_fill;
+        uint32_t time = ts_enabled ? USB_timestamp(sof_frames, sof_timer) : 0;
+        // A trailing partial packet from a misbehaving host is discarded
+        uint8_t count = USBFSD->RX_LEN / 4;
+        if(USBFSD->RX_LEN & 3) stats.rxDropped++;
+        stats.rxPackets += count;
+        ep2_rx_fill ^= 1;
+#if !WCH_USBMIDI_RX_DEFERRED
+        if(rx_hook) {
+            // Dispatched in place, so the half is free again right away
+            rx_hook_running = 1;
+            if(count) rx_hook((const uint32_t*)EP2_OUT_WORDS(half), count, time, 0);
+            rx_hook_running = 0;
+            USB_rx_update_response();
+            return;
+        }
+#endif
+        count = USB_rx_extract_rt(EP2_OUT_WORDS(half), count, time);
+        if(count) {
+            uint8_t wr = ep2_rx_wr;
+            ep2_rx_q_half[wr & 1] = half;
+            ep2_rx_q_len[wr & 1]  = count;
+            ep2_rx_q_time[wr & 1] = time;
+            FIFO_STORE(ep2_rx_wr, (uint8_t)(wr + 1));
+            uint16_t waiting = 0;
+            for(uint8_t i = FIFO_LOAD(ep2_rx_rd); i != (uint8_t)(wr + 1); i++) waiting += ep2_rx_q_len[i & 1];
+            if(waiting > stats.rxHighWater) stats.rxHighWater = waiting;
         }
-        USBFSD->UEP2_CTRL_H = USBFS_UEP_R_RES_ACK | USBFS_UEP_AUTO_TOG; // Re-arm for next
+#if WCH_USBMIDI_RX_DEFERRED
+        if(rx_hook) NVIC_SetPendingIRQ(Software_IRQn);
+#endif
+        // Re-arm for next; only touch the OUT response bits so the IN side and
+        // the data toggles are preserved
+        USB_rx_update_response();
     }
 }
 
 static inline void MIDI_EP2_IN(void) {
     // TX Completed, hardware automatically NAKs subsequent IN tokens until we re-arm
     USBFSD->UEP2_CTRL_H = (USBFSD->UEP2_CTRL_H & ~USBFS_UEP_T_RES_MASK) | USBFS_UEP_T_RES_NAK;
+    ep2_tx_staged[ep2_tx_cur] = 0;
+    ep2_tx_rt_staged[ep2_tx_cur] = 0;
+    ep2_tx_cur ^= 1;
     
-    // Check if more data is waiting in FIFO and send it
+    // Send the half staged during the last transfer, topped up from the FIFO
     USB_send_from_fifo();
 }
 
-// Helper to write (Non-blocking using FIFO)
-uint32_t USB_write(const uint8_t* buf, uint32_t len) {
-    if(len == 0) return 0;
-    
+// Bits of a packet that identify the value it carries (cable, CIN, status
+// and controller/note), or 0 if it must never be merged
+static uint32_t coalesce_key_mask(uint32_t packet) {
+    switch(packet & 0x0F) {
+        case 0x0B: { // Control Change: continuous controllers only
+            uint8_t cc = USB_MIDI_BYTE(packet, 2);
+            if(cc == 0 || cc == 32) return 0;                 // Bank select
+            if(cc == 6 || cc == 38 || (cc >= 96 && cc <= 101)) return 0; // Data entry, (N)RPN
+            if(cc >= 64 && cc <= 69) return 0;                // Pedals and switches
+            if(cc >= 120) return 0;                           // Channel mode
+            return 0x00FFFFFF;
+        }
+        case 0x0A: return 0x00FFFFFF; // Poly pressure, per note
+        case 0x0D:                    // Channel pressure
+        case 0x0E: return 0x0000FFFF; // Pitch bend
+        default:   return 0;
+    }
+}
+
+// Replace the newest queued packet with the same key by this one. The scan
+// stops at any other channel message for the same cable and channel so
+// updates never move ahead of notes. Main loop only.
+static int USB_tx_coalesce(uint32_t packet) {
+    uint32_t mask = coalesce_key_mask(packet);
+    if(!mask) return 0;
+
+    uint16_t tail = FIFO_LOAD(tx_tail);
+    for(uint16_t i = tx_head; i != tail;) {
+        i--;
+        uint32_t queued = tx_fifo[i & TX_FIFO_MASK];
+        if((queued & mask) == (packet & mask)) {
+            tx_fifo[i & TX_FIFO_MASK] = packet;
+            // The ISR runs to completion between our instructions, so either it
+            // copies the slot after this store or tx_tail already shows the
+            // slot was taken; in that case the old value went out and this
+            // one must be appended
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            return (int16_t)(i - FIFO_LOAD(tx_tail)) >= 0;
+        }
+        uint8_t cin = queued & 0x0F;
+        if((queued & 0xF0) == (packet & 0xF0) && cin >= 0x08 && cin <= 0x0E
+           && ((queued ^ packet) & 0x0F00) == 0 && !coalesce_key_mask(queued)) {
+            return 0; // Note or other channel message in between
+        }
+    }
+    return 0;
+}
+
+static int is_note_off(uint32_t packet) {
+    uint8_t cin = packet & 0x0F;
+    return cin == 0x08 || (cin == 0x09 && USB_MIDI_BYTE(packet, 3) == 0);
+}
+
+// Main loop and receive hook: one producer at a time. Masking is only needed
+// on the main loop side, the hook cannot be interrupted by it. Nests; never
+// wait for the ISR while holding it.
+void USB_tx_lock(void) {
+    if(tx_lock_depth++ == 0) {
+        tx_lock_masked = rx_hook && !rx_hook_running;
+        if(tx_lock_masked) NVIC_DisableIRQ(RX_HOOK_IRQn);
+    }
+}
+
+void USB_tx_unlock(void) {
+    if(--tx_lock_depth == 0 && tx_lock_masked) NVIC_EnableIRQ(RX_HOOK_IRQn);
+}
+
+static uint32_t USB_tx_queue(const uint32_t* packets, uint32_t count) {
+    uint16_t reserve = 0;
+    if(count == 0) return 0;
+    // Nobody is listening: queueing would only replay stale data later
+    if(USB_get_state() != USB_STATE_CONFIGURED) {
+        stats.txDropped += count;
+        return 0;
+    }
+
+    if(tx_coalesce && !usb_alt) {
+        if(count == 1 && USB_tx_coalesce(packets[0])) {
+            stats.txCoalesced++;
+            return 1;
+        }
+        if(count > 1 || !is_note_off(packets[0])) reserve = TX_NOTE_OFF_RESERVE;
+    }
+
     // Try to push to buffer
-    if(!tx_fifo_push(buf, len)) {
-        return 0; // Buffer full, packet dropped (non-blocking)
+    if(count > TX_FIFO_SIZE || !tx_fifo_push(packets, count, reserve)) {
+        stats.txDropped += count;
+        // A batch that outgrows the FIFO is released early so it can drain
+        if(tx_batch) USB_kick_tx();
+        return 0; // Buffer full, packets dropped (non-blocking)
     }
+    stats.txPackets += count;
 
-    // Trigger transmission if hardware is idle
-    USB_send_from_fifo();
+    // Trigger transmission if hardware is idle, unless a batch holds it back
+    if(!tx_batch) USB_kick_tx();
     
-    return len;
+    return count;
 }
 
-uint32_t USB_available(void) {
-    uint16_t head = rx_head;
-    uint16_t tail = rx_tail;
-    if (head >= tail) return head - tail;
-    return RX_FIFO_SIZE + head - tail;
+// Helper to write (Non-blocking using FIFO). All packets are queued or none.
+uint32_t USB_write(const uint32_t* packets, uint32_t count) {
+    USB_tx_lock();
+    count = USB_tx_queue(packets, count);
+    USB_tx_unlock();
+    return count;
+}
+
+uint32_t USB_write_realtime(uint32_t packet) {
+    uint32_t queued = 0;
+    USB_tx_lock();
+    uint16_t head = tx_rt_head;
+    if(USB_get_state() != USB_STATE_CONFIGURED ||(uint16_t)(head - FIFO_LOAD(tx_rt_tail)) >= RT_FIFO_SIZE) {
+        stats.txDropped++;
+    } else {
+        tx_rt_fifo[head & RT_FIFO_MASK] = packet;
+        FIFO_STORE(tx_rt_head, (uint16_t)(head + 1));
+        stats.txPackets++;
+        // Never held back by an open batch
+        USB_kick_tx_idle();
+        queued = 1;
+    }
+    USB_tx_unlock();
+    return queued;
+}
+
+void USB_set_coalescing(uint8_t enable) {
+    tx_coalesce = enable;
+}
+
+void USB_batch_begin(void) {
+    USB_tx_lock();
+    tx_batch++;
+    USB_tx_unlock();
+}
+
+void USB_batch_end(void) {
+    USB_tx_lock();
+    if(tx_batch && --tx_batch == 0) {
+        if(tx_head != tx_commit) stats.txFlushes++;
+        USB_kick_tx();
+    }
+    USB_tx_unlock();
 }
 
-uint32_t USB_read(uint8_t* buf, uint32_t len) {
+void USB_set_rx_hook(USB_rx_hook_t hook) {
+#if WCH_USBMIDI_RX_DEFERRED
+    NVIC_SetPriority(Software_IRQn, 0xF0);
+    NVIC_EnableIRQ(Software_IRQn);
+#endif
+    rx_hook = hook;
+#if WCH_USBMIDI_RX_DEFERRED
+    NVIC_SetPendingIRQ(Software_IRQn); // Anything that arrived meanwhile
+#endif
+}
+
+#if WCH_USBMIDI_RX_DEFERRED
+// Runs the receive hook once the USB interrupt is done, realtime first. It
+// takes over the reading side of the queues from the main loop.
+static void USB_rx_hook_runs(USB_rx_hook_t hook, const uint32_t* packets, const uint32_t* times,
+                             uint32_t count, uint8_t realtime) {
+    // One call per transfer, like the in-interrupt mode: a run of equal times
+    for(uint32_t i = 0, j; i < count; i = j) {
+        for(j = i + 1; j < count && times[j] == times[i]; j++) {}
+        hook(packets + i, (uint8_t)(j - i), times[i], realtime);
+    }
+}
+
+void SW_Handler(void) WCH_USBMIDI_IRQ_ATTR;
+void SW_Handler(void) {
+    USB_rx_hook_t hook = rx_hook;
+    uint32_t packets[EP2_PACKETS], times[EP2_PACKETS], count;
+    if(!hook) return;
+    rx_hook_running = 1;
+    for(;;) {
+        while((count = USB_read_realtime(packets, times, EP2_PACKETS)) > 0) {
+            USB_rx_hook_runs(hook, packets, times, count, 1);
+        }
+        if((count = USB_read_timestamped(packets, times, EP2_PACKETS)) == 0) break;
+        USB_rx_hook_runs(hook, packets, times, count, 0);
+    }
+    rx_hook_running = 0;
+}
+#endif
+
+void USB_get_stats(USBMIDIStats* out) {
+    *out = stats;
+}
+
+void USB_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+    timer_period = WCH_USBMIDI_TIMER_PERIOD(); // In case SysTick was set up after begin()
+}
+
+uint32_t USB_available(void) {
     uint32_t count = 0;
-    while(count < len && rx_head != rx_tail) {
-        buf[count++] = rx_fifo[rx_tail];
-        rx_tail = (rx_tail + 1) % RX_FIFO_SIZE;
+    uint8_t wr = FIFO_LOAD(ep2_rx_wr);
+    for(uint8_t i = ep2_rx_rd; i != wr; i++) count += ep2_rx_q_len[i & 1];
+    return count ? count - ep2_rx_pos : 0;
+}
+
+uint32_t USB_available_realtime(void) {
+    return (uint16_t)(FIFO_LOAD(rx_rt_head) - rx_rt_tail);
+}
+
+uint32_t USB_read_realtime(uint32_t* packets, uint32_t* times, uint32_t count) {
+    uint16_t tail = rx_rt_tail;
+    uint16_t avail = (uint16_t)(FIFO_LOAD(rx_rt_head) - tail);
+    uint32_t n = 0;
+    for(; n < count && n < avail; n++) {
+        packets[n] = rx_rt_fifo[(uint16_t)(tail + n) & RT_FIFO_MASK];
+        if(times) times[n] = rx_rt_time[(uint16_t)(tail + n) & RT_FIFO_MASK];
     }
-    return count;
+    FIFO_STORE(rx_rt_tail, (uint16_t)(tail + n));
+    return n;
+}
+
+uint32_t USB_read(uint32_t* packets, uint32_t count) {
+    return USB_read_timestamped(packets, NULL, count);
+}
+
+uint32_t USB_read_timestamped(uint32_t* packets, uint32_t* times, uint32_t count) {
+    uint32_t n = 0;
+    while(n < count) {
+        uint8_t rd = ep2_rx_rd;
+        if(rd == FIFO_LOAD(ep2_rx_wr)) break;
+
+        const usb_word_t* src = EP2_OUT_WORDS(ep2_rx_q_half[rd & 1]);
+        uint8_t len = ep2_rx_q_len[rd & 1];
+        uint8_t pos = ep2_rx_pos;
+        uint32_t start = n;
+        while(n < count && pos < len) packets[n++] = src[pos++];
+        if(times) {
+            for(uint32_t i = start; i < n; i++) times[i] = ep2_rx_q_time[rd & 1];
+        }
+        if(pos < len) {
+            ep2_rx_pos = pos;
+            break;
+        }
+
+        // Half fully read: hand it back to the hardware
+        ep2_rx_pos = 0;
+        FIFO_STORE(ep2_rx_rd, (uint8_t)(rd + 1));
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(ep2_rx_nak) NVIC_SetPendingIRQ(USBFS_IRQn);
+    }
+    return n;
+}
+
+void USB_timestamps_enable(uint8_t enable) {
+    if(!enable) {
+        USBFSD->INT_EN &= ~USBFS_UIE_DEV_SOF;
+        ts_enabled = 0;
+        return;
+    }
+    if(ts_enabled) return;
+    ts_ticks_per_us = WCH_USBMIDI_TIMER_TICKS_PER_US;
+    if(ts_ticks_per_us == 0) ts_ticks_per_us = 1;
+    timer_period = WCH_USBMIDI_TIMER_PERIOD();
+    sof_timer = WCH_USBMIDI_TIMER_READ();
+    sof_phase = SOF_PHASE_NONE;
+    ts_enabled = 1;
+    USBFSD->INT_EN |= USBFS_UIE_DEV_SOF;
+}
+
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+static uint32_t USB_sched_post(uint32_t time, uint32_t packet) {
+    uint16_t head = sched_in_head;
+    // Like USB_tx_queue: nothing is scheduled for a host that is not there
+    if(USB_get_state() != USB_STATE_CONFIGURED
+       || sched_posted - FIFO_LOAD(sched_retired) >= WCH_USBMIDI_SCHED_CAPACITY
+       || (uint16_t)(head - FIFO_LOAD(sched_in_tail)) >= SCHED_IN_SIZE) {
+        stats.txDropped++;
+        return 0;
+    }
+    // Released from the SOF interrupt on the frame clock
+    if(!ts_enabled) USB_timestamps_enable(1);
+
+    SchedEvent* ev = &sched_in[head & SCHED_IN_MASK];
+    ev->time   = time;
+    ev->packet = packet;
+    ev->seq    = sched_seq++;
+    sched_posted++;
+    stats.txPackets++;
+    FIFO_STORE(sched_in_head, (uint16_t)(head + 1));
+    // Let the ISR empty the ring early when it fills faster than once a frame
+    if((uint16_t)(head + 1 - sched_in_tail) == SCHED_IN_SIZE / 2) NVIC_SetPendingIRQ(USBFS_IRQn);
+    return 1;
+}
+
+uint32_t USB_write_at(uint32_t time, uint32_t packet) {
+    USB_tx_lock();
+    uint32_t queued = USB_sched_post(time, packet);
+    USB_tx_unlock();
+    return queued;
+}
+
+uint32_t USB_scheduled(void) {
+    return sched_posted - FIFO_LOAD(sched_retired);
+}
+
+void USB_sched_clear(void) {
+    sched_clear_req = 1;
+    NVIC_SetPendingIRQ(USBFS_IRQn);
+}
+#endif
+
+uint32_t USB_now(void) {
+    uint32_t frames, at;
+    if(!ts_enabled) return 0;
+    do {
+        frames = sof_frames;
+        at = sof_timer;
+    } while(frames != sof_frames);
+    return USB_timestamp(frames, at);
 }
 
-void USBFS_IRQHandler(void) __attribute__((interrupt));
+void USBFS_IRQHandler(void) WCH_USBMIDI_IRQ_ATTR;
 void USBFS_IRQHandler(void) {
+  uint32_t entered = WCH_USBMIDI_TIMER_READ();
   uint8_t intflag = USBFSD->INT_FG;
   uint8_t intst   = USBFSD->INT_ST;
   if(intflag & USBFS_UIF_TRANSFER) {
@@ -299,12 +1120,38 @@ void USBFS_IRQHandler(void) {
       case USBFS_UIS_TOKEN_OUT:
         switch(callIndex) { case 0: USB_EP0_OUT(); break; case 2: MIDI_EP2_OUT(); break; default: break; }
         break;
+      case USBFS_UIS_TOKEN_SOF:
+        USB_SOF(); break;
     }
     USBFSD->INT_FG = USBFS_UIF_TRANSFER;
   }
-  if(intflag & USBFS_UIF_SUSPEND) { USBFSD->INT_FG = USBFS_UIF_SUSPEND; }
+  if(intflag & USBFS_UIF_SUSPEND) {
+    // Raised on both suspend and resume; MIS_ST tells which
+    USBFSD->INT_FG = USBFS_UIF_SUSPEND;
+    usb_suspended = (USBFSD->MIS_ST & USBFS_UMS_SUSPEND) ? 1 : 0;
+    if(usb_suspended) stats.suspends++;
+    usb_link_events++;
+  }
   if(intflag & USBFS_UIF_BUS_RST) {
+    USB_tx_discard();
     USB_EP_init();
+    usb_suspended = 0;
+    usb_link_events++;
+    stats.busResets++;
     USBFSD->DEV_ADDR = 0; USBFSD->INT_FG = 0xff;
   }
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+  // Pended by the main loop when the posting ring is half full or on clear
+  if(sched_clear_req || sched_in_tail != FIFO_LOAD(sched_in_head)) {
+      USB_sched_service(sof_frames * 1000);
+  }
+#endif
+  // Also entered without any flag when the main loop pends the IRQ to start TX
+  // or to re-arm EP2 OUT after releasing a buffer half
+  if(!ep2_tx_busy) USB_send_from_fifo();
+  if(ep2_rx_nak) USB_rx_update_response();
+
+  uint32_t took = timer_elapsed(entered, WCH_USBMIDI_TIMER_READ());
+  stats.isrCount++;
+  if(took > stats.isrMaxTicks) stats.isrMaxTicks = took;
 }
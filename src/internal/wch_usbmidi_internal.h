@@ -9,21 +9,6 @@
 #define EP0_SIZE 64
 #define EP2_SIZE 64
 
-// Buffer externs
-extern __attribute__((aligned(4))) unsigned char wch_usbmidi_EP0_buffer[];
-extern __attribute__((aligned(4))) unsigned char wch_usbmidi_EP2_buffer[];
-
-// Descriptor externs
-extern const USB_DEV_DESCR wch_usbmidi_DevDescr;
-extern const uint8_t wch_usbmidi_CfgDescr[];
-extern const uint16_t wch_usbmidi_CfgDescrLen;
-
-extern const USB_STR_DESCR wch_usbmidi_LangDescr;
-extern USB_STR_DESCR wch_usbmidi_ManufDescr;
-extern USB_STR_DESCR wch_usbmidi_ProdDescr;
-extern USB_STR_DESCR wch_usbmidi_SerDescr;
-extern USB_STR_DESCR wch_usbmidi_InterfDescr;
-
 // Setup buffer access
 typedef struct __attribute__((packed)) {
     uint8_t  bRequestType;
@@ -38,20 +23,159 @@ typedef struct __attribute__((packed)) {
 
 #define USB_SetupBuf ((PUSB_SETUP_REQ)wch_usbmidi_EP0_buffer)
 
+// Runtime counters (see USB_get_stats)
+typedef struct {
+    uint32_t txPackets;     // Packets accepted into the TX FIFO
+    uint32_t txDropped;     // Packets refused because the TX FIFO was full
+    uint32_t txTransfers;   // EP2 IN transfers armed
+    uint32_t txFlushes;     // Batches flushed with pending packets
+    uint32_t txCoalesced;   // Controller updates merged into a queued packet
+    uint32_t rxPackets;     // Packets received on EP2 OUT
+    uint32_t rxDropped;     // Torn (non multiple of 4) packets discarded
+    uint32_t rxNaks;        // Times EP2 OUT was held off with NAK because
+                            // both receive halves were still unread
+    uint16_t txHighWater;   // Most packets ever waiting in the TX FIFO (of 64)
+    uint16_t rxHighWater;   // Most received packets ever waiting unread (of 32)
+    uint32_t busResets;     // USB bus resets (host restart, re-plug)
+    uint32_t suspends;      // Times the bus went to suspend
+    uint32_t setupStalls;   // Control requests answered with STALL
+    uint32_t isrCount;      // USB interrupts taken
+    uint32_t isrMaxTicks;   // Longest USB interrupt, in WCH_USBMIDI_TIMER_READ
+                            // ticks (WCH_USBMIDI_TIMER_TICKS_PER_US per us),
+                            // modulo WCH_USBMIDI_TIMER_PERIOD (1 ms of SysTick
+                            // under the Arduino core)
+} USBMIDIStats;
+
+// USB-MIDI event packet <-> 32-bit word (byte 0 = cable/CIN in bits 0-7)
+#define USB_MIDI_PACKET(hdr, b1, b2, b3) \
+    ((uint32_t)(hdr) | ((uint32_t)(b1) << 8) | ((uint32_t)(b2) << 16) | ((uint32_t)(b3) << 24))
+#define USB_MIDI_BYTE(pkt, n)   ((uint8_t)((pkt) >> ((n) * 8)))
+
+// Universal MIDI Packet size in 32-bit words, from the message type in the
+// top nibble of its first word
+#define UMP_WORD_COUNT(w)       ((uint8_t)((0x4443322211422111ull >> (((w) >> 28) * 4)) & 0x0F))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Buffer externs
+extern __attribute__((aligned(4))) unsigned char wch_usbmidi_EP0_buffer[];
+extern __attribute__((aligned(4))) unsigned char wch_usbmidi_EP2_buffer[];
+
+// Descriptor externs
+extern const USB_DEV_DESCR wch_usbmidi_DevDescr;
+extern const uint8_t* const wch_usbmidi_CfgDescr;
+extern const uint16_t wch_usbmidi_CfgDescrLen;
+#if WCH_USBMIDI_MIDI2
+extern const uint8_t* const wch_usbmidi_GtbDescr;
+extern const uint16_t wch_usbmidi_GtbDescrLen;
+#endif
+
+extern const USB_STR_DESCR wch_usbmidi_LangDescr;
+extern USB_STR_DESCR wch_usbmidi_ManufDescr;
+extern USB_STR_DESCR wch_usbmidi_ProdDescr;
+extern USB_STR_DESCR wch_usbmidi_SerDescr;
+extern USB_STR_DESCR wch_usbmidi_InterfDescr;
+
 void generate_all_string_descriptors(void);
 void USB_init(void);
+uint8_t USB_configured(void);
+
+// Connection state. USB_write refuses packets unless the state is
+// USB_STATE_CONFIGURED, and a bus reset discards whatever was still queued.
+// USB_link_events counts resets, suspends and resumes so a transition is
+// seen even when the state is back where it was by the next look.
+#define USB_STATE_DEFAULT     0 // Attached but not (or no longer) configured
+#define USB_STATE_CONFIGURED  1 // Enumerated; the host reads the MIDI endpoint
+#define USB_STATE_SUSPENDED   2 // Bus idle: host asleep or cable pulled
+uint8_t USB_get_state(void);
+uint8_t USB_link_events(void);
+
+#if WCH_USBMIDI_NOTE_TRACKING
+// Note Offs that were queued (or staged, or on the wire unacknowledged) when
+// a bus reset or SET_INTERFACE discarded the TX queues, as USB-MIDI packets
+// whatever the setting, oldest first. Up to 32 are kept unread;
+// USB_lost_note_offs_overflows counts the discards that found more.
+uint32_t USB_read_lost_note_offs(uint32_t* packets, uint32_t max);
+uint8_t USB_lost_note_offs_overflows(void);
+#endif
 
-// Handler specific (renamed from CDC)
-// We need MIDI specific EP handling exposed if C++ needs it, 
-// but usually it's handled via shared buffers or helper functions.
-// Let's expose helpers.
+// Packet queues. Every element is one 4-byte USB-MIDI event packet packed
+// into a little-endian word (see USB_MIDI_PACKET); counts are in packets.
 uint32_t USB_available(void);
-uint32_t USB_read(uint8_t* buf, uint32_t len);
-uint32_t USB_write(const uint8_t* buf, uint32_t len);
+uint32_t USB_read(uint32_t* packets, uint32_t count);
+// As USB_read, also storing each packet's receive timestamp in times
+uint32_t USB_read_timestamped(uint32_t* packets, uint32_t* times, uint32_t count);
+uint32_t USB_write(const uint32_t* packets, uint32_t count);
+
+// System Real-Time lanes (CIN 0xF, status 0xF8-0xFF). USB_write_realtime
+// queues one packet that is sent ahead of the TX FIFO and is not held by
+// batches (returns 0 if the lane is full). Received realtime packets are
+// taken out of the normal stream and read with USB_read_realtime (times may
+// be NULL).
+uint32_t USB_write_realtime(uint32_t packet);
+uint32_t USB_read_realtime(uint32_t* packets, uint32_t* times, uint32_t count);
+uint32_t USB_available_realtime(void);
+
+// SOF timestamps: microseconds on the USB frame clock (frames counted from
+// SOF * 1000 plus a hardware timer offset). Received packets are stamped once
+// per OUT transfer. Off by default since it adds one interrupt per frame;
+// while off all timestamps are 0.
+void USB_timestamps_enable(uint8_t enable);
+uint32_t USB_now(void);
+
+// Scheduled output: USB_write_at queues one packet to go out in the first
+// USB frame that starts at or after time (a USB_now() timestamp; enables
+// timestamps if needed). Returns 0 if the device is not configured or
+// WCH_USBMIDI_SCHED_CAPACITY packets are already pending. USB_sched_clear
+// drops everything not yet released; a bus reset does the same.
+#if WCH_USBMIDI_SCHED_CAPACITY > 0
+uint32_t USB_write_at(uint32_t time, uint32_t packet);
+uint32_t USB_scheduled(void);
+void USB_sched_clear(void);
+#endif
+
+// Coalescing mode: a single controller packet (CC, pitch bend, channel or
+// poly pressure) overwrites the newest queued value for the same cable,
+// channel and controller instead of being appended, as long as no other
+// channel message for that channel was queued after it. Switch-type and
+// parameter-number CCs are never merged. Packets other than Note Off also
+// leave 8 FIFO slots free (TX_NOTE_OFF_RESERVE) so Note Offs still fit when
+// the FIFO is flooded. That is a margin, not a guarantee: once the host stops
+// reading, or more than 8 notes are released into a full FIFO, further Note
+// Offs are refused and counted in txDropped like any other packet. Nothing
+// already queued is evicted for them, since the ISR may be copying it.
+void USB_set_coalescing(uint8_t enable);
+
+// Receive hook: while set, received packets bypass the read queue and are
+// handed over as they arrive, from the USB interrupt (or the software
+// interrupt with WCH_USBMIDI_RX_DEFERRED), all with the same receive time.
+// realtime is set for packets from the realtime lane. NULL returns to
+// USB_read*; packets already queued stay there.
+typedef void (*USB_rx_hook_t)(const uint32_t* packets, uint8_t count, uint32_t time, uint8_t realtime);
+void USB_set_rx_hook(USB_rx_hook_t hook);
+
+// The hook may send too. The write functions take care of that themselves;
+// USB_tx_lock/unlock around several of them (or around state shared with
+// the hook's sends) keeps the hook out in between, by masking its interrupt
+// while called from the main loop. Nests; keep it short and never wait for
+// TX space while holding it.
+void USB_tx_lock(void);
+void USB_tx_unlock(void);
+
+// While a batch is open USB_write only queues; EP2 IN is armed when the
+// outermost batch ends, so the packets share as few transfers as possible.
+void USB_batch_begin(void);
+void USB_batch_end(void);
+
+// Nonzero while the host has selected the USB MIDI 2.0 setting: the queues
+// then carry Universal MIDI Packets (whole messages of 1-4 words) instead of
+// USB-MIDI event packets
+uint8_t USB_ump_active(void);
+
+void USB_get_stats(USBMIDIStats* out);
+void USB_reset_stats(void);
 
 #ifdef __cplusplus
 }
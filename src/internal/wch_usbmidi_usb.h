@@ -16,6 +16,7 @@ extern "C" {
 #define USB_DESCR_TYP_ENDP      0x05
 #define USB_DESCR_TYP_CS_INTF   0x24
 #define USB_DESCR_TYP_CS_ENDP   0x25
+#define USB_DESCR_TYP_CS_GR_TRM_BLOCK 0x26  // USB MIDI 2.0 Group Terminal Blocks
 
 #define USB_DEV_CLASS_AUDIO     0x01
 #define USB_SUBCLASS_AUDIOCONTROL 0x01